@@ -0,0 +1,66 @@
+// Throughput of the checksum implementations over buffers of typical log
+// record / snapshot block sizes.
+//
+// usage: ./bench_crc [nbytes...]   (default: 64 1024 65536)
+// output: one line per (implementation, buffer size) in the form of
+//   <implementation> <nbytes> <GB/s>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "../utils.h"
+
+using namespace std;
+
+static double elapsed_sec(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Checksums |buf| repeatedly for about 256MB in total
+template<typename F>
+static void bench(const char* name, const string& buf, F checksum) {
+    size_t iterations = max<size_t>(1, (256 << 20) / buf.size());
+    uint32_t sum = 0;
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; i++) {
+        sum += checksum(buf.data(), buf.size());
+    }
+    double sec = elapsed_sec(start);
+    printf("%-10s %8zu %8.3f\n", name, buf.size(),
+           iterations * buf.size() / sec / 1e9);
+    fflush(stdout);
+    // keep the results alive
+    if (sum == 42)
+        printf("\n");
+}
+
+int main(int argc, char** argv) {
+    vector<size_t> sizes;
+    for (int i = 1; i < argc; i++) {
+        sizes.push_back(atol(argv[i]));
+    }
+    if (sizes.empty())
+        sizes = {64, 1024, 65536};
+
+    printf("sse4.2: %s\n", has_sse42() ? "yes" : "no");
+    for (size_t size : sizes) {
+        string buf(size, '\0');
+        for (size_t i = 0; i < size; i++) {
+            buf[i] = (char)(i * 131 + 7);
+        }
+        bench("crc32", buf, [](const char* p, size_t n) {
+            return crc32(p, n);
+        });
+        bench("slicing8", buf, [](const char* p, size_t n) {
+            return crc32c_slicing8(0, p, n);
+        });
+        if (has_sse42()) {
+            bench("sse4.2", buf, [](const char* p, size_t n) {
+                return crc32c_sse42(0, p, n);
+            });
+        }
+    }
+    return 0;
+}
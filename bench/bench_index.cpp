@@ -0,0 +1,98 @@
+// Point lookup / insert throughput of the primary index implementations
+// compared with the former DataBase::table, a std::map of string keys.
+//
+// usage: ./bench_index [nkeys...]   (default: 1000000)
+// output: one line per (index, nkeys, operation) in the form of
+//   <index> <nkeys> <op> <Mops/s>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../index.h"
+
+using namespace std;
+
+static double elapsed_sec(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static void report(const char* name, size_t n, const char* op, double sec) {
+    printf("%-10s %10zu %-7s %8.3f\n", name, n, op, n / sec / 1e6);
+    fflush(stdout);
+}
+
+// The record of the former table
+struct FormerRecordInfo {
+    int value;
+    int nlock = 0;
+};
+
+static void bench_map(const vector<string>& keys,
+                      const vector<string>& lookups) {
+    map<string, FormerRecordInfo> table;
+    auto start = chrono::steady_clock::now();
+    for (const auto& key : keys) {
+        table[key].value = 1;
+    }
+    report("std::map", keys.size(), "insert", elapsed_sec(start));
+
+    long sum = 0;
+    start = chrono::steady_clock::now();
+    for (const auto& key : lookups) {
+        sum += table.find(key)->second.value;
+    }
+    report("std::map", keys.size(), "lookup", elapsed_sec(start));
+    if (sum != (long) lookups.size())
+        abort();
+}
+
+static void bench_index(const char* name, Index::Type type,
+                        const vector<Key>& keys, const vector<Key>& lookups) {
+    unique_ptr<Index> table = Index::create(type);
+    auto start = chrono::steady_clock::now();
+    for (const auto& key : keys) {
+        table->insert(key)->value = 1;
+    }
+    report(name, keys.size(), "insert", elapsed_sec(start));
+
+    long sum = 0;
+    start = chrono::steady_clock::now();
+    for (const auto& key : lookups) {
+        sum += table->find(key)->value.as_int();
+    }
+    report(name, keys.size(), "lookup", elapsed_sec(start));
+    if (sum != (long) lookups.size())
+        abort();
+}
+
+int main(int argc, char** argv) {
+    vector<size_t> sizes;
+    for (int i = 1; i < argc; i++) {
+        sizes.push_back(strtoull(argv[i], nullptr, 10));
+    }
+    if (sizes.empty())
+        sizes.push_back(1000000);
+
+    mt19937_64 rng(42);
+    for (size_t n : sizes) {
+        // keys are inserted in random order
+        vector<Key> keys(n);
+        for (size_t i = 0; i < n; i++) {
+            keys[i] = "key" + to_string(i);
+        }
+        shuffle(keys.begin(), keys.end(), rng);
+        vector<Key> lookups = keys;
+        shuffle(lookups.begin(), lookups.end(), rng);
+
+        bench_map(vector<string>(keys.begin(), keys.end()),
+                  vector<string>(lookups.begin(), lookups.end()));
+        bench_index("bplustree", Index::BPlusTree, keys, lookups);
+        bench_index("hash", Index::Hash, keys, lookups);
+    }
+    return 0;
+}
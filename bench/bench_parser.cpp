@@ -0,0 +1,153 @@
+// Throughput of the query parser compared with the former one, which split
+// a line into a vector<string> with words() before matching the command.
+//
+// usage: ./bench_parser [nqueries]   (default: 1000000)
+// output: one line per parser in the form of
+//   <parser> <nqueries> <Mqueries/s>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../utils.h"
+
+using namespace std;
+
+static double elapsed_sec(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static void report(const char* name, size_t n, double sec) {
+    printf("%-14s %10zu %8.3f\n", name, n, n / sec / 1e6);
+    fflush(stdout);
+}
+
+// ------------------------------ former parser -------------------------------
+
+static vector<string> words(const string &str) {
+    vector<string> v;
+    int start_pos = 0;
+    bool in_word = false;
+
+    for (size_t i = 0; i < str.size(); i++) {
+        if (str[i] == ' ' || str[i] == '\n' || str[i] == '\t') {
+            if (!in_word)
+                continue;
+            in_word = false;
+            v.push_back(str.substr(start_pos, i - start_pos));
+            continue;
+        }
+
+        if (in_word)
+            continue;
+
+        in_word = true;
+        start_pos = i;
+    }
+
+    if (in_word) {
+        v.push_back(str.substr(start_pos, str.size() - start_pos));
+    }
+
+    return v;
+}
+
+struct OldQuery {
+    Query::Commands cmd = Query::Unknown;
+    string arg1 = "";
+    int arg2 = 0;
+};
+
+static OldQuery old_parse_query(string input) {
+    OldQuery q = OldQuery();
+    vector<string> fields = words(input);
+
+    if (fields[0] == "set") {
+        q.cmd = Query::Set;
+        q.arg1 = fields[1];
+        q.arg2 = stoi(fields[2]);
+    } else if (fields[0] == "get") {
+        q.cmd = Query::Get;
+        q.arg1 = fields[1];
+    } else if (fields[0] == "del") {
+        q.cmd = Query::Del;
+        q.arg1 = fields[1];
+    } else if (fields[0] == "begin") {
+        q.cmd = Query::Begin;
+    } else if (fields[0] == "commit") {
+        q.cmd = Query::Commit;
+    } else if (fields[0] == "abort") {
+        q.cmd = Query::Abort;
+    } else if (fields[0] == "keys") {
+        q.cmd = Query::Keys;
+    }
+    return q;
+}
+
+// ----------------------------------------------------------------------------
+
+int main(int argc, char** argv) {
+    size_t n = argc > 1 ? atol(argv[1]) : 1000000;
+
+    // a pipelined stream of typical commands
+    mt19937 rng(0);
+    string input;
+    for (size_t i = 0; i < n; i++) {
+        string key = "user" + to_string(rng() % 100000);
+        switch (rng() % 4) {
+            case 0:
+                input += "set " + key + " " + to_string(rng() % 1000000) + "\n";
+                break;
+            case 1:
+            case 2:
+                input += "get " + key + "\n";
+                break;
+            default:
+                input += (i % 2 ? "begin\n" : "commit\n");
+                break;
+        }
+    }
+
+    long sum = 0;
+    auto start = chrono::steady_clock::now();
+    size_t pos = 0;
+    while (pos < input.size()) {
+        size_t end = input.find('\n', pos);
+        OldQuery q = old_parse_query(input.substr(pos, end - pos));
+        sum += q.cmd + q.arg2 + q.arg1.size();
+        pos = end + 1;
+    }
+    report("words", n, elapsed_sec(start));
+
+    start = chrono::steady_clock::now();
+    string_view rest = input;
+    while (!rest.empty()) {
+        size_t end = rest.find('\n');
+        Query q = parse_query(rest.substr(0, end));
+        sum += q.cmd + q.arg2 + q.arg1.size();
+        rest.remove_prefix(end + 1);
+    }
+    report("parse_query", n, elapsed_sec(start));
+
+    // batches of pipelined commands as the server receives them
+    const size_t kChunk = 4096;
+    vector<Query> queries;
+    start = chrono::steady_clock::now();
+    rest = input;
+    while (!rest.empty()) {
+        queries.clear();
+        size_t consumed = parse_queries(rest.substr(0, kChunk), &queries);
+        for (const auto& q : queries) {
+            sum += q.cmd + q.arg2 + q.arg1.size();
+        }
+        rest.remove_prefix(consumed);
+    }
+    report("parse_queries", n, elapsed_sec(start));
+
+    // keep the results alive
+    if (sum == 42)
+        printf("\n");
+    return 0;
+}
@@ -0,0 +1,152 @@
+// 1. Throughput of short transactions with the worker pool of the
+//    Concurrent scheduler compared with a thread per transaction
+//    (nworkers = 0). Every transaction reads one key and commits, so no
+//    log is written.
+// 2. Cost of an operation (a snapshot read followed by the switch to the
+//    next transaction) in the RoundRobin and Coroutine schedulers, and of
+//    the same read without any scheduler as the baseline.
+//
+// usage: ./bench_scheduler [ntxs...]   (default: 1000 10000)
+// output: one line per (executor, ntxs) in the form of
+//   <executor> <ntxs> <tx/s>
+// followed by one line per interleaving scheduler (and the baseline) in
+// the form of
+//   <scheduler> <ns/op>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../database.h"
+
+using namespace std;
+
+static const string dumpfilename = ".bench_scheduler_dump";
+static const string logfilename = ".bench_scheduler_log";
+static const int kNumKeys = 1000;
+
+static double elapsed_sec(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static void populate(Scheduler& scheduler) {
+    scheduler.add_tx([](Transaction* tx) {
+        tx->begin();
+        for (int i = 0; i < kNumKeys; i++) {
+            tx->set("key" + to_string(i), i);
+        }
+        tx->commit();
+    });
+    scheduler.start();
+}
+
+static DBOptions options() {
+    remove(dumpfilename.c_str());
+    remove(logfilename.c_str());
+    DBOptions options;
+    options.checkpoint_interval = chrono::milliseconds(0);
+    return options;
+}
+
+static void bench(const char* name, size_t nworkers, size_t ntxs) {
+    Scheduler scheduler = Scheduler(Scheduler::Concurrent, nworkers);
+    DataBase db = DataBase(&scheduler, dumpfilename, logfilename, options());
+    populate(scheduler);
+
+    for (size_t n = 0; n < ntxs; n++) {
+        Key key = "key" + to_string(n % kNumKeys);
+        scheduler.add_tx([key](Transaction* tx) {
+            do {
+                tx->begin();
+                tx->get(key);
+            } while (!tx->commit());
+        });
+    }
+    auto start = chrono::steady_clock::now();
+    scheduler.start();
+    printf("%-14s %8zu %12.0f\n", name, ntxs, ntxs / elapsed_sec(start));
+    fflush(stdout);
+}
+
+static const int kNumInterleavedTxs = 8;
+static const int kNumOpsPerTx = 10000;
+
+static void bench_round_robin() {
+    Scheduler scheduler = Scheduler(Scheduler::RoundRobin);
+    DataBase db = DataBase(&scheduler, dumpfilename, logfilename, options());
+    populate(scheduler);
+
+    for (int n = 0; n < kNumInterleavedTxs; n++) {
+        scheduler.add_tx([](Transaction* tx) {
+            tx->begin_read_only();
+            for (int i = 0; i < kNumOpsPerTx; i++) {
+                tx->get("key" + to_string(i % kNumKeys));
+            }
+            tx->commit();
+        });
+    }
+    auto start = chrono::steady_clock::now();
+    scheduler.start();
+    printf("%-14s %12.1f\n", "roundrobin",
+           elapsed_sec(start) * 1e9 / kNumInterleavedTxs / kNumOpsPerTx);
+    fflush(stdout);
+}
+
+static void bench_coroutine() {
+    Scheduler scheduler = Scheduler(Scheduler::Coroutine);
+    DataBase db = DataBase(&scheduler, dumpfilename, logfilename, options());
+    scheduler.add_coroutine_tx([](Transaction* tx) -> TxCoroutine {
+        co_await tx->async_begin();
+        for (int i = 0; i < kNumKeys; i++) {
+            co_await tx->async_set("key" + to_string(i), i);
+        }
+        co_await tx->async_commit();
+    });
+    scheduler.start();
+
+    for (int n = 0; n < kNumInterleavedTxs; n++) {
+        scheduler.add_coroutine_tx([](Transaction* tx) -> TxCoroutine {
+            co_await tx->async_begin_read_only();
+            for (int i = 0; i < kNumOpsPerTx; i++) {
+                co_await tx->async_get("key" + to_string(i % kNumKeys));
+            }
+            co_await tx->async_commit();
+        });
+    }
+    auto start = chrono::steady_clock::now();
+    scheduler.start();
+    printf("%-14s %12.1f\n", "coroutine",
+           elapsed_sec(start) * 1e9 / kNumInterleavedTxs / kNumOpsPerTx);
+
+    start = chrono::steady_clock::now();
+    for (int n = 0; n < kNumInterleavedTxs; n++) {
+        for (int i = 0; i < kNumOpsPerTx; i++) {
+            db.read_snapshot("key" + to_string(i % kNumKeys), 1);
+        }
+    }
+    printf("%-14s %12.1f\n", "baseline",
+           elapsed_sec(start) * 1e9 / kNumInterleavedTxs / kNumOpsPerTx);
+    fflush(stdout);
+}
+
+int main(int argc, char** argv) {
+    vector<size_t> sizes;
+    for (int i = 1; i < argc; i++) {
+        sizes.push_back(strtoull(argv[i], nullptr, 10));
+    }
+    if (sizes.empty())
+        sizes = {1000, 10000};
+
+    size_t ncores = max(1u, thread::hardware_concurrency());
+    for (size_t n : sizes) {
+        bench("thread-per-tx", 0, n);
+        bench("pool", ncores, n);
+    }
+    bench_round_robin();
+    bench_coroutine();
+    remove(dumpfilename.c_str());
+    remove(logfilename.c_str());
+    return 0;
+}
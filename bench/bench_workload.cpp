@@ -0,0 +1,522 @@
+// Throughput, abort rate and latency of transactional workloads run with
+// the Concurrent scheduler (a transaction is retried until it commits):
+//   ycsb-a .. ycsb-f : YCSB core workloads with Zipfian skew, each
+//                      transaction doing --ops operations
+//                        a: 50% read, 50% update
+//                        b: 95% read, 5% update
+//                        c: 100% read
+//                        d: 95% read of the latest keys, 5% insert
+//                        e: 95% scan of up to 100 keys, 5% insert
+//                        f: 50% read, 50% read-modify-write
+//   tpcc             : a simplified TPC-C mix of NewOrder (read the
+//                      warehouse, bump the order ID of the district, read
+//                      the customer, update the stock of 5-15 items and
+//                      insert the order lines) and Payment (add to the YTD
+//                      of the warehouse and the district and to the
+//                      balance of the customer), half and half
+//   scan             : 90% read-only transactions scanning 100 keys (from
+//                      a snapshot), 10% updates of --ops keys
+// The operations of every transaction are drawn before the run, so the
+// random generators are not measured.
+//
+// usage: ./bench_workload [--option=value ...]
+//   --workload=a,b,c,d,e,f,tpcc,scan  (default: all of them)
+//   --protocol=2pl,occ,sgt            (default: all of them)
+//   --index=btree|hash                (default: btree; hash can't scan
+//                                      in order, so e and scan are slow)
+//   --records=10000 --txs=10000 --ops=4 --theta=0.99 --value-bytes=100
+//   --warehouses=4 --workers=<hardware threads> --seed=1
+// output: a header line starting with '#', followed by one line per
+// (workload, protocol) in the form of
+//   <workload> <protocol> <index> <txs> <tx/s> <abort rate> <p50 us>
+//   <p99 us> <p999 us>
+// where the abort rate is aborted attempts / all attempts, and a latency
+// spans from the first attempt of a transaction to its commit.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../database.h"
+
+using namespace std;
+
+static const string dumpfilename = ".bench_workload_dump";
+static const string logfilename = ".bench_workload_log";
+
+// (records loaded per transaction)
+static const size_t kLoadBatch = 1000;
+static const size_t kMaxScanLength = 100;
+
+struct Config {
+    vector<string> workloads = {"a", "b", "c", "d", "e", "f", "tpcc", "scan"};
+    vector<string> protocols = {"2pl", "occ", "sgt"};
+    string index = "btree";
+    size_t records = 10000;
+    size_t txs = 10000;
+    size_t ops = 4;
+    double theta = 0.99;
+    size_t value_bytes = 100;
+    int warehouses = 4;
+    size_t workers = max(1u, thread::hardware_concurrency());
+    uint64_t seed = 1;
+};
+
+static vector<string> split(const string& s) {
+    vector<string> v;
+    size_t begin = 0;
+    while (begin <= s.size()) {
+        size_t end = s.find(',', begin);
+        if (end == string::npos)
+            end = s.size();
+        v.push_back(s.substr(begin, end - begin));
+        begin = end + 1;
+    }
+    return v;
+}
+
+static Config parse_args(int argc, char** argv) {
+    Config config;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        size_t eq = arg.find('=');
+        if (arg.rfind("--", 0) != 0 || eq == string::npos) {
+            fprintf(stderr, "usage: %s [--option=value ...]\n", argv[0]);
+            exit(1);
+        }
+        string name = arg.substr(2, eq - 2);
+        string value = arg.substr(eq + 1);
+        if (name == "workload")
+            config.workloads = split(value);
+        else if (name == "protocol")
+            config.protocols = split(value);
+        else if (name == "index")
+            config.index = value;
+        else if (name == "records")
+            config.records = strtoull(value.c_str(), nullptr, 10);
+        else if (name == "txs")
+            config.txs = strtoull(value.c_str(), nullptr, 10);
+        else if (name == "ops")
+            config.ops = strtoull(value.c_str(), nullptr, 10);
+        else if (name == "theta")
+            config.theta = strtod(value.c_str(), nullptr);
+        else if (name == "value-bytes")
+            config.value_bytes = strtoull(value.c_str(), nullptr, 10);
+        else if (name == "warehouses")
+            config.warehouses = atoi(value.c_str());
+        else if (name == "workers")
+            config.workers = strtoull(value.c_str(), nullptr, 10);
+        else if (name == "seed")
+            config.seed = strtoull(value.c_str(), nullptr, 10);
+        else {
+            fprintf(stderr, "unknown option: %s\n", arg.c_str());
+            exit(1);
+        }
+    }
+    if (config.records == 0 || config.warehouses <= 0) {
+        fprintf(stderr, "--records and --warehouses must be positive\n");
+        exit(1);
+    }
+    return config;
+}
+
+// Zipfian distribution over [0, n) where 0 is the most popular, computed
+// as in YCSB (Gray et al., "Quickly Generating Billion-Record Synthetic
+// Databases"). theta = 0 is uniform.
+class Zipfian {
+    public:
+        Zipfian(uint64_t n, double theta) : n_(n), theta_(theta) {
+            if (theta_ == 0)
+                return;
+            for (uint64_t i = 1; i <= n_; i++) {
+                zetan_ += 1 / pow((double) i, theta_);
+            }
+            double zeta2 = 1 + pow(0.5, theta_);
+            alpha_ = 1 / (1 - theta_);
+            eta_ = (1 - pow(2.0 / n_, 1 - theta_)) / (1 - zeta2 / zetan_);
+        }
+
+        uint64_t next(mt19937_64& rng) const {
+            double u = uniform_real_distribution<double>(0, 1)(rng);
+            if (theta_ == 0)
+                return min<uint64_t>(u * n_, n_ - 1);
+            double uz = u * zetan_;
+            if (uz < 1)
+                return 0;
+            if (uz < 1 + pow(0.5, theta_))
+                return 1;
+            return min<uint64_t>(n_ * pow(eta_ * u - eta_ + 1, alpha_), n_ - 1);
+        }
+
+    private:
+        uint64_t n_;
+        double theta_;
+        double zetan_ = 0;
+        double alpha_ = 0;
+        double eta_ = 0;
+};
+
+// Spreads the popular ranks of Zipfian over the key space (FNV-1a)
+static uint64_t scramble(uint64_t rank, uint64_t n) {
+    uint64_t h = 0xCBF29CE484222325ull;
+    for (int i = 0; i < 8; i++) {
+        h = (h ^ ((rank >> (i * 8)) & 0xFF)) * 0x100000001B3ull;
+    }
+    return h % n;
+}
+
+static Key user_key(uint64_t i) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "user%010llu", (unsigned long long) i);
+    return Key(buf);
+}
+
+// Outcome of a run, filled by the transactions
+struct Stats {
+    atomic<size_t> aborts = 0;
+    vector<double> latencies;  // seconds, one per transaction
+
+    explicit Stats(size_t ntxs) : latencies(ntxs) {}
+};
+
+// Runs |body| until it commits and records the latency of transaction |n|
+static Transaction::Logic retry(Stats* stats, size_t n,
+                                function<void(Transaction*)> body) {
+    return [stats, n, body = move(body)](Transaction* tx) {
+        auto start = chrono::steady_clock::now();
+        while (true) {
+            body(tx);
+            if (tx->committed())
+                break;
+            stats->aborts++;
+        }
+        stats->latencies[n] = chrono::duration<double>(
+                chrono::steady_clock::now() - start).count();
+    };
+}
+
+// Loads the |nkeys| records made by |record|, kLoadBatch per transaction
+static void load(Scheduler& scheduler, size_t nkeys,
+                 const function<pair<Key, Value>(size_t)>& record) {
+    for (size_t begin = 0; begin < nkeys; begin += kLoadBatch) {
+        size_t end = min(nkeys, begin + kLoadBatch);
+        scheduler.add_tx([begin, end, &record](Transaction* tx) {
+            do {
+                tx->begin();
+                for (size_t i = begin; i < end; i++) {
+                    auto [key, value] = record(i);
+                    tx->set(key, value);
+                }
+            } while (!tx->commit());
+        });
+    }
+    scheduler.start();
+}
+
+// --------------------------------- YCSB ---------------------------------
+
+struct YcsbOp {
+    enum Type {
+        Read,
+        Update,
+        Insert,
+        Scan,
+        ReadModifyWrite,
+    };
+    Type type;
+    uint64_t key;
+    size_t length = 0;  // of Scan
+};
+
+static void run_ycsb_op(Transaction* tx, const YcsbOp& op, const Value& value) {
+    switch (op.type) {
+        case YcsbOp::Read:
+            tx->get(user_key(op.key));
+            break;
+        case YcsbOp::Update:
+        case YcsbOp::Insert:
+            tx->set(user_key(op.key), value);
+            break;
+        case YcsbOp::Scan:
+            for (auto it = tx->scan(user_key(op.key), nullopt, op.length);
+                 it.valid(); it.next()) {
+            }
+            break;
+        case YcsbOp::ReadModifyWrite: {
+            Key key = user_key(op.key);
+            tx->get(key);
+            tx->set(key, value);
+            break;
+        }
+    }
+}
+
+static void plan_ycsb(const Config& config, char workload, Stats* stats,
+                      Scheduler& scheduler) {
+    mt19937_64 rng(config.seed);
+    Zipfian zipf(config.records, config.theta);
+    uniform_real_distribution<double> coin(0, 1);
+    uniform_int_distribution<size_t> scan_length(1, kMaxScanLength);
+    uint64_t nkeys = config.records;  // including the planned inserts
+    auto value = make_shared<Value>(string(config.value_bytes, 'v'));
+
+    for (size_t n = 0; n < config.txs; n++) {
+        vector<YcsbOp> ops;
+        for (size_t i = 0; i < config.ops; i++) {
+            double p = coin(rng);
+            uint64_t key = scramble(zipf.next(rng), config.records);
+            switch (workload) {
+                case 'a':
+                    ops.push_back({p < 0.5 ? YcsbOp::Read : YcsbOp::Update, key});
+                    break;
+                case 'b':
+                    ops.push_back({p < 0.95 ? YcsbOp::Read : YcsbOp::Update, key});
+                    break;
+                case 'c':
+                    ops.push_back({YcsbOp::Read, key});
+                    break;
+                case 'd':
+                    if (p < 0.95) {
+                        // the latest keys are the most popular
+                        uint64_t rank = zipf.next(rng);
+                        ops.push_back({YcsbOp::Read, nkeys - 1 - min(rank, nkeys - 1)});
+                    } else {
+                        ops.push_back({YcsbOp::Insert, nkeys++});
+                    }
+                    break;
+                case 'e':
+                    if (p < 0.95)
+                        ops.push_back({YcsbOp::Scan, key, scan_length(rng)});
+                    else
+                        ops.push_back({YcsbOp::Insert, nkeys++});
+                    break;
+                case 'f':
+                    ops.push_back({p < 0.5 ? YcsbOp::Read
+                                           : YcsbOp::ReadModifyWrite, key});
+                    break;
+            }
+        }
+        scheduler.add_tx(retry(stats, n, [ops = move(ops), value](Transaction* tx) {
+            tx->begin();
+            for (const auto& op : ops) {
+                run_ycsb_op(tx, op, *value);
+            }
+            tx->commit();
+        }));
+    }
+}
+
+static void load_ycsb(const Config& config, Scheduler& scheduler) {
+    Value value(string(config.value_bytes, 'v'));
+    load(scheduler, config.records, [&value](size_t i) {
+        return make_pair(user_key(i), value);
+    });
+}
+
+// Read-only scans from snapshots among updates
+static void plan_scan(const Config& config, Stats* stats, Scheduler& scheduler) {
+    mt19937_64 rng(config.seed);
+    Zipfian zipf(config.records, config.theta);
+    uniform_real_distribution<double> coin(0, 1);
+    auto value = make_shared<Value>(string(config.value_bytes, 'w'));
+
+    for (size_t n = 0; n < config.txs; n++) {
+        if (coin(rng) < 0.9) {
+            uint64_t begin = scramble(zipf.next(rng), config.records);
+            scheduler.add_tx(retry(stats, n, [begin](Transaction* tx) {
+                tx->begin_read_only();
+                for (auto it = tx->scan(user_key(begin), nullopt, kMaxScanLength);
+                     it.valid(); it.next()) {
+                }
+                tx->commit();
+            }));
+            continue;
+        }
+        vector<uint64_t> keys;
+        for (size_t i = 0; i < config.ops; i++) {
+            keys.push_back(scramble(zipf.next(rng), config.records));
+        }
+        scheduler.add_tx(retry(stats, n, [keys = move(keys), value](Transaction* tx) {
+            tx->begin();
+            for (uint64_t key : keys) {
+                tx->set(user_key(key), *value);
+            }
+            tx->commit();
+        }));
+    }
+}
+
+// --------------------------------- TPC-C ---------------------------------
+
+static const int kDistricts = 10;
+static const int kCustomers = 300;  // per district
+static const int kItems = 10000;
+
+static Key tpcc_key(const char* table, int a, int b = -1, int c = -1, int d = -1) {
+    char buf[64];
+    int len = snprintf(buf, sizeof(buf), "%s%d", table, a);
+    for (int x : {b, c, d}) {
+        if (x >= 0)
+            len += snprintf(buf + len, sizeof(buf) - len, ".%d", x);
+    }
+    return Key(string_view(buf, len));
+}
+
+static void load_tpcc(const Config& config, Scheduler& scheduler) {
+    // item, warehouse, district (YTD and next order ID), customer, stock
+    vector<pair<Key, Value>> records;
+    for (int i = 0; i < kItems; i++) {
+        records.emplace_back(tpcc_key("i", i), 1 + i % 100);
+    }
+    for (int w = 0; w < config.warehouses; w++) {
+        records.emplace_back(tpcc_key("w", w), 0);
+        for (int d = 0; d < kDistricts; d++) {
+            records.emplace_back(tpcc_key("d", w, d), 0);
+            records.emplace_back(tpcc_key("dn", w, d), 1);
+            for (int c = 0; c < kCustomers; c++) {
+                records.emplace_back(tpcc_key("c", w, d, c), 0);
+            }
+        }
+        for (int i = 0; i < kItems; i++) {
+            records.emplace_back(tpcc_key("s", w, i), 100);
+        }
+    }
+    load(scheduler, records.size(), [&records](size_t i) { return records[i]; });
+}
+
+static void new_order(Transaction* tx, int w, int d, int c,
+                      const vector<int>& items) {
+    tx->begin();
+    tx->get(tpcc_key("w", w));
+    Key next_key = tpcc_key("dn", w, d);
+    int o = tx->get(next_key).value_or(0).as_int();
+    tx->set(next_key, o + 1);
+    tx->get(tpcc_key("c", w, d, c));
+    int total = 0;
+    for (size_t l = 0; l < items.size(); l++) {
+        int price = tx->get(tpcc_key("i", items[l])).value_or(0).as_int();
+        Key stock_key = tpcc_key("s", w, items[l]);
+        int quantity = tx->get(stock_key).value_or(0).as_int();
+        tx->set(stock_key, quantity > 10 ? quantity - 1 : quantity + 90);
+        tx->set(tpcc_key("ol", w, d, o, l), items[l]);
+        total += price;
+    }
+    tx->set(tpcc_key("o", w, d, o), total);
+    tx->commit();
+}
+
+static void payment(Transaction* tx, int w, int d, int c, int amount) {
+    tx->begin();
+    for (const Key& key : {tpcc_key("w", w), tpcc_key("d", w, d),
+                           tpcc_key("c", w, d, c)}) {
+        int x = tx->get(key).value_or(0).as_int();
+        tx->set(key, x + amount);
+    }
+    tx->commit();
+}
+
+static void plan_tpcc(const Config& config, Stats* stats, Scheduler& scheduler) {
+    mt19937_64 rng(config.seed);
+    uniform_int_distribution<int> warehouse(0, config.warehouses - 1);
+    uniform_int_distribution<int> district(0, kDistricts - 1);
+    uniform_int_distribution<int> customer(0, kCustomers - 1);
+    uniform_int_distribution<int> item(0, kItems - 1);
+    uniform_int_distribution<int> nitems(5, 15);
+    uniform_int_distribution<int> amount(1, 5000);
+
+    for (size_t n = 0; n < config.txs; n++) {
+        int w = warehouse(rng), d = district(rng), c = customer(rng);
+        if (n % 2 == 0) {
+            vector<int> items(nitems(rng));
+            for (int& i : items) {
+                i = item(rng);
+            }
+            scheduler.add_tx(retry(stats, n, [=](Transaction* tx) {
+                new_order(tx, w, d, c, items);
+            }));
+        } else {
+            int a = amount(rng);
+            scheduler.add_tx(retry(stats, n, [=](Transaction* tx) {
+                payment(tx, w, d, c, a);
+            }));
+        }
+    }
+}
+
+// ---------------------------------- main ----------------------------------
+
+static void run(const Config& config, const string& workload,
+                const string& protocol) {
+    remove(dumpfilename.c_str());
+    remove(logfilename.c_str());
+    DBOptions options;
+    options.checkpoint_interval = chrono::milliseconds(0);
+    options.index = config.index == "hash" ? Index::Hash : Index::BPlusTree;
+    if (protocol == "2pl") {
+        options.protocol = TwoPhaseLocking;
+    } else if (protocol == "occ") {
+        options.protocol = Optimistic;
+    } else if (protocol == "sgt") {
+        options.protocol = SerializationGraph;
+    } else {
+        fprintf(stderr, "unknown protocol: %s\n", protocol.c_str());
+        exit(1);
+    }
+
+    Scheduler scheduler = Scheduler(Scheduler::Concurrent, config.workers);
+    DataBase db = DataBase(&scheduler, dumpfilename, logfilename, options);
+    Stats stats(config.txs);
+    if (workload == "tpcc") {
+        load_tpcc(config, scheduler);
+        plan_tpcc(config, &stats, scheduler);
+    } else if (workload == "scan") {
+        load_ycsb(config, scheduler);
+        plan_scan(config, &stats, scheduler);
+    } else if (workload.size() == 1 && workload[0] >= 'a' && workload[0] <= 'f') {
+        load_ycsb(config, scheduler);
+        plan_ycsb(config, workload[0], &stats, scheduler);
+    } else {
+        fprintf(stderr, "unknown workload: %s\n", workload.c_str());
+        exit(1);
+    }
+
+    auto start = chrono::steady_clock::now();
+    scheduler.start();
+    double sec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    vector<double>& lat = stats.latencies;
+    sort(lat.begin(), lat.end());
+    auto percentile = [&lat](double p) {
+        return lat.empty() ? 0 : lat[min(lat.size() - 1, (size_t) (lat.size() * p))] * 1e6;
+    };
+    size_t aborts = stats.aborts;
+    string name = (workload.size() == 1 ? "ycsb-" : "") + workload;
+    printf("%-8s %-4s %-6s %8zu %12.0f %8.4f %10.1f %10.1f %10.1f\n",
+           name.c_str(), protocol.c_str(), config.index.c_str(), config.txs,
+           config.txs / sec, (double) aborts / (aborts + config.txs),
+           percentile(0.5), percentile(0.99), percentile(0.999));
+    fflush(stdout);
+}
+
+int main(int argc, char** argv) {
+    Config config = parse_args(argc, argv);
+    printf("# workload protocol index txs tx/s abort_rate p50_us p99_us p999_us\n");
+    for (const string& workload : config.workloads) {
+        for (const string& protocol : config.protocols) {
+            run(config, workload, protocol);
+        }
+    }
+    remove(dumpfilename.c_str());
+    remove(logfilename.c_str());
+    remove((logfilename + ".old").c_str());
+    return 0;
+}
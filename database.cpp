@@ -1,25 +1,91 @@
 #include "database.h"
 
+#include <algorithm>
+#include <cstddef>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <mutex>
 #include <set>
+#include <shared_mutex>
+#include <sstream>
+#include <string_view>
+#include <unordered_map>
 
 #include <fcntl.h>  // open
+#include <sys/mman.h>  // mmap
+#include <sys/stat.h>  // fstat
 #include <unistd.h>  // close
 #include <stdio.h>
 
 using namespace std;
 
+#ifdef NLOG  // for benchmarks
+#define LOG
+#define TXLOG
+#else
 #define LOG   printf("[LOG]          %s::%d\n", __FUNCTION__, __LINE__);
 #define TXLOG printf("[LOG](txid: %d) %s::%d\n", id_, __FUNCTION__, __LINE__);
+#endif
 #define UNREACHABLE \
     fprintf(stderr, "Shouldn't reach here: %s::%d\n", __FUNCTION__, __LINE__);
 
-// -------------------------------- Transaction --------------------------------
+template<typename T>
+static void put(string& buf, T v) {
+    buf.append(reinterpret_cast<const char*>(&v), sizeof(T));
+}
+
+template<typename T>
+static T get(const char* p) {
+    T v;
+    memcpy(&v, p, sizeof(T));
+    return v;
+}
+
+// Entry of a key and its value in the log and the snapshot:
+//   [keylen: u32] [value: i32] [key: keylen bytes]
+// or, for a string value (flagged by the top bit of keylen),
+//   [keylen | kBytesFlag: u32] [length: u32] [key] [value: length bytes]
+static const uint32_t kBytesFlag = 1u << 31;
+static const size_t kEntryHeaderSize = sizeof(uint32_t) + sizeof(int32_t);
+
+static void put_entry(string& buf, const Key& key, const Value& value) {
+    if (value.is_int()) {
+        put<uint32_t>(buf, key.size());
+        put<int32_t>(buf, value.as_int());
+        buf.append(key);
+        return;
+    }
+    string_view bytes = value.as_bytes();
+    put<uint32_t>(buf, key.size() | kBytesFlag);
+    put<uint32_t>(buf, bytes.size());
+    buf.append(key);
+    buf.append(bytes);
+}
+
+// Bytes of the entry at |p| (only its header is read)
+static size_t entry_size(const char* p) {
+    uint32_t keylen = get<uint32_t>(p);
+    size_t size = kEntryHeaderSize + (keylen & ~kBytesFlag);
+    if (keylen & kBytesFlag)
+        size += get<uint32_t>(p + sizeof(uint32_t));
+    return size;
+}
+
+static string_view entry_key(const char* p) {
+    return string_view(p + kEntryHeaderSize, get<uint32_t>(p) & ~kBytesFlag);
+}
+
+static Value entry_value(const char* p) {
+    uint32_t keylen = get<uint32_t>(p);
+    if (!(keylen & kBytesFlag))
+        return get<int32_t>(p + sizeof(uint32_t));
+    return string_view(p + kEntryHeaderSize + (keylen & ~kBytesFlag),
+                       get<uint32_t>(p + sizeof(uint32_t)));
+}
 
-mutex giant_mtx_;
+// -------------------------------- Transaction --------------------------------
 
 Transaction::Transaction(
         int id, Transaction::Logic logic, DataBase* db, Scheduler* scheduler)
@@ -30,147 +96,672 @@ Transaction::Transaction(
 
 void Transaction::begin() {
     TXLOG;
-    unique_lock<mutex> lock(giant_mtx_);
-    lock_ = move(lock);
+    killed_ = false;
+    committed_ = false;
+    // (a retrying transaction keeps the CPU since the last finish())
+    if (scheduler_->mode() == Scheduler::RoundRobin && !lock_.owns_lock()) {
+        unique_lock<mutex> lock(scheduler_->turn_mutex());
+        lock_ = move(lock);
+    }
+    snapshot_ts_ = db_->register_tx(&snapshot_slot_);
     wait();
 }
 
-void Transaction::commit() {
+void Transaction::begin_read_only() {
+    read_only_ = true;
+    begin();
+}
+
+bool Transaction::commit() {
+    return commit(nullptr);
+}
+
+bool Transaction::commit(uint64_t* ticket) {
     TXLOG;
-    db_->apply_tx(this);
-    for (const auto& key : write_log_) {
-        scheduler_->log(id_, key, Write);
-    }
+    // (a transaction without writes waits for the ones it may have read)
+    if (ticket)
+        *ticket = db_->last_ticket();
+    // (apply_tx() reports the writes to the scheduler)
+    committed_ = read_only_ || (!killed_ && db_->apply_tx(this, ticket));
+    if (!killed_)  // (die() has reported the abort)
+        scheduler_->log_finish(id_, committed_);
     finish();
+    return committed_;
 }
 
 void Transaction::abort() {
     TXLOG;
+    if (!killed_)
+        scheduler_->log_finish(id_, false);
     finish();
 }
 
-bool Transaction::set(Key key, int val) {
+bool Transaction::set(const Key& key, const Value& val) {
     TXLOG;
-
-    if (db_->table.count(key) > 0) {
-        while (!db_->get_lock(this, key, Write)) {
-            wait();
-        }
+    while (!try_set(key, val)) {
+        backoff();
     }
-    write_log_.push_back(key);
-    write_set[key] = make_pair(New, val);
     wait();
     return false;
 }
 
-optional<int> Transaction::get(Key key) {
+optional<Value> Transaction::get(const Key& key) {
     TXLOG;
-
-    if (!has_key(key)) {
-        wait();
-        return nullopt;
+    optional<Value> value;
+    while (!try_get(key, &value)) {
+        backoff();
     }
+    wait();
+    return value;
+}
 
-    // read from the write set
-    if (write_set.count(key) > 0) {
-        if (write_set[key].first != New) {
-            UNREACHABLE;
-            return nullopt;
-        }
-        // db_->get_lock(this, key, DataBase::Read);
-        wait();
-        scheduler_->log(id_, key, Read);
-        return write_set[key].second;
+bool Transaction::del(const Key& key) {
+    TXLOG;
+    bool absent;
+    while (!try_del(key, &absent)) {
+        backoff();
     }
+    wait();
+    return absent;
+}
 
-    while (!db_->get_lock(this, key, Read)) {
-        wait();
-    }
-    lock_set.push_back(key);
+vector<string> Transaction::keys() {
+    TXLOG;
+    vector<string> v = list_keys();
     wait();
-    scheduler_->log(id_, key, Read);
-    return db_->table[key].value;
+    return v;
 }
 
-bool Transaction::del(Key key) {
+Value Transaction::get_until_success(const Key& key) {
     TXLOG;
+    // (the absence isn't locked, or the insert waited for could never come)
+    optional<Value> tmp;
+    while (!try_get(key, &tmp, false) || (!tmp.has_value() && !killed_)) {
+        backoff();
+    }
+    wait();
+    return tmp.value_or(0);
+}
 
-    if (!has_key(key)) {
+bool Transaction::try_set(const Key& key, const Value& val) {
+    if (read_only_) {
+        UNREACHABLE;
         return true;
     }
-    while (!db_->get_lock(this, key, Write)) {
-        wait();
+    if (killed_)
+        return true;
+
+    // OCC and SGT buffer writes without locking until commit
+    if (!lock_free()) {
+        if (db_->has_key(key)) {
+            if (try_lock(key, Write) == MustWait)
+                return false;
+        } else {
+            // an insert must not slip into a range scanned by others
+            LockResult result = db_->lock_insert(this, key);
+            if (result == MustWait)
+                return false;
+            if (result == MustDie)
+                die();
+            // inserted by another meanwhile: lock the record on the retry
+            else if (db_->has_key(key))
+                return false;
+        }
     }
-    write_log_.push_back(key);
-    write_set[key] = make_pair(Delete, 0);
-    wait();
-    return false;
+    if (killed_)
+        return true;
+    write_set.insert_or_assign(key, make_pair(New, val));
+    return true;
 }
 
-vector<string> Transaction::keys() {
-    TXLOG;
+bool Transaction::try_get(const Key& key, optional<Value>* value,
+                          bool lock_absence) {
+    *value = nullopt;
+
+    // Snapshot reads are not logged since they don't conflict with writers
+    if (read_only_) {
+        *value = db_->read_snapshot(key, snapshot_ts_);
+        return true;
+    }
+
+    if (killed_)
+        return true;
+
+    if (lock_free() && write_set.count(key) <= 0) {
+        *value = read_unlocked(key);
+        // (Optimistic reports the reads at commit, SerializationGraph
+        // in read_serialized())
+        return true;
+    }
+
+    // read from the write set
+    if (write_set.count(key) > 0) {
+        // (not reported: reading its own write depends on no other)
+        if (write_set[key].first == New)
+            *value = write_set[key].second;
+        return true;
+    }
+
+    // the key might have been deleted by another transaction
+    LockResult result = db_->has_key(key) ? try_lock(key, Read) : NoSuchKey;
+    if (result == NoSuchKey)
+        return !lock_absence || lock_absent(key) != MustWait;
+    if (result == MustWait)
+        return false;
+    if (result != Locked)
+        return true;
+    scheduler_->log(id_, key, Read);
+    *value = db_->read(key);
+    return true;
+}
+
+bool Transaction::try_del(const Key& key, bool* absent) {
+    *absent = true;
+    if (read_only_) {
+        UNREACHABLE;
+        return true;
+    }
+    if (killed_)
+        return true;
+    if (!has_key(key)) {
+        // (deleting a nonexistent key reads its absence)
+        if (!lock_free() && write_set.count(key) <= 0)
+            return lock_absent(key) != MustWait;
+        return true;
+    }
+
+    if (!lock_free() && db_->has_key(key) &&
+        try_lock(key, Write) == MustWait)
+        return false;
+    if (killed_)
+        return true;
+    *absent = false;
+    write_set.insert_or_assign(key, make_pair(Delete, 0));
+    return true;
+}
 
+vector<string> Transaction::list_keys() {
     vector<string> v;
-    for (const auto& entry : db_->table) {
-        Key key = entry.first;
+    if (read_only_) {
+        for (const auto& key : db_->keys_snapshot(snapshot_ts_)) {
+            v.push_back(key.str());
+        }
+        return v;
+    }
+
+    for (const auto& key : db_->keys()) {
         if (write_set.count(key) > 0 && write_set[key].first == Delete)
             continue;
-        v.push_back(key);
+        v.push_back(key.str());
     }
     for (const auto& [key, val] : write_set) {
-        if (db_->table.count(key) <= 0 || val.first == Delete)
+        if (db_->has_key(key) || val.first == Delete)
             continue;
-        v.push_back(key);
+        v.push_back(key.str());
     }
-
-    wait();
     return v;
 }
 
-int Transaction::get_until_success(Key key) {
+Transaction::Scan Transaction::scan(Key begin, optional<Key> end,
+                                    size_t limit) {
     TXLOG;
-    optional<int> tmp = get(key);
-    while (!tmp.has_value()) {
-        wait();
-        tmp = get(key);
+    Scan it(this, move(begin), move(end), limit);
+    it.next();
+    return it;
+}
+
+Transaction::Scan Transaction::prefix(const Key& prefix, size_t limit) {
+    // the smallest key greater than every key starting with |prefix|
+    string end = prefix.str();
+    while (!end.empty() && (unsigned char)end.back() == 0xFF) {
+        end.pop_back();
     }
-    wait();
-    return tmp.value();
+    if (end.empty())
+        return scan(prefix, nullopt, limit);
+    end.back()++;
+    return scan(prefix, Key(end), limit);
+}
+
+// number of keys read from the index at a time
+static const size_t kScanBatch = 64;
+
+Transaction::Scan::Scan(Transaction* tx, Key begin, optional<Key> end,
+                        size_t limit)
+  : tx_(tx),
+    end_(move(end)),
+    limit_(limit),
+    next_(begin),
+    fetch_from_(begin) {
+    if (tx_->read_only_ || tx_->killed_)
+        return;
+    if (tx_->optimistic()) {
+        scan_entry_ = tx_->scan_set.size();
+        tx_->scan_set.push_back({move(begin), next_, 0});
+    } else if (tx_->lock_free()) {
+        tx_->db_->scan_serialized(tx_, begin, end_);
+    }
+}
+
+void Transaction::Scan::next() {
+    valid_ = false;
+    // (the scan set is cleared if the transaction is killed)
+    auto entry = [this]() -> ScanEntry* {
+        if (!tx_->optimistic() || tx_->read_only_ || tx_->killed_)
+            return nullptr;
+        return &tx_->scan_set[scan_entry_];
+    };
+    while (limit_ > 0 && !tx_->killed_) {
+        if (batch_.empty() && !exhausted_ && !fetch())
+            break;
+        // the next key of the write set in the range
+        auto w = tx_->write_set.lower_bound(next_);
+        if (w != tx_->write_set.end() && end_ && w->first >= *end_)
+            w = tx_->write_set.end();
+        if (w == tx_->write_set.end() && batch_.empty()) {
+            if (ScanEntry* e = entry())
+                e->end = end_;
+            break;
+        }
+
+        if (w != tx_->write_set.end() &&
+            (batch_.empty() || w->first <= batch_.front())) {
+            // the write set overrides the index
+            if (!batch_.empty() && batch_.front() == w->first) {
+                batch_.pop_front();
+                // (counted as the validation sees it before installing)
+                ScanEntry* e = entry();
+                if (e && tx_->db_->read_optimistic(tx_, w->first))
+                    e->count++;
+            }
+            next_ = w->first + '\0';
+            if (ScanEntry* e = entry())
+                e->end = next_;
+            if (w->second.first == Delete)
+                continue;
+            key_ = w->first;
+            value_ = w->second.second;
+        } else {
+            optional<Value> value;
+            // (the range is locked already)
+            if (!tx_->try_get(batch_.front(), &value, false)) {
+                tx_->backoff();
+                continue;
+            }
+            key_ = move(batch_.front());
+            batch_.pop_front();
+            next_ = key_ + '\0';
+            if (ScanEntry* e = entry()) {
+                e->end = next_;
+                if (value)
+                    e->count++;
+            }
+            if (!value)  // deleted, or killed by wait-die
+                continue;
+            value_ = move(*value);
+        }
+        limit_--;
+        valid_ = true;
+        break;
+    }
+    tx_->wait();
+}
+
+bool Transaction::Scan::fetch() {
+    // Optimistic validates the range at commit and SerializationGraph has
+    // it in the graph instead of locking it, and read-only transactions
+    // read a snapshot
+    Transaction* locker =
+        (tx_->lock_free() || tx_->read_only_) ? nullptr : tx_;
+    vector<Key> keys;
+    while (true) {
+        LockResult result = tx_->db_->scan_keys(locker, fetch_from_, end_,
+                min(limit_, kScanBatch), &keys, &exhausted_);
+        if (result == Locked)
+            break;
+        if (result == MustDie) {
+            tx_->die();
+            return false;
+        }
+        tx_->backoff();
+    }
+    if (!keys.empty())
+        fetch_from_ = keys.back() + '\0';
+    for (auto& key : keys) {
+        batch_.push_back(move(key));
+    }
+    return true;
 }
 
 void Transaction::wait() {
+    if (scheduler_->mode() != Scheduler::RoundRobin)
+        return;
     scheduler_->notify();
     turn_ = false;
     cv_.wait(lock_, [this]{ return turn_; });
 }
 
+void Transaction::backoff() {
+    if (scheduler_->mode() == Scheduler::RoundRobin) {
+        wait();
+        return;
+    }
+    this_thread::yield();
+}
+
+LockResult Transaction::try_lock(const Key& key, BaseOp type) {
+    LockResult result = db_->get_lock(this, key, type);
+    if (result == MustDie)
+        die();
+    return result;
+}
+
+LockResult Transaction::lock_absent(const Key& key) {
+    LockResult result = db_->lock_absent(this, key);
+    if (result == MustDie)
+        die();
+    if (result == Locked && db_->has_key(key))
+        return MustWait;
+    return result;
+}
+
+void Transaction::die() {
+    TXLOG;
+    // Reported before the locks are released, or a writer of a key read
+    // could be ordered after this transaction which never commits.
+    if (!killed_)
+        scheduler_->log_finish(id_, false);
+    clear_sets();
+    killed_ = true;
+}
+
 void Transaction::finish() {
-    for (const auto& entry : write_set) {
-        Key key = entry.first;
-        db_->table[key].nlock = 0;
+    clear_sets();
+    if (db_->protocol() == SerializationGraph)
+        db_->forget_serialized(this);
+    read_only_ = false;
+    db_->unregister_tx(snapshot_ts_, snapshot_slot_);
+}
+
+void Transaction::clear_sets() {
+    for (const auto& [id, type] : lock_set) {
+        db_->release_lock(id, type);
     }
-    for (const auto& key : lock_set) {
-        db_->table[key].nlock = 0;
+    if (range_locked)
+        db_->release_range_locks(this);
+    // Everything in |arena| must be dropped before it is reused. The
+    // vectors keep their capacity for the next transaction.
+    lock_set.clear();
+    write_set.clear();
+    read_set.clear();
+    scan_set.clear();
+    arena.reset();
+}
+
+bool Transaction::step() {
+    if (pending_op_) {
+        if (!attempt_(pending_op_))
+            return true;
+        pending_op_ = nullptr;
     }
-    write_set = {};
+    coroutine_.resume();
+    is_done = coroutine_.done();
+    return !is_done;
+}
+
+void Transaction::run() {
+    logic(this);
     is_done = true;
+    if (scheduler_->mode() != Scheduler::RoundRobin || !lock_.owns_lock())
+        return;
     turn_ = false;
     lock_.unlock();
     scheduler_->notify();
 }
 
-bool Transaction::has_key(Key key) {
+bool Transaction::optimistic() const {
+    return db_->protocol() == Optimistic;
+}
+
+bool Transaction::lock_free() const {
+    return db_->protocol() != TwoPhaseLocking;
+}
+
+optional<Value> Transaction::read_unlocked(const Key& key) {
+    if (optimistic())
+        return db_->read_optimistic(this, key);
+    optional<Value> value;
+    if (!db_->read_serialized(this, key, &value))
+        die();
+    return value;
+}
+
+bool Transaction::has_key(const Key& key) {
     if (write_set.count(key) <= 0) {
-        return db_->table.count(key) > 0;
+        if (lock_free())  // existence is a read in OCC and SGT
+            return read_unlocked(key).has_value();
+        return db_->has_key(key);
     }
     return (write_set[key].first == New);
 }
 
+// -------------------------------- LockManager --------------------------------
+
+LockResult LockManager::grant(uint64_t bits, int ts, BaseOp type,
+                              bool upgrade, uint64_t* desired) {
+    uint64_t readers = bits & kReaderMask;
+    uint64_t holder = bits >> kTsShift;
+    bool conflict;
+    if (type == Read) {
+        conflict = (bits & kWriterBit) || readers == kReaderMask;
+        uint64_t oldest = readers == 0 ? ts : min<uint64_t>(holder, ts);
+        *desired = (oldest << kTsShift) |
+                   ((bits & ~(~0ull << kTsShift)) + kReaderUnit);
+    } else {
+        // (our own read lock is upgraded)
+        conflict = (bits & kWriterBit) || readers > (upgrade ? 1 : 0);
+        *desired = ((uint64_t)ts << kTsShift) |
+                   (bits & (kTagMask | kOverflowBit)) | kWriterBit;
+    }
+    if (!conflict)
+        return Locked;
+    // |holder| is the writer or no younger than any reader, so the
+    // request may wait only if it is older. (A reader which has left
+    // may make it die needlessly, never wait for a younger one.)
+    return (uint64_t)ts > holder ? MustDie : MustWait;
+}
+
+LockResult LockManager::acquire(
+        uint32_t id, int ts, BaseOp type, bool upgrade, bool block) {
+    Word& word = words_[slot_of(id)];
+    uint64_t tag = tag_of(id);
+    uint64_t bits = word.bits.load(memory_order_relaxed);
+    while (true) {
+        // held for another ID, or free but |id| may be in |overflow_|
+        bool held = bits & (kReaderMask | kWriterBit);
+        if (held ? (bits & kTagMask) != tag : (bits & kOverflowBit))
+            return acquire_overflow(id, ts, type, upgrade, block);
+
+        uint64_t desired;
+        LockResult result = grant(bits, ts, type, upgrade, &desired);
+        if (result == Locked) {
+            if (word.bits.compare_exchange_weak(bits,
+                    (desired & ~kTagMask) | tag,
+                    memory_order_acquire, memory_order_relaxed))
+                return Locked;
+            continue;
+        }
+        if (result == MustDie || !block)
+            return result;
+        wait(word, bits);
+    }
+}
+
+LockResult LockManager::acquire_overflow(
+        uint32_t id, int ts, BaseOp type, bool upgrade, bool block) {
+    uint32_t slot = slot_of(id);
+    Word& word = words_[slot];
+    uint64_t tag = tag_of(id);
+    unique_lock<mutex> lock(overflow_mtx_);
+    while (true) {
+        auto it = overflow_.find(id);
+        if (it == overflow_.end()) {
+            uint64_t bits = word.bits.load(memory_order_relaxed);
+            bool held = bits & (kReaderMask | kWriterBit);
+            if (held && (bits & kTagMask) == tag) {
+                // taken for |id| meanwhile
+                lock.unlock();
+                return acquire(id, ts, type, upgrade, block);
+            }
+            if (!held) {
+                // (a free word is always granted)
+                uint64_t desired;
+                grant(bits, ts, type, upgrade, &desired);
+                if (word.bits.compare_exchange_weak(bits,
+                        (desired & ~kTagMask) | tag,
+                        memory_order_acquire, memory_order_relaxed))
+                    return Locked;
+                continue;
+            }
+            // held for another ID: lock |id| aside
+            if (!(bits & kOverflowBit) &&
+                !word.bits.compare_exchange_weak(bits, bits | kOverflowBit))
+                continue;
+            it = overflow_.emplace(id, 0).first;
+            noverflow_[slot]++;
+        }
+
+        uint64_t desired;
+        LockResult result = grant(it->second, ts, type, upgrade, &desired);
+        if (result == Locked) {
+            it->second = desired;
+            return Locked;
+        }
+        if (result == MustDie || !block)
+            return result;
+        overflow_cv_.wait(lock);
+    }
+}
+
+void LockManager::wait(Word& word, uint64_t& bits) {
+    // counted as a waiter first, so that release() notifies
+    word.nwaiters++;
+    word.bits.wait(bits);
+    word.nwaiters--;
+    bits = word.bits.load(memory_order_relaxed);
+}
+
+void LockManager::release(uint32_t id, BaseOp type) {
+    Word& word = words_[slot_of(id)];
+    uint64_t bits = word.bits.load(memory_order_relaxed);
+    // (held by the caller, so the word is held for |id| iff it has the tag)
+    if ((bits & kTagMask) != tag_of(id) ||
+        !(bits & (kReaderMask | kWriterBit))) {
+        release_overflow(id, type);
+        return;
+    }
+    uint64_t desired;
+    do {
+        // (the timestamp of the readers is kept until the next reader)
+        desired = type == Write ? (bits & kOverflowBit) : bits - kReaderUnit;
+    } while (!word.bits.compare_exchange_weak(bits, desired));
+    if (word.nwaiters > 0)
+        word.bits.notify_all();
+}
+
+void LockManager::release_overflow(uint32_t id, BaseOp type) {
+    uint32_t slot = slot_of(id);
+    lock_guard<mutex> lock(overflow_mtx_);
+    auto it = overflow_.find(id);
+    it->second = type == Write ? 0 : it->second - kReaderUnit;
+    if (!(it->second & (kReaderMask | kWriterBit))) {
+        overflow_.erase(it);
+        if (--noverflow_[slot] == 0) {
+            noverflow_.erase(slot);
+            words_[slot].bits &= ~kOverflowBit;
+        }
+    }
+    overflow_cv_.notify_all();
+}
+
+// ------------------------------- RangeLockTable -------------------------------
+
+// wait-die against the oldest conflicting holder (-1 if none)
+static LockResult wait_or_die(int ts, int oldest) {
+    if (oldest < 0)
+        return Locked;
+    return ts > oldest ? MustDie : MustWait;
+}
+
+LockResult RangeLockTable::lock_range(
+        int ts, const Key& begin, const optional<Key>& end) {
+    lock_guard<mutex> lock(mtx_);
+    int oldest = -1;
+    for (auto it = inserts_.lower_bound(begin);
+         it != inserts_.end() && (!end || it->first < *end); it++) {
+        if (it->second != ts && (oldest < 0 || it->second < oldest))
+            oldest = it->second;
+    }
+    LockResult result = wait_or_die(ts, oldest);
+    if (result != Locked)
+        return result;
+    // A scan locks its batches one after another; extend the last one.
+    for (Range& r : ranges_) {
+        if (r.ts == ts && r.end && *r.end == begin) {
+            r.end = end;
+            return Locked;
+        }
+    }
+    ranges_.push_back({ts, begin, end});
+    return Locked;
+}
+
+LockResult RangeLockTable::lock_insert(int ts, const Key& key) {
+    lock_guard<mutex> lock(mtx_);
+    int oldest = -1;
+    for (const Range& r : ranges_) {
+        if (r.ts != ts && r.begin <= key && (!r.end || key < *r.end) &&
+            (oldest < 0 || r.ts < oldest))
+            oldest = r.ts;
+    }
+    // two inserts of the same key would both believe it was absent
+    bool declared = false;
+    auto [first, last] = inserts_.equal_range(key);
+    for (auto it = first; it != last; it++) {
+        if (it->second == ts)
+            declared = true;
+        else if (oldest < 0 || it->second < oldest)
+            oldest = it->second;
+    }
+    LockResult result = wait_or_die(ts, oldest);
+    if (result == Locked && !declared)
+        inserts_.emplace(key, ts);
+    return result;
+}
+
+void RangeLockTable::release(int ts) {
+    lock_guard<mutex> lock(mtx_);
+    ranges_.erase(remove_if(ranges_.begin(), ranges_.end(),
+                            [ts](const Range& r) { return r.ts == ts; }),
+                  ranges_.end());
+    erase_if(inserts_, [ts](const auto& entry) { return entry.second == ts; });
+}
+
 // --------------------------------- Scheduler ---------------------------------
 
+Scheduler::Scheduler(Mode mode, size_t nworkers) : mode_(mode) {
+    if (mode == Concurrent && nworkers > 0)
+        pool_ = make_unique<ThreadPool>(nworkers);
+}
+
 Scheduler::~Scheduler() {
-    ConflictGraph graph(io_log_);
-    graph.emit();
+    if (checker_thread_.joinable()) {
+        stop_checker_ = true;
+        checker_signal_.fetch_add(1);
+        checker_signal_.notify_one();
+        checker_thread_.join();
+    }
+    if (checker_)
+        history_.emit(graphfilename_);
 }
 
 void Scheduler::add_tx(Transaction::Logic logic) {
@@ -180,16 +771,77 @@ void Scheduler::add_tx(Transaction::Logic logic) {
     transactions.push(move(tx));
 }
 
+void Scheduler::add_coroutine_tx(Transaction::CoLogic logic) {
+    LOG;
+    unique_ptr<Transaction> tx = db_->generate_tx(nullptr);
+    tx->co_logic = move(logic);
+    transactions.push(move(tx));
+}
+
+vector<future<bool>> Scheduler::submit(span<Transaction::Logic> logics) {
+    vector<future<bool>> outcomes;
+    outcomes.reserve(logics.size());
+    for (auto& logic : logics) {
+        auto outcome = make_shared<promise<bool>>();
+        outcomes.push_back(outcome->get_future());
+        inbox_.push([logic = move(logic), outcome](Transaction* tx) {
+            logic(tx);
+            outcome->set_value(tx->committed());
+        });
+    }
+    // one wakeup for the whole batch
+    inbox_signal_.fetch_add(1, memory_order_release);
+    inbox_signal_.notify_one();
+    return outcomes;
+}
+
+future<bool> Scheduler::submit(Transaction::Logic logic) {
+    return move(submit(span<Transaction::Logic>(&logic, 1))[0]);
+}
+
+void Scheduler::close() {
+    closed_.store(true, memory_order_release);
+    inbox_signal_.fetch_add(1, memory_order_release);
+    inbox_signal_.notify_one();
+}
+
+void Scheduler::drain_inbox() {
+    Transaction::Logic logic;
+    while (inbox_.pop(&logic)) {
+        add_tx(move(logic));
+    }
+}
+
+void Scheduler::serve() {
+    if (mode_ != Concurrent) {
+        UNREACHABLE;
+        exit(1);
+    }
+    run_concurrently(true);
+    closed_ = false;
+}
+
 void Scheduler::start() {
+    if (mode_ == Concurrent) {
+        run_concurrently(false);
+        return;
+    }
+    drain_inbox();
+    if (mode_ == Coroutine) {
+        run_coroutines();
+        return;
+    }
+
     // spawn transaction threads
-    unique_lock<mutex> lock(giant_mtx_);
+    unique_lock<mutex> lock(turn_mtx_);
     lock_ = move(lock);
     LOG;
     for (const auto& tx : transactions) {
-        thread th(tx->logic, tx.get());
+        thread th(&Transaction::run, tx.get());
         tx->set_thread(move(th));
     }
     run();
+    lock_.unlock();
 }
 
 void Scheduler::run() {
@@ -207,103 +859,744 @@ void Scheduler::run() {
     }
 }
 
+void Scheduler::run_concurrently(bool until_closed) {
+    LOG;
+    // Starts the transactions in |transactions|. With the pool, they are
+    // handed over to the workers, which free them when they finish.
+    vector<unique_ptr<Transaction>> running;  // (without the pool)
+    auto dispatch = [this, &running]() {
+        while (!transactions.empty()) {
+            unique_ptr<Transaction> tx = move(transactions.front());
+            transactions.pop();
+            if (pool_) {
+                pool_->submit([tx = shared_ptr<Transaction>(move(tx))]{
+                    tx->run();
+                });
+                continue;
+            }
+            thread th(&Transaction::run, tx.get());
+            tx->set_thread(move(th));
+            running.push_back(move(tx));
+        }
+    };
+
+    drain_inbox();
+    dispatch();
+    while (until_closed) {
+        uint64_t signal = inbox_signal_.load(memory_order_acquire);
+        bool closed = closed_.load(memory_order_acquire);
+        drain_inbox();
+        dispatch();
+        if (closed)
+            break;
+        inbox_signal_.wait(signal, memory_order_acquire);
+    }
+
+    if (pool_)
+        pool_->wait_idle();
+    for (auto& tx : running) {
+        tx->terminate();
+    }
+}
+
+void Scheduler::run_coroutines() {
+    LOG;
+    for (const auto& tx : transactions) {
+        tx->start_coroutine();
+    }
+    while (!transactions.empty()) {
+        unique_ptr<Transaction> tx = move(transactions.front());
+        transactions.pop();
+        if (tx->step())
+            transactions.push(move(tx));
+    }
+}
+
 void Scheduler::wait(Transaction* tx) {
     tx->notify();
     turn_ = false;
     cv_.wait(lock_, [this]{ return turn_; });
 }
 
+void Scheduler::enable_checker() {
+    call_once(checker_once_, [this] {
+        checker_thread_ = thread(&Scheduler::check_loop, this);
+    });
+    checker_ = true;
+}
+
+void Scheduler::push_check(CheckEvent event) {
+    checks_.push(move(event));
+    // (pairs with the fence of check_loop(): either the checker sees the
+    // event or this sees it sleeping)
+    atomic_thread_fence(memory_order_seq_cst);
+    if (checker_sleeping_.load(memory_order_relaxed)) {
+        checker_signal_.fetch_add(1);
+        checker_signal_.notify_one();
+    }
+}
+
+void Scheduler::flush_checks() {
+    if (!checker_thread_.joinable())
+        return;
+    promise<void> done;
+    future<void> checked = done.get_future();
+    CheckEvent event;
+    event.done = &done;
+    push_check(move(event));
+    checked.wait();
+}
+
+void Scheduler::check_loop() {
+    CheckEvent event;
+    while (true) {
+        {
+            lock_guard<mutex> lock(graph_mtx_);
+            while (checks_.pop(&event)) {
+                check(event);
+            }
+        }
+        if (stop_checker_)
+            return;
+        uint32_t signal = checker_signal_.load();
+        checker_sleeping_ = true;
+        atomic_thread_fence(memory_order_seq_cst);
+        if (checks_.empty() && !stop_checker_)
+            checker_signal_.wait(signal);
+        checker_sleeping_ = false;
+    }
+}
+
+void Scheduler::check(const CheckEvent& event) {
+    if (event.done) {
+        event.done->set_value();
+        return;
+    }
+    if (event.op == History::Commit || event.op == History::Abort) {
+        bool committed = (event.op == History::Commit);
+        graph_.finish(event.id, committed);
+        history_.record_finish(event.id, committed);
+        return;
+    }
+    BaseOp rw = (event.op == History::Read) ? Read : Write;
+    history_.record(event.id, event.key, rw);
+    bool ok = (rw == Read) ? graph_.read(event.id, event.key)
+                           : graph_.write(event.id, event.key);
+    if (!ok) {
+        fprintf(stderr, "not serializable: %s of %s by Tx%d closes a cycle\n",
+                rw == Read ? "read" : "write", event.key.c_str(), event.id);
+    }
+}
+
 // ---------------------------------- DataBase ---------------------------------
 
-DataBase::DataBase(Scheduler* scheduler, string dumpfilename, string logfilename)
-  : scheduler_(scheduler),
+DataBase::DataBase(Scheduler* scheduler, string dumpfilename, string logfilename,
+                   DBOptions options)
+  : table(Index::create(options.index)),
+    scheduler_(scheduler),
+    protocol_(options.protocol),
     dumpfilename_(dumpfilename),
-    logfilename_(logfilename)
+    logfilename_(logfilename),
+    oldlogfilename_(logfilename + ".old"),
+    recovery_threads_(options.recovery_threads),
+    group_commit_(options.group_commit),
+    ended_(new atomic<uint64_t>[kEndedSlots]),
+    snapshots_(new SnapshotSlot[kSnapshotSlots]),
+    checkpoint_interval_(options.checkpoint_interval)
 {
     LOG;
     scheduler_->set_db(this);
+    if (options.check_serializability)
+        scheduler_->enable_checker();
 
     // 前回のDBファイルをメモリに読み出し
-    ifstream ifs_dump(dumpfilename);
-    string str;
-
-    while (getline(ifs_dump, str)) {
-        if (str == "") continue;
-        vector<string> fields = words(str);
-        if (fields.size() != 2) {
-            UNREACHABLE;
-            exit(1);
-        }
-        table[fields[0]].value = stoi(fields[1]);
-    }
-
-    ifs_dump.close();
+    bool text_dump = load_dump();
+    next_lsn_ = ckpt_lsn_ + 1;
 
     // (必要なら) crash recovery
-    recover();
+    // The old log remains only if we crashed in the middle of a checkpoint.
+    bool has_oldlog = (access(oldlogfilename_.c_str(), F_OK) == 0);
+    if (has_oldlog)
+        recover(oldlogfilename_);
+    // A log of the former text format is replayed once and replaced by a
+    // checkpoint; the binary parser would take all of it for a torn tail.
+    bool text_log = is_text_log(logfilename_);
+    size_t log_size = 0;
+    if (text_log) {
+        size_t ntxs = recover_text_log(logfilename_);
+        fprintf(stderr, "%s: converted %zu transactions from the text format\n",
+                logfilename_.c_str(), ntxs);
+    } else {
+        log_size = recover(logfilename_);
+    }
+    flushed_lsn_ = next_lsn_ - 1;
+
+    fd_log_ = open(logfilename.c_str(), O_WRONLY | O_CREAT, 0644);
+    if (has_oldlog || text_log || text_dump) {
+        // Both logs have been replayed; take a checkpoint before the old log
+        // could be overwritten by the next rotation (or the text files are
+        // replaced).
+        write_snapshot(next_lsn_ - 1);
+        unlink(oldlogfilename_.c_str());
+        log_size = 0;
+    }
+    // discard the torn tail so that new records follow the valid ones
+    if (ftruncate(fd_log_, log_size) != 0 || lseek(fd_log_, 0, SEEK_END) < 0) {
+        perror("ftruncate");
+        exit(1);
+    }
+    fsync(fd_log_);
 
-    fd_log_ = open(logfilename.c_str(), O_WRONLY | O_TRUNC);
+    log_flusher_ = thread(&DataBase::flush_log_loop, this);
+    if (checkpoint_interval_.count() > 0)
+        checkpointer_ = thread(&DataBase::checkpoint_loop, this);
 }
 
 DataBase::~DataBase() {
     LOG;
 
-    // checkpointing
-    ofstream ofs_dump(dumpfilename_);  // dump file will be truncated
-    for (const auto& [key, v] : table) {
-        ofs_dump << key << " " << v.value << endl;
+    // The log since the last checkpoint is replayed on restart, so nothing
+    // has to be dumped here.
+    if (checkpointer_.joinable()) {
+        {
+            lock_guard<mutex> lock(ckpt_stop_mtx_);
+            stop_checkpointer_ = true;
+        }
+        ckpt_stop_cv_.notify_one();
+        checkpointer_.join();
     }
 
-    ofs_dump.close();
+    {
+        lock_guard<mutex> lock(log_mtx_);
+        stop_flusher_ = true;
+    }
+    log_cv_.notify_one();
+    log_flusher_.join();
     close(fd_log_);
+}
 
-    // clear log file
-    fd_log_ = open(logfilename_.c_str(), O_TRUNC);
-    close(fd_log_);
+static const size_t kPageSize = 4096;
+static const size_t kSnapshotBlockSize = 64 * 1024;
+static const char kSnapshotMagic[8] = {'S', 'C', 'D', 'B', 'S', 'N', 'A', 'P'};
+// 1: crc32, 2: crc32c, 3: string values
+static const uint32_t kSnapshotVersion = 3;
+
+static size_t round_up(size_t n, size_t align) {
+    return (n + align - 1) / align * align;
 }
 
-void DataBase::recover() {
-    LOG;
-    ifstream ifs_log(logfilename_);
-    string line;
-    vector<string> buf;
-    bool in_transaction = false;
+static void corrupted_dump(const string& filename, const char* reason) {
+    fprintf(stderr, "%s is corrupted (%s)\n", filename.c_str(), reason);
+    exit(1);
+}
+
+// Runs fn(0), ..., fn(n - 1) on |n| threads
+static void parallel_for(size_t n, const function<void(size_t)>& fn) {
+    vector<thread> threads;
+    for (size_t i = 1; i < n; i++) {
+        threads.emplace_back(fn, i);
+    }
+    fn(0);
+    for (auto& th : threads) {
+        th.join();
+    }
+}
+
+bool DataBase::load_dump() {
+    int fd = open(dumpfilename_.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    fstat(fd, &st);
+    size_t size = st.st_size;
+    if (size == 0) {
+        close(fd);
+        return false;
+    }
+    char magic[sizeof(kSnapshotMagic)] = {};
+    if (pread(fd, magic, sizeof(magic), 0) < 0 ||
+        memcmp(magic, kSnapshotMagic, sizeof(magic)) != 0) {
+        close(fd);
+        size_t nrecords;
+        if (!load_text_dump(&nrecords))
+            corrupted_dump(dumpfilename_, "bad header");
+        fprintf(stderr, "%s: converted %zu records from the text format\n",
+                dumpfilename_.c_str(), nrecords);
+        return true;
+    }
+    if (size < kPageSize)
+        corrupted_dump(dumpfilename_, "too short");
+
+    // 前回のsnapshotをmmapして一括でtableに読み出し
+    void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    madvise(addr, size, MADV_SEQUENTIAL | MADV_WILLNEED);
+    const char* base = static_cast<const char*>(addr);
+
+    SnapshotHeader header;
+    memcpy(&header, base, sizeof(header));
+    uint32_t crc = header.crc;
+    header.crc = 0;
+    if (memcmp(header.magic, kSnapshotMagic, sizeof(kSnapshotMagic)) != 0 ||
+        header.version != kSnapshotVersion ||
+        crc32c(reinterpret_cast<const char*>(&header), sizeof(header)) != crc)
+        corrupted_dump(dumpfilename_, "bad header");
+    ckpt_lsn_ = header.lsn;
+    table->reserve(header.nrecords);
+
+    vector<size_t> blocks;  // offsets
+    size_t offset = kPageSize;
+    for (uint64_t i = 0; i < header.nblocks; i++) {
+        SnapshotBlockHeader block;
+        if (offset + sizeof(block) > size)
+            corrupted_dump(dumpfilename_, "truncated");
+        memcpy(&block, base + offset, sizeof(block));
+        if (block.length > size - offset - sizeof(block))
+            corrupted_dump(dumpfilename_, "truncated");
+        blocks.push_back(offset);
+        offset += round_up(sizeof(block) + block.length, kPageSize);
+    }
+
+    // Returns the error of the block at |offset|, or decodes it into
+    // |records|
+    using Records = vector<pair<Key, unique_ptr<RecordInfo>>>;
+    auto decode = [&](size_t offset, Records* records) -> const char* {
+        SnapshotBlockHeader block;
+        memcpy(&block, base + offset, sizeof(block));
+        const char* p = base + offset + sizeof(block);
+        const char* end = p + block.length;
+        if (crc32c(p, block.length) != block.crc)
+            return "checksum mismatch";
+        records->reserve(block.nentries);
+        for (uint32_t j = 0; j < block.nentries; j++) {
+            if (p + kEntryHeaderSize > end || entry_size(p) > (size_t) (end - p))
+                return "bad entry";
+            auto record = make_unique<RecordInfo>();
+            record->load(entry_value(p));
+            records->emplace_back(Key(entry_key(p)), move(record));
+            p += entry_size(p);
+        }
+        return nullptr;
+    };
+
+    // Most of the cost is in decoding (allocating the records above all),
+    // so the blocks of a window are decoded by |recovery_threads_| workers.
+    // Then the records are appended to |table| in the snapshot order, which
+    // is the key order if the snapshot was taken from an ordered index.
+    const size_t nthreads = max<size_t>(1, recovery_threads_);
+    const size_t window = 16 * nthreads;
+    for (size_t first = 0; first < blocks.size(); first += window) {
+        size_t n = min(window, blocks.size() - first);
+        vector<Records> records(n);
+        vector<const char*> errors(n);
+        parallel_for(min(nthreads, n), [&](size_t w) {
+            for (size_t i = w; i < n; i += nthreads) {
+                errors[i] = decode(blocks[first + i], &records[i]);
+            }
+        });
+        for (size_t i = 0; i < n; i++) {
+            if (errors[i])
+                corrupted_dump(dumpfilename_, errors[i]);
+            for (auto& [key, record] : records[i]) {
+                table->append(key, move(record));
+            }
+        }
+    }
 
-    while (getline(ifs_log, line)) {
+    munmap(addr, size);
+    return false;
+}
+
+bool DataBase::load_text_dump(size_t* nrecords) {
+    ifstream ifs(dumpfilename_);
+    string line;
+    vector<pair<Key, int>> records;
+    while (getline(ifs, line)) {
         if (line == "")
             continue;
+        istringstream fields(line);
+        string key;
+        int value;
+        if (!(fields >> key >> value) || !fields.eof())
+            return false;
+        records.emplace_back(Key(key), value);
+    }
+    for (const auto& [key, value] : records) {
+        table->insert(key)->load(value);
+    }
+    *nrecords = records.size();
+    return true;
+}
 
-       if (line == "{") {
-            if (in_transaction) {
-                UNREACHABLE;
-                return;
+size_t DataBase::recover(const string& filename) {
+    LOG;
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    // An entry decoded in place (|key| points into |buf|)
+    struct Entry {
+        size_t rec;  // index of the record in the chunk
+        const char* key;
+        uint32_t keylen;
+        ChangeMode mode;
+        Value value;
+    };
+
+    // The log is streamed in chunks. In each chunk, records are validated
+    // and decoded by |nthreads| workers in parallel (each takes a contiguous
+    // range of records), and the entries are partitioned by key hash. Then
+    // each partition is replayed by its own worker in log order, so the
+    // order of operations on every key is preserved. Only the last
+    // operation on each key is kept and applied to |table| at the end.
+    const size_t kChunkSize = 8 << 20;
+    const size_t nthreads = max<size_t>(1, recovery_threads_);
+    vector<unordered_map<Key, pair<ChangeMode, Value>>> partitions(nthreads);
+
+    string buf;
+    size_t buf_len = 0;      // bytes of |buf| filled with the file content
+    size_t buf_offset = 0;   // file offset of buf[0]
+    size_t valid_end = 0;    // file offset after the last valid record
+    bool eof = false;
+    bool corrupted = false;
+
+    while (!eof && !corrupted) {
+        // read the next chunk after the bytes left from the previous one
+        buf.resize(buf_len + kChunkSize);
+        ssize_t n = pread(fd, buf.data() + buf_len, kChunkSize,
+                          buf_offset + buf_len);
+        if (n <= 0)
+            eof = true;
+        else
+            buf_len += n;
+
+        // find the boundaries of the complete records
+        vector<size_t> offsets;
+        size_t pos = 0;
+        while (pos + sizeof(LogRecordHeader) <= buf_len) {
+            uint32_t length = get<uint32_t>(
+                    buf.data() + pos + offsetof(LogRecordHeader, length));
+            if (length < sizeof(LogRecordHeader)) {
+                corrupted = true;
+                break;
             }
-            in_transaction = true;
+            if (pos + length > buf_len)  // continues to the next chunk
+                break;
+            offsets.push_back(pos);
+            pos += length;
+        }
+        if (offsets.empty())
             continue;
+
+        size_t nrecords = offsets.size();
+        vector<size_t> first_invalid(nthreads, nrecords);
+        vector<vector<vector<Entry>>> buckets(
+                nthreads, vector<vector<Entry>>(nthreads));
+        parallel_for(nthreads, [&](size_t w) {
+            size_t begin = nrecords * w / nthreads;
+            size_t end = nrecords * (w + 1) / nthreads;
+            for (size_t i = begin; i < end; i++) {
+                char* rec = buf.data() + offsets[i];
+                size_t len = deserialize(rec, buf_len - offsets[i],
+                        [&](const char* key, uint32_t keylen,
+                            ChangeMode mode, Value value) {
+                    size_t p = hash<string_view>{}(string_view(key, keylen))
+                        % nthreads;
+                    buckets[w][p].push_back({i, key, keylen, mode, move(value)});
+                });
+                if (len == 0) {
+                    first_invalid[w] = i;
+                    break;
+                }
+            }
+        });
+
+        // records after the first invalid one are discarded
+        size_t nvalid = *min_element(first_invalid.begin(), first_invalid.end());
+        parallel_for(nthreads, [&](size_t p) {
+            for (size_t w = 0; w < nthreads; w++) {
+                for (const auto& e : buckets[w][p]) {
+                    if (e.rec >= nvalid)
+                        break;
+                    partitions[p][Key(string_view(e.key, e.keylen))] = {e.mode, e.value};
+                }
+            }
+        });
+
+        for (size_t i = 0; i < nvalid; i++) {
+            uint64_t lsn = get<uint64_t>(buf.data() + offsets[i]);
+            next_lsn_ = max(next_lsn_, lsn + 1);
+        }
+        if (nvalid < nrecords) {
+            valid_end = buf_offset + offsets[nvalid];
+            corrupted = true;
+            break;
+        }
+        valid_end = buf_offset + pos;
+
+        // keep the incomplete record at the tail for the next chunk
+        memmove(buf.data(), buf.data() + pos, buf_len - pos);
+        buf_offset += pos;
+        buf_len -= pos;
+    }
+    close(fd);
+
+    for (auto& partition : partitions) {
+        for (const auto& [key, op] : partition) {
+            if (op.first == New)
+                table->insert(key)->load(op.second);
+            else
+                table->erase(key);
         }
-        if (line == "}") {
-            if (!in_transaction) {
-                UNREACHABLE;
-                return;
+    }
+    return valid_end;
+}
+
+// The former text format is a sequence of transactions
+//   {
+//   <crc32 of key, mode and value> <key> <mode> <value>
+//   ...
+//   }
+// A binary log can't start with "{\n" followed by text, since the length
+// in its first header would then be far beyond the end of the file.
+bool DataBase::is_text_log(const string& filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    LogRecordHeader header;
+    ssize_t n = pread(fd, &header, sizeof(header), 0);
+    struct stat st;
+    fstat(fd, &st);
+    close(fd);
+    if (n < 2 || memcmp(&header, "{\n", 2) != 0)
+        return false;
+    return n < (ssize_t) sizeof(header) || header.length > (size_t) st.st_size;
+}
+
+size_t DataBase::recover_text_log(const string& filename) {
+    LOG;
+    ifstream ifs(filename);
+    string line;
+    DBDiff diff;  // of the transaction being read
+    bool in_transaction = false;
+    size_t ntxs = 0;
+    // stops at the first malformed line (the torn tail)
+    while (getline(ifs, line) && !ifs.eof()) {
+        if (line == "")
+            continue;
+        if (line == "{" || line == "}") {
+            if (in_transaction == (line == "{"))
+                break;
+            in_transaction = !in_transaction;
+            if (in_transaction) {
+                diff.clear();
+                continue;
+            }
+            for (const auto& [key, value] : diff) {
+                if (value.first == New)
+                    table->insert(key)->load(value.second);
+                else
+                    table->erase(key);
             }
-            in_transaction = false;
+            ntxs++;
             continue;
         }
+        if (!in_transaction)
+            break;
+        istringstream fields(line);
+        unsigned int crc;
+        string key;
+        int mode, value;
+        if (!(fields >> crc >> key >> mode >> value) || !fields.eof())
+            break;
+        string seed = key + to_string(mode) + to_string(value);
+        if (crc != crc32(seed.data(), seed.size()))
+            break;
+        diff.insert_or_assign(Key(key), make_pair(mode ? Delete : New, Value(value)));
+    }
+    return ntxs;
+}
 
-        buf.push_back(line);
+// Makes renames/creations of files in the directory of |path| durable
+static void fsync_dir(const string& path) {
+    size_t slash = path.rfind('/');
+    string dir = (slash == string::npos) ? "." : path.substr(0, slash + 1);
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return;
+    fsync(fd);
+    close(fd);
+}
+
+static void write_all(int fd, const string& buf) {
+    size_t nbytes_written = 0;
+    while (nbytes_written < buf.size()) {
+        ssize_t n = write(fd,
+                buf.c_str() + nbytes_written,
+                buf.size() - nbytes_written);
+        if (n < 0) {
+            perror("write");
+            exit(1);
+        }
+        nbytes_written += n;
     }
+}
 
-    DBDiff diff = {};
-    deserialize(diff, buf);
-    for (const auto& [key, value] : diff) {
-        if (value.first == New) {
-            table[key].value = value.second;
-        } else {
-            table.erase(key);
+void DataBase::checkpoint() {
+    lock_guard<mutex> ckpt_lock(ckpt_mtx_);
+    LOG;
+
+    // Every record up to |lsn| is in the old log and every later record
+    // goes to the new one.
+    uint64_t lsn = rotate_log();
+
+    // wait for the committers of these records to apply them to |table|
+    {
+        unique_lock<mutex> lock(log_mtx_);
+        ckpt_cv_.wait(lock, [this, lsn]{
+            return unapplied_lsns_.empty() || *unapplied_lsns_.begin() > lsn;
+        });
+    }
+
+    // The snapshot may also contain the effects of records after |lsn|.
+    // That is fine since replaying a record is idempotent.
+    write_snapshot(lsn);
+
+    // the old log is now covered by the snapshot
+    unlink(oldlogfilename_.c_str());
+    fsync_dir(oldlogfilename_);
+}
+
+void DataBase::write_snapshot(uint64_t lsn) {
+    string tmpfilename = dumpfilename_ + ".tmp";
+    int fd = open(tmpfilename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open");
+        exit(1);
+    }
+    // page 0 is reserved for the header, which is written at last
+    write_all(fd, string(kPageSize, '\0'));
+
+    uint64_t nrecords = 0;
+    uint64_t nblocks = 0;
+    uint32_t nentries = 0;
+    string block(sizeof(SnapshotBlockHeader), '\0');
+    auto flush_block = [&]() {
+        if (nentries == 0)
+            return;
+        SnapshotBlockHeader header;
+        header.length = block.size() - sizeof(header);
+        header.nentries = nentries;
+        header.crc = crc32c(block.data() + sizeof(header), header.length);
+        memcpy(block.data(), &header, sizeof(header));
+        block.resize(round_up(block.size(), kPageSize), '\0');
+        write_all(fd, block);
+        nblocks++;
+        nentries = 0;
+        block.assign(sizeof(header), '\0');
+    };
+
+    // Entries are encoded into |chunk| while holding the latch and are cut
+    // into blocks (and written) after releasing it.
+    string chunk;
+    auto dump_record = [this, &chunk](const Key& key, RecordInfo& record) {
+        // (installs don't take the latch)
+        Value value;
+        if (stable_read(&record, &value) & RecordInfo::kAbsentBit)
+            return;
+        put_entry(chunk, key, value);
+    };
+    auto emit_chunk = [&]() {
+        const char* p = chunk.data();
+        const char* end = p + chunk.size();
+        while (p < end) {
+            size_t len = entry_size(p);
+            if (nentries > 0 && block.size() + len > kSnapshotBlockSize)
+                flush_block();
+            block.append(p, len);
+            nentries++;
+            nrecords++;
+            p += len;
+        }
+        chunk.clear();
+    };
+
+    if (table->ordered()) {
+        // Copy the table chunk by chunk so that committers (which take the
+        // latch exclusively) are not blocked for the whole scan.
+        const size_t kChunkSize = 1024;
+        Key start = "";
+        bool done = false;
+        while (!done) {
+            {
+                shared_lock<shared_mutex> latch(latch_);
+                size_t n = 0;
+                done = true;
+                table->for_each_from(start, [&](const Key& key, RecordInfo& record) {
+                    if (n++ == kChunkSize) {
+                        start = key;
+                        done = false;
+                        return false;
+                    }
+                    dump_record(key, record);
+                    return true;
+                });
+            }
+            emit_chunk();
+        }
+    } else {
+        {
+            shared_lock<shared_mutex> latch(latch_);
+            table->for_each([&](const Key& key, RecordInfo& record) {
+                dump_record(key, record);
+                return true;
+            });
         }
+        emit_chunk();
+    }
+    flush_block();
+
+    SnapshotHeader header = {};
+    memcpy(header.magic, kSnapshotMagic, sizeof(kSnapshotMagic));
+    header.version = kSnapshotVersion;
+    header.lsn = lsn;
+    header.nrecords = nrecords;
+    header.nblocks = nblocks;
+    header.crc = crc32c(reinterpret_cast<const char*>(&header), sizeof(header));
+    if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        perror("pwrite");
+        exit(1);
     }
 
-    ifs_log.close();
+    // atomically replace the dump file with the new snapshot
+    fsync(fd);
+    close(fd);
+    rename(tmpfilename.c_str(), dumpfilename_.c_str());
+    fsync_dir(dumpfilename_);
+    ckpt_lsn_ = lsn;
+}
+
+uint64_t DataBase::rotate_log() {
+    unique_lock<mutex> lock(log_mtx_);
+    rotate_requested_ = true;
+    log_cv_.notify_one();
+    ckpt_cv_.wait(lock, [this]{ return !rotate_requested_; });
+    return rotated_lsn_;
+}
+
+void DataBase::checkpoint_loop() {
+    unique_lock<mutex> lock(ckpt_stop_mtx_);
+    while (!ckpt_stop_cv_.wait_for(lock, checkpoint_interval_,
+                                   [this]{ return stop_checkpointer_; })) {
+        lock.unlock();
+        checkpoint();
+        collect_garbage();
+        lock.lock();
+    }
 }
 
 unique_ptr<Transaction> DataBase::generate_tx(Transaction::Logic logic) {
@@ -312,216 +1605,1302 @@ unique_ptr<Transaction> DataBase::generate_tx(Transaction::Logic logic) {
     return tx;
 }
 
-bool DataBase::get_lock(Transaction* tx, Key key, BaseOp locktype) {
-    if (table.count(key) <= 0) {
-        UNREACHABLE;
-        return false;
+LockResult DataBase::get_lock(
+        Transaction* tx, const Key& key, BaseOp locktype) {
+    if (!has_key(key))
+        return NoSuchKey;
+    uint32_t id = LockManager::lock_id(key);
+    BaseOp* held = tx->lock_set.find(id);
+    if (held && (*held == Write || locktype == Read))
+        return Locked;
+    bool block = scheduler_->mode() == Scheduler::Concurrent &&
+                 !tx->nonblocking();
+    LockResult result = locks_.acquire(id, tx->id(), locktype, held, block);
+    if (result == Locked) {
+        if (held)
+            *held = locktype;
+        else
+            tx->lock_set.insert(id, locktype);
     }
+    return result;
+}
 
-    if (vexists(tx->lock_set, key)) {
-        return ((locktype == Write && table[key].nlock == -1) ||
-                (locktype == Read && table[key].nlock > 0));
+void DataBase::release_lock(uint32_t id, BaseOp locktype) {
+    locks_.release(id, locktype);
+}
+
+LockResult DataBase::lock_insert(Transaction* tx, const Key& key) {
+    LockResult result = range_locks_.lock_insert(tx->id(), key);
+    if (result == Locked)
+        tx->range_locked = true;
+    return result;
+}
+
+LockResult DataBase::lock_absent(Transaction* tx, const Key& key) {
+    LockResult result = range_locks_.lock_range(tx->id(), key, key + '\0');
+    if (result == Locked)
+        tx->range_locked = true;
+    return result;
+}
+
+void DataBase::release_range_locks(Transaction* tx) {
+    range_locks_.release(tx->id());
+    tx->range_locked = false;
+}
+
+LockResult DataBase::scan_keys(Transaction* tx, const Key& from,
+                               const optional<Key>& end, size_t n,
+                               vector<Key>* keys, bool* exhausted) {
+    keys->clear();
+    *exhausted = true;
+    shared_lock<shared_mutex> latch(latch_);
+    if (table->ordered()) {
+        table->for_each_from(from, [&](const Key& key, RecordInfo&) {
+            if (end && key >= *end)
+                return false;
+            if (keys->size() == n) {
+                *exhausted = false;
+                return false;
+            }
+            keys->push_back(key);
+            return true;
+        });
+    } else {
+        // every slot has to be visited to find the smallest keys
+        table->for_each([&](const Key& key, RecordInfo&) {
+            if (key >= from && (!end || key < *end))
+                keys->push_back(key);
+            return true;
+        });
+        if (keys->size() > n) {
+            partial_sort(keys->begin(), keys->begin() + n, keys->end());
+            keys->resize(n);
+            *exhausted = false;
+        } else {
+            sort(keys->begin(), keys->end());
+        }
     }
+    if (!tx)
+        return Locked;
+    // An insert into the range either has committed before the latch was
+    // taken (and is in |keys|), or still holds its intent and conflicts.
+    optional<Key> upto = end;
+    if (!*exhausted)
+        upto = keys->back() + '\0';
+    LockResult result = range_locks_.lock_range(tx->id(), from, upto);
+    if (result == Locked)
+        tx->range_locked = true;
+    return result;
+}
 
-    if (locktype == Write) {
-        if (table[key].nlock != 0)
-            return false;
-        table[key].nlock = -1;
-        tx->lock_set.push_back(key);
+bool DataBase::apply_tx(Transaction* tx, uint64_t* ticket) {
+    if (protocol_ == Optimistic)
+        return commit_optimistic(tx, ticket);
+    if (protocol_ == SerializationGraph)
+        return commit_serialized(tx, ticket);
+
+    if (tx->write_set.empty())  // read-only transactions don't need logging
         return true;
+    uint64_t lsn = ticket ? enqueue_log(tx, ticket) : append_log(tx);
+    // (reported while the locks are held, i.e. in the serialization order)
+    for (const auto& entry : tx->write_set) {
+        scheduler_->log(tx->id(), entry.first, Write);
     }
+    install_writes(tx);
+    mark_applied(lsn);
+    return true;
+}
 
-    if (table[key].nlock < 0)
-        return false;
+void DataBase::install_writes(Transaction* tx) {
+    vector<RecordInfo*> records;
+    records.reserve(tx->write_set.size());
+    for (const auto& [key, value] : tx->write_set) {
+        records.push_back(lock_record(key, value.first == New));
+    }
+    install_writes(tx, records);
+}
 
-    table[key].nlock++;
-    tx->lock_set.push_back(key);
-    return true;
+void DataBase::install_writes(Transaction* tx,
+                              span<RecordInfo* const> records) {
+    uint64_t ts = begin_commit();
+    size_t i = 0;
+    for (const auto& [key, value] : tx->write_set) {
+        RecordInfo* record = records[i++];
+        if (!record)
+            continue;
+        install_version(record, ts, value.first, value.second);
+        // Deleted records stay in the index as absent records until
+        // no snapshot can see them.
+        uint64_t tid = (record->tid.load(memory_order_relaxed) &
+                        RecordInfo::kVersionMask) + RecordInfo::kVersionUnit;
+        if (value.first == New) {
+            record->value = value.second;
+            record->tid.store(tid, memory_order_release);
+        } else {
+            record->tid.store(tid | RecordInfo::kAbsentBit,
+                              memory_order_release);
+        }
+    }
+    end_commit(ts);
 }
 
-void DataBase::apply_tx(Transaction* tx) {
-    string buf = serialize(tx->write_set);
-    size_t nbytes_written = 0;
-    while (nbytes_written < buf.size()) {
-        nbytes_written += write(fd_log_,
-                buf.c_str() + nbytes_written,
-                buf.size() - nbytes_written);
+RecordInfo* DataBase::lock_record(const Key& key, bool create) {
+    RecordInfo* record;
+    uint64_t tid;
+    do {
+        {
+            shared_lock<shared_mutex> latch(latch_);
+            record = table->find(key);
+        }
+        if (!record) {
+            if (!create)
+                return nullptr;
+            unique_lock<shared_mutex> latch(latch_);
+            record = table->find(key);
+            if (!record) {
+                record = table->insert(key);
+                record->base.deleted = true;
+                record->tid = RecordInfo::kAbsentBit;
+            }
+        }
+        tid = record->tid.load();
+        // An obsolete record stays locked; look up the new one.
+        while (!(tid & RecordInfo::kObsoleteBit) &&
+               ((tid & RecordInfo::kLockBit) ||
+                !record->tid.compare_exchange_weak(
+                        tid, tid | RecordInfo::kLockBit))) {
+            this_thread::yield();
+            tid = record->tid.load();
+        }
+    } while (tid & RecordInfo::kObsoleteBit);
+    return record;
+}
+
+void DataBase::mark_applied(uint64_t lsn) {
+    lock_guard<mutex> lock(log_mtx_);
+    unapplied_lsns_.erase(lsn);
+    ckpt_cv_.notify_all();
+}
+
+uint64_t DataBase::stable_read(RecordInfo* record, Value* value) {
+    while (true) {
+        uint64_t tid1 = record->tid.load(memory_order_acquire);
+        // The committer holding the lock prepends the new version before it
+        // stores the new TID, so the newest version of a locked record may
+        // not belong to |tid1|. Wait for the commit to finish. (An obsolete
+        // record stays locked, but it is absent.)
+        if (tid1 & RecordInfo::kObsoleteBit)
+            return tid1 & ~RecordInfo::kLockBit;
+        if (tid1 & RecordInfo::kLockBit) {
+            this_thread::yield();
+            continue;
+        }
+        // |value| may be replaced (and its string freed) by a concurrent
+        // install, so the value is taken from the newest version instead,
+        // which is immutable and is not pruned while the reader is active.
+        *value = record->versions.load(memory_order_acquire)->value;
+        atomic_thread_fence(memory_order_acquire);
+        // (every install bumps the version bits of the TID)
+        if (record->tid.load(memory_order_relaxed) == tid1)
+            return tid1;
     }
-    fsync(fd_log_);
+}
 
-    // apply write_set to table
+optional<Value> DataBase::read_optimistic(Transaction* tx, const Key& key) {
+    RecordInfo* record;
+    {
+        shared_lock<shared_mutex> latch(latch_);
+        record = table->find(key);
+    }
+    if (!record) {
+        tx->read_set.push_back({tx->arena.copy(key), nullptr, 0});
+        return nullopt;
+    }
+
+    Value value;
+    uint64_t tid = stable_read(record, &value);
+    tx->read_set.push_back({tx->arena.copy(key), record, tid});
+    if (tid & RecordInfo::kAbsentBit)
+        return nullopt;
+    return value;
+}
+
+bool DataBase::commit_optimistic(Transaction* tx, uint64_t* ticket) {
+    // Phase 1: lock the write set in key order (|write_set| is sorted), so
+    // that committing transactions never deadlock. A nonexistent key gets an
+    // absent record first, which makes the insert visible to validations.
+    vector<RecordInfo*> locked;
+    uint64_t max_tid = 0;
+    for (const auto& entry : tx->write_set) {
+        RecordInfo* record = lock_record(entry.first, true);
+        uint64_t tid = record->tid.load(memory_order_relaxed);
+        locked.push_back(record);
+        max_tid = max(max_tid, tid & RecordInfo::kVersionMask);
+    }
+    auto is_locked_by_me = [&locked](RecordInfo* record) {
+        return find(locked.begin(), locked.end(), record) != locked.end();
+    };
+    // The commit timestamp is taken after locking and before validating,
+    // so that the timestamp order agrees with the serialization order.
+    uint64_t ts = tx->write_set.empty() ? 0 : begin_commit();
+    auto unlock_all = [this, &locked, ts]() {
+        for (auto record : locked) {
+            record->tid &= ~RecordInfo::kLockBit;
+        }
+        if (ts > 0)
+            end_commit(ts);
+    };
+
+    // The reads are reported at the serialization point: a write installed
+    // after this fails the validation below, and one installed after the
+    // validation is reported after these. (A record already changed or
+    // being written by others fails the validation, so it isn't reported.)
+    for (const auto& r : tx->read_set) {
+        if (!r.record || (r.tid & RecordInfo::kAbsentBit))
+            continue;
+        uint64_t tid = r.record->tid.load(memory_order_acquire);
+        if ((tid & ~RecordInfo::kLockBit) == r.tid &&
+            (!(tid & RecordInfo::kLockBit) || is_locked_by_me(r.record)))
+            scheduler_->log(tx->id(), Key(r.key), Read);
+    }
+
+    // Phase 2: validate the read set
+    for (const auto& r : tx->read_set) {
+        RecordInfo* record = r.record;
+        if (!record) {
+            // the key must still be nonexistent
+            shared_lock<shared_mutex> latch(latch_);
+            record = table->find(Key(r.key));
+            if (!record)
+                continue;
+        }
+        uint64_t tid = record->tid.load(memory_order_acquire);
+        bool changed = r.record
+            ? ((tid & ~RecordInfo::kLockBit) != r.tid)
+            : !(tid & RecordInfo::kAbsentBit);
+        if (changed || ((tid & RecordInfo::kLockBit) && !is_locked_by_me(record))) {
+            unlock_all();
+            return false;
+        }
+        max_tid = max(max_tid, r.tid & RecordInfo::kVersionMask);
+    }
+    // The ranges scanned must have the same records (phantoms). A record
+    // updated or deleted since fails the read set validation above, so it
+    // is enough to count the present ones (the write set isn't installed
+    // yet).
+    for (const auto& scan : tx->scan_set) {
+        size_t count = 0;
+        bool locked_by_others = false;
+        {
+            shared_lock<shared_mutex> latch(latch_);
+            auto visit = [&](const Key& key, RecordInfo& record) {
+                if (scan.end && key >= *scan.end)
+                    return !table->ordered();
+                if (key < scan.begin)
+                    return true;
+                uint64_t tid = record.tid.load(memory_order_acquire);
+                if ((tid & RecordInfo::kLockBit) && !is_locked_by_me(&record)) {
+                    locked_by_others = true;
+                    return false;
+                }
+                if (!(tid & RecordInfo::kAbsentBit))
+                    count++;
+                return true;
+            };
+            table->for_each_from(scan.begin, visit);
+        }
+        if (locked_by_others || count != scan.count) {
+            unlock_all();
+            return false;
+        }
+    }
+
+    if (tx->write_set.empty())
+        return true;
+    uint64_t commit_tid = max_tid + RecordInfo::kVersionUnit;
+    uint64_t lsn = ticket ? enqueue_log(tx, ticket) : append_log(tx);
+    // (reported before the install, so before any read of the new values)
+    for (const auto& entry : tx->write_set) {
+        scheduler_->log(tx->id(), entry.first, Write);
+    }
+
+    // Phase 3: install the writes and unlock
+    size_t i = 0;
     for (const auto& [key, value] : tx->write_set) {
-        if (value.first == New)
-            table[key].value = value.second;
-        else
-            table.erase(key);
+        RecordInfo* record = locked[i++];
+        install_version(record, ts, value.first, value.second);
+        if (value.first == New) {
+            record->value = value.second;
+            record->tid.store(commit_tid, memory_order_release);
+        } else {
+            // Deleted records stay in the index as absent records since
+            // concurrent readers may hold pointers to them.
+            record->tid.store(commit_tid | RecordInfo::kAbsentBit,
+                              memory_order_release);
+        }
     }
+    end_commit(ts);
+
+    mark_applied(lsn);
+    return true;
 }
 
-string DataBase::serialize(DBDiff diff) {
-    string buf = "{\n";
-    for (const auto& [key, value] : diff) {
-        buf += make_log_format(value.first, key, value.second);
+bool DataBase::read_serialized(Transaction* tx, const Key& key,
+                               optional<Value>* value) {
+    RecordInfo* record;
+    uint64_t tid;
+    {
+        lock_guard<mutex> lock(graph_mtx_);
+        if (!graph_.read(tx->id(), key)) {
+            graph_.finish(tx->id(), false);
+            return false;
+        }
+        // The TID tells the read's place among the installs: a writer
+        // ahead of it in the graph has locked the record (or installed)
+        // before releasing |graph_mtx_| (see commit_serialized()).
+        {
+            shared_lock<shared_mutex> latch(latch_);
+            record = table->find(key);
+        }
+        tid = record ? record->tid.load(memory_order_acquire) : 0;
+        // (reported before any commit can overwrite the value)
+        scheduler_->log(tx->id(), key, Read);
+    }
+    *value = nullopt;
+    if (!record || (tid & RecordInfo::kObsoleteBit))
+        return true;
+
+    // Reads the install of the writer ahead, and no later one
+    uint64_t expected = (tid & RecordInfo::kVersionMask) +
+        ((tid & RecordInfo::kLockBit) ? RecordInfo::kVersionUnit : 0);
+    Value v;
+    uint64_t seen = stable_read(record, &v);
+    if ((seen & RecordInfo::kVersionMask) != expected) {
+        lock_guard<mutex> lock(graph_mtx_);
+        graph_.finish(tx->id(), false);
+        return false;
     }
-    buf += "}\n";
-    return buf;
+    if (!(seen & RecordInfo::kAbsentBit))
+        *value = move(v);
+    return true;
 }
 
-void DataBase::deserialize(DBDiff& diff, vector<string> buf) {
-    for (const auto& line : buf) {
-        vector<string> fields = words(line);
-        if (fields.size() != 4) {
-            diff = {};
-            return;
+void DataBase::scan_serialized(Transaction* tx, const Key& begin,
+                               const optional<Key>& end) {
+    lock_guard<mutex> lock(graph_mtx_);
+    graph_.read_range(tx->id(), begin, end);
+}
+
+void DataBase::forget_serialized(Transaction* tx) {
+    lock_guard<mutex> lock(graph_mtx_);
+    graph_.finish(tx->id(), false);  // (no-op if committed)
+}
+
+bool DataBase::commit_serialized(Transaction* tx, uint64_t* ticket) {
+    vector<Key> keys;
+    keys.reserve(tx->write_set.size());
+    for (const auto& entry : tx->write_set) {
+        keys.push_back(entry.first);
+    }
+    vector<RecordInfo*> records;
+    records.reserve(keys.size());
+    {
+        lock_guard<mutex> lock(graph_mtx_);
+        if (!graph_.write(tx->id(), keys)) {
+            graph_.finish(tx->id(), false);
+            return false;
         }
-        // checksum validation
-        string str = fields[1] + fields[2] + fields[3];
-        if (((unsigned int) stol(fields[0])) != crc32(str)) {
-            diff = {};
-            return;
+        graph_.finish(tx->id(), true);
+        if (keys.empty())
+            return true;
+        // Locking the records is the place of the commit among the
+        // installs: the later readers and writers of the keys in the graph
+        // wait for the lock bits, so the writes are logged and installed
+        // in the order of the graph without |graph_mtx_|. A transaction
+        // may read them before they are durable, but its own record comes
+        // later in the log.
+        for (const auto& [key, value] : tx->write_set) {
+            records.push_back(lock_record(key, value.first == New));
+        }
+        for (const Key& key : keys) {
+            scheduler_->log(tx->id(), key, Write);
         }
-        diff[fields[1]] = make_pair(
-                stoi(fields[2]) ? Delete : New,
-                stoi(fields[3]));
     }
-    return;
+    uint64_t queued;
+    uint64_t lsn = enqueue_log(tx, &queued);
+    install_writes(tx, records);
+    if (ticket)
+        *ticket = queued;
+    else
+        wait_durable(queued);
+    mark_applied(lsn);
+    return true;
 }
 
-string DataBase::make_log_format(ChangeMode mode, Key key, int val) {
-    string seed = key + to_string(mode) + to_string(val);
-    string buf;
-    buf += to_string(crc32(seed)) + " ";
-    buf += key + " ";
-    buf += to_string(mode) + " ";
-    buf += to_string(val) + "\n";
-    return buf;
-}
-
-ConflictGraph::ConflictGraph(vector<Scheduler::Log> logs) {
-    map<Key, vector<pair<int, BaseOp>>> tbl = {};
-
-    for (const auto& log : logs) {
-        if (!vexists(nodes_, log.id))
-            nodes_.push_back(log.id);
-        tbl[log.key].emplace_back(log.id, log.op);
-    }
-
-    for (const auto& [key, logs] : tbl) {
-        int nlock = 0;
-        vector<int> lock_holder_ids = {};
-
-        for (const auto& l : logs) {
-            int myid = l.first;
-            int action = l.second;
-
-            if (action == Read) {
-                if (nlock >= 0) {
-                    // read -> read (no conflict)
-                    nlock++;
-                    lock_holder_ids.push_back(myid);
-                } else if (nlock == -1) {
-                    // write -> read conflict
-                    add_edge(lock_holder_ids[0], myid, WriteRead);
-                    lock_holder_ids = {myid};
-                    nlock = 1;
-                }
-            }
+bool DataBase::has_key(const Key& key) {
+    shared_lock<shared_mutex> latch(latch_);
+    RecordInfo* record = table->find(key);
+    return record && record->present();
+}
 
-            if (l.second == Write) {
-                if (nlock >= 0) {
-                    // read -> write conflict
-                    for (const auto& other_id : lock_holder_ids) {
-                        add_edge(other_id, myid, ReadWrite);
-                    }
-                } else if (nlock == -1) {
-                    // write -> write conflict
-                    add_edge(lock_holder_ids[0], myid, WriteWrite);
-                }
-                lock_holder_ids = {myid};
-                nlock = -1;
-            }
-            // cout << key << " " << l.first << " " << l.second << endl;
+optional<Value> DataBase::read(const Key& key) {
+    RecordInfo* record;
+    {
+        shared_lock<shared_mutex> latch(latch_);
+        record = table->find(key);
+    }
+    // (installs don't take the latch)
+    Value value;
+    if (!record || (stable_read(record, &value) & RecordInfo::kAbsentBit))
+        return nullopt;
+    return value;
+}
+
+vector<Key> DataBase::keys() {
+    shared_lock<shared_mutex> latch(latch_);
+    vector<Key> v;
+    v.reserve(table->size());
+    table->for_each([&](const Key& key, RecordInfo& record) {
+        if (record.present())
+            v.push_back(key);
+        return true;
+    });
+    return v;
+}
+
+uint64_t DataBase::register_tx(size_t* slot) {
+    nactive_txs_++;
+    static atomic<size_t> nthreads = 0;
+    static thread_local size_t home = nthreads++;
+    uint64_t ts = visible_ts_;
+    for (size_t i = 0; i < kSnapshotSlots; i++) {
+        *slot = (home + i) % kSnapshotSlots;
+        uint64_t none = kNoSnapshot;
+        if (!snapshots_[*slot].ts.compare_exchange_strong(none, ts))
+            continue;
+        // oldest_snapshot() may have missed the slot and taken a newer
+        // |visible_ts_| than |ts|, but not newer than this one
+        uint64_t now = visible_ts_;
+        if (now != ts) {
+            snapshots_[*slot].ts = now;
+            ts = now;
         }
+        return ts;
+    }
+    *slot = kSnapshotSlots;
+    lock_guard<mutex> lock(mvcc_mtx_);
+    ts = visible_ts_;
+    overflow_snapshots_.insert(ts);
+    return ts;
+}
+
+void DataBase::unregister_tx(uint64_t snapshot_ts, size_t slot) {
+    nactive_txs_--;
+    if (slot < kSnapshotSlots) {
+        snapshots_[slot].ts.store(kNoSnapshot, memory_order_release);
+        return;
     }
+    lock_guard<mutex> lock(mvcc_mtx_);
+    overflow_snapshots_.erase(overflow_snapshots_.find(snapshot_ts));
 }
 
-void ConflictGraph::emit() {
-    FILE* fp_out = fopen(graphfilename_.c_str(), "w");
+uint64_t DataBase::oldest_snapshot() {
+    uint64_t oldest = kNoSnapshot;
+    for (size_t i = 0; i < kSnapshotSlots; i++) {
+        oldest = min(oldest, snapshots_[i].ts.load());
+    }
+    lock_guard<mutex> lock(mvcc_mtx_);
+    if (!overflow_snapshots_.empty())
+        oldest = min(oldest, *overflow_snapshots_.begin());
+    return oldest;
+}
 
-    vector<int> serial_schedule = serialize();
+uint64_t DataBase::begin_commit() {
+    return ++commit_ts_;
+}
 
-    fprintf(fp_out, "/*\n");
-    fprintf(fp_out, "serial schedule:\n");
-    for (const auto& n : serial_schedule) {
-        fprintf(fp_out, "%d\n", n);
+void DataBase::end_commit(uint64_t ts) {
+    // The slot is reused by |ts| once the commit |kEndedSlots| earlier has
+    // become visible (practically never waits).
+    while (visible_ts_.load(memory_order_acquire) + kEndedSlots <= ts) {
+        this_thread::yield();
     }
-    fprintf(fp_out, " */\n");
+    ended_[ts % kEndedSlots].store(ts, memory_order_release);
+    // Whoever ends the next commit moves the visible timestamp on
+    uint64_t visible = visible_ts_.load(memory_order_acquire);
+    while (ended_[(visible + 1) % kEndedSlots].load(memory_order_acquire) ==
+           visible + 1) {
+        visible_ts_.compare_exchange_weak(visible, visible + 1);
+        visible = visible_ts_.load(memory_order_acquire);
+    }
+}
 
-    fprintf(fp_out, "digraph g {\n");
-    for (const auto& n : nodes_) {
-        fprintf(fp_out, "    Tx%d;\n", n);
+void DataBase::install_version(
+        RecordInfo* record, uint64_t ts, ChangeMode mode, const Value& value) {
+    RecordInfo::Version* v = new RecordInfo::Version();
+    v->ts = ts;
+    v->value = value;
+    v->deleted = (mode == Delete);
+    v->older = record->versions.load(memory_order_relaxed);
+    record->versions.store(v, memory_order_release);
+}
+
+// Returns the newest version of |record| in the snapshot at |ts|
+static const RecordInfo::Version* visible_version(
+        const RecordInfo* record, uint64_t ts) {
+    const RecordInfo::Version* v = record->versions.load(memory_order_acquire);
+    while (v && v->ts > ts) {
+        v = v->older;
     }
-    for (const auto& e : edges_) {
-        string conflict_type =
-            (e.type == ReadWrite) ? "r-w" :
-            (e.type == WriteRead) ? "w-r" : "w-w";
-        fprintf(fp_out, "    Tx%d -> Tx%d [label = \"%s\"];\n",
-                e.from, e.to, conflict_type.c_str());
+    return v;
+}
+
+optional<Value> DataBase::read_snapshot(const Key& key, uint64_t ts) {
+    RecordInfo* record;
+    {
+        // (commits hold the latch exclusively only to insert new keys)
+        shared_lock<shared_mutex> latch(latch_);
+        record = table->find(key);
     }
-    fprintf(fp_out, "}\n");
-    fclose(fp_out);
+    if (!record)
+        return nullopt;
+    // The versions seen by |ts| are never modified nor freed while the
+    // snapshot is active (see collect_garbage()).
+    const RecordInfo::Version* v = visible_version(record, ts);
+    if (!v || v->deleted)
+        return nullopt;
+    return v->value;
 }
 
-vector<int> ConflictGraph::serialize() {  // 全然効率的ではないです
-    vector<int> ret = {};
-    map<int, set<int>> outgoing_edges = {};
-    map<int, set<int>> incoming_edges = {};
-    set<int> nodes_without_parent(nodes_.begin(), nodes_.end());
+vector<Key> DataBase::keys_snapshot(uint64_t ts) {
+    shared_lock<shared_mutex> latch(latch_);
+    vector<Key> v;
+    table->for_each([&](const Key& key, RecordInfo& record) {
+        const RecordInfo::Version* version = visible_version(&record, ts);
+        if (version && !version->deleted)
+            v.push_back(key);
+        return true;
+    });
+    return v;
+}
 
-    // initialization
-    for (const auto& e : edges_) {
-        if (outgoing_edges.count(e.from) <= 0) {
-            outgoing_edges[e.from] = {e.to};
-        } else {
-            outgoing_edges[e.from].insert(e.to);
+bool DataBase::prune_versions(RecordInfo* record, uint64_t horizon) {
+    // Every active snapshot stops at |keep| or a newer version. Committers
+    // only prepend versions, so the tail can be cut without locking.
+    RecordInfo::Version* head = record->versions.load(memory_order_acquire);
+    RecordInfo::Version* keep = head;
+    while (keep && keep->ts > horizon) {
+        keep = keep->older;
+    }
+    if (!keep)
+        return false;
+    RecordInfo::Version* v = keep->older;
+    keep->older = nullptr;
+    while (v) {
+        RecordInfo::Version* older = v->older;
+        if (v != &record->base)
+            delete v;
+        v = older;
+    }
+    return keep == head && keep->deleted;
+}
+
+void DataBase::collect_garbage() {
+    // (|visible_ts_| is read before the slots; see register_tx())
+    uint64_t horizon = visible_ts_;
+    horizon = min(horizon, oldest_snapshot());
+
+    // Committers only prepend versions, so the shared latch (against
+    // inserts) is enough to prune them.
+    vector<Key> deleted;
+    {
+        shared_lock<shared_mutex> latch(latch_);
+        table->for_each([&](const Key& key, RecordInfo& record) {
+            if (prune_versions(&record, horizon))
+                deleted.push_back(key);
+            return true;
+        });
+    }
+
+    if (!deleted.empty()) {
+        unique_lock<shared_mutex> latch(latch_);
+        for (const auto& key : deleted) {
+            RecordInfo* record = table->find(key);
+            if (!record)
+                continue;
+            // Committers and validators of Optimistic may still hold the
+            // record, so it is locked forever and marked obsolete instead
+            // of being freed right away. The CAS fails if a commit has
+            // locked the record since |tid| was read.
+            uint64_t tid = record->tid.load();
+            if (!(tid & RecordInfo::kAbsentBit) || (tid & RecordInfo::kLockBit) ||
+                !prune_versions(record, horizon) ||
+                !record->tid.compare_exchange_strong(tid,
+                    tid | RecordInfo::kLockBit | RecordInfo::kObsoleteBit))
+                continue;
+            unique_ptr<RecordInfo> removed = table->release(key);
+            lock_guard<mutex> lock(mvcc_mtx_);
+            retired_.emplace_back(commit_ts_, move(removed));
         }
-        if (incoming_edges.count(e.to) <= 0) {
-            incoming_edges[e.to] = {e.from};
-        } else {
-            incoming_edges[e.to].insert(e.from);
+    }
+
+    // A transaction begun before the removal has a snapshot timestamp
+    // <= the timestamp of the removal.
+    uint64_t oldest = oldest_snapshot();
+    lock_guard<mutex> lock(mvcc_mtx_);
+    size_t nfreed = 0;
+    while (nfreed < retired_.size() && oldest > retired_[nfreed].first) {
+        nfreed++;
+    }
+    retired_.erase(retired_.begin(), retired_.begin() + nfreed);
+}
+
+size_t DataBase::count_versions() {
+    shared_lock<shared_mutex> latch(latch_);
+    size_t n = 0;
+    table->for_each([&n](const Key&, RecordInfo& record) {
+        for (auto v = record.versions.load(); v; v = v->older) {
+            n++;
         }
+        return true;
+    });
+    return n;
+}
+
+uint64_t DataBase::append_log(Transaction* tx) {
+    uint64_t ticket;
+    uint64_t lsn = enqueue_log(tx, &ticket);
+    wait_durable(ticket);
+    return lsn;
+}
+
+uint64_t DataBase::enqueue_log(Transaction* tx, uint64_t* ticket) {
+    lock_guard<mutex> lock(log_mtx_);
+    uint64_t lsn = next_lsn_++;
+    serialize(log_batch_, lsn, tx->id(), tx->write_set);
+    unapplied_lsns_.insert(lsn);
+    *ticket = ++nappended_;
+    nwaiting_commits_++;
+    log_cv_.notify_one();
+    return lsn;
+}
+
+void DataBase::wait_durable(uint64_t ticket) {
+    unique_lock<mutex> lock(log_mtx_);
+    durable_cv_.wait(lock, [this, ticket]{ return ndurable_ >= ticket; });
+}
+
+uint64_t DataBase::last_ticket() {
+    lock_guard<mutex> lock(log_mtx_);
+    return nappended_;
+}
+
+void DataBase::on_durable(function<void()> fn) {
+    lock_guard<mutex> lock(log_mtx_);
+    durable_callback_ = move(fn);
+}
+
+void DataBase::flush_log_loop() {
+    unique_lock<mutex> lock(log_mtx_);
+    while (true) {
+        log_cv_.wait(lock, [this]{
+            return stop_flusher_ || rotate_requested_ || !log_batch_.empty();
+        });
+        if (rotate_requested_ && log_batch_.empty()) {
+            // Everything up to |flushed_lsn_| has been written to the
+            // current file. Switch to a new file for the following records.
+            uint64_t lsn = flushed_lsn_;
+            lock.unlock();
+            close(fd_log_);
+            rename(logfilename_.c_str(), oldlogfilename_.c_str());
+            fd_log_ = open(logfilename_.c_str(),
+                    O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd_log_ < 0) {
+                perror("open");
+                exit(1);
+            }
+            fsync_dir(logfilename_);
+            lock.lock();
+            rotated_lsn_ = lsn;
+            rotate_requested_ = false;
+            ckpt_cv_.notify_all();
+            continue;
+        }
+        if (log_batch_.empty())
+            break;
+
+        // wait for other committers to join the batch
+        if (scheduler_->mode() == Scheduler::Concurrent) {
+            log_cv_.wait_for(lock, group_commit_.max_wait, [this]{
+                return stop_flusher_ ||
+                    log_batch_.size() >= group_commit_.max_batch_bytes ||
+                    (int) nwaiting_commits_ >= nactive_txs_;
+            });
+        }
+
+        // Swap the buffers so that the capacity is reused by the next batch
+        swap(log_batch_, log_flushing_);
+        log_batch_.clear();
+        uint64_t batch_end = nappended_;
+        flushed_lsn_ = next_lsn_ - 1;
+        nwaiting_commits_ = 0;
+        lock.unlock();
+
+        write_all(fd_log_, log_flushing_);
+        fsync(fd_log_);
+        nflushes_++;
+
+        lock.lock();
+        ndurable_ = batch_end;
+        durable_cv_.notify_all();
+        if (durable_callback_)
+            durable_callback_();
+    }
+}
+
+// [mode: u8] followed by an entry
+static const size_t kLogEntryHeaderSize = sizeof(uint8_t) + kEntryHeaderSize;
+
+void DataBase::serialize(
+        string& buf, uint64_t lsn, int txid, const DBDiff& diff) {
+    size_t start = buf.size();
+    LogRecordHeader header = {};
+    header.lsn = lsn;
+    header.txid = txid;
+    header.nentries = diff.size();
+    put(buf, header);
+
+    for (const auto& [key, value] : diff) {
+        make_log_format(buf, value.first, key, value.second);
     }
 
-    for (const auto& e : edges_) {
-        nodes_without_parent.erase(e.to);
+    // fill in the length and the checksum of the whole record
+    char* rec = buf.data() + start;
+    uint32_t length = buf.size() - start;
+    memcpy(rec + offsetof(LogRecordHeader, length), &length, sizeof(length));
+    uint32_t crc = crc32c(rec, length);
+    memcpy(rec + offsetof(LogRecordHeader, crc), &crc, sizeof(crc));
+}
+
+size_t DataBase::deserialize(char* rec, size_t len,
+        const function<void(const char*, uint32_t, ChangeMode, Value)>& fn) {
+    if (len < sizeof(LogRecordHeader))
+        return 0;
+    LogRecordHeader header;
+    memcpy(&header, rec, sizeof(header));
+    if (header.length < sizeof(header) || header.length > len)
+        return 0;
+
+    // checksum validation (over the record with the crc field zeroed)
+    const size_t crc_offset = offsetof(LogRecordHeader, crc);
+    const size_t crc_end = crc_offset + sizeof(header.crc);
+    Crc32c crc;
+    crc.update(rec, crc_offset);
+    crc.update_zeros(sizeof(header.crc));
+    crc.update(rec + crc_end, header.length - crc_end);
+    if (crc.value() != header.crc)
+        return 0;
+
+    // validate every entry before applying any of them
+    const char* end = rec + header.length;
+    const char* p = rec + sizeof(header);
+    for (uint32_t i = 0; i < header.nentries; i++) {
+        if (p + kLogEntryHeaderSize > end)
+            return 0;
+        size_t size = sizeof(uint8_t) + entry_size(p + sizeof(uint8_t));
+        if (size > (size_t) (end - p))
+            return 0;
+        p += size;
     }
+    if (p != end)
+        return 0;
+
+    p = rec + sizeof(header);
+    for (uint32_t i = 0; header.lsn > ckpt_lsn_ && i < header.nentries; i++) {
+        uint8_t mode = get<uint8_t>(p);
+        const char* entry = p + sizeof(uint8_t);
+        string_view key = entry_key(entry);
+        fn(key.data(), key.size(), (ChangeMode) mode, entry_value(entry));
+        p += sizeof(uint8_t) + entry_size(entry);
+    }
+    return header.length;
+}
+
+void DataBase::make_log_format(
+        string& buf, ChangeMode mode, const Key& key, const Value& val) {
+    put<uint8_t>(buf, mode);
+    put_entry(buf, key, val);
+}
 
-    // find serializable schedule
-    while (!nodes_without_parent.empty()) {
-        auto n = nodes_without_parent.begin();
-        int node = *n;
-        nodes_without_parent.erase(n);
-        ret.push_back(node);
+uint64_t ConflictGraph::node_of(int txid) {
+    auto it = running_.find(txid);
+    if (it != running_.end())
+        return it->second;
+    uint64_t id = next_id_++;
+    nodes_[id].ord = next_ord_++;  // (no edges yet, so the last is fine)
+    running_[txid] = id;
+    return id;
+}
 
-        for (const auto& m : outgoing_edges[node]) {
-            incoming_edges[m].erase(node);
+bool ConflictGraph::read(int txid, const Key& key) {
+    uint64_t id = node_of(txid);
+    KeyState& state = keys_[key];
+    if (vexists(state.readers, id))
+        return true;
+    // write -> read conflict
+    if (state.writer != 0 && !add_edge(state.writer, id))
+        return false;
+    // read -> read (no conflict)
+    state.readers.push_back(id);
+    nodes_[id].keys.push_back(key);
+    return true;
+}
 
-            if (incoming_edges[m].empty()) {
-                nodes_without_parent.insert(m);
+bool ConflictGraph::write(int txid, span<const Key> keys) {
+    uint64_t id = node_of(txid);
+    for (const Key& key : keys) {
+        auto it = keys_.find(key);
+        if (it != keys_.end()) {
+            // read -> write and write -> write conflicts
+            KeyState& state = it->second;
+            for (uint64_t reader : state.readers) {
+                if (!add_edge(reader, id))
+                    return false;
             }
+            if (state.writer != 0 && !add_edge(state.writer, id))
+                return false;
         }
-        outgoing_edges.erase(node);
+        // read -> write conflicts with the ranges scanned (phantoms)
+        for (uint64_t n : ranged_) {
+            for (const Range& range : nodes_[n].ranges) {
+                if (key < range.begin || (range.end && key >= *range.end))
+                    continue;
+                if (!add_edge(n, id))
+                    return false;
+                break;
+            }
+        }
+    }
+    for (const Key& key : keys) {
+        KeyState& state = keys_[key];
+        state.writer = id;
+        state.readers.clear();
+        nodes_[id].keys.push_back(key);
     }
+    return true;
+}
+
+void ConflictGraph::read_range(int txid, const Key& begin,
+                               const optional<Key>& end) {
+    uint64_t id = node_of(txid);
+    nodes_[id].ranges.push_back({begin, end});
+    ranged_.insert(id);
+}
+
+void ConflictGraph::finish(int txid, bool committed) {
+    auto it = running_.find(txid);
+    if (it == running_.end())
+        return;
+    uint64_t id = it->second;
+    running_.erase(it);
+    Node& node = nodes_[id];
+    if (committed) {
+        node.committed = true;
+        prune(id);
+        return;
+    }
+
+    // An aborted transaction didn't happen.
+    for (uint64_t from : node.in) {
+        nodes_[from].out.erase(id);
+    }
+    vector<uint64_t> successors(node.out.begin(), node.out.end());
+    for (uint64_t to : successors) {
+        nodes_[to].in.erase(id);
+    }
+    forget_keys(id);
+    ranged_.erase(id);
+    nodes_.erase(id);
+    for (uint64_t to : successors) {
+        prune(to);
+    }
+}
 
-    // check if cycle exists
-    if (!outgoing_edges.empty()) {
-        return {};
+void ConflictGraph::add(const History::Event& event) {
+    switch (event.op) {
+        case History::Read:
+            read(event.txid, Key(event.key));
+            break;
+        case History::Write:
+            write(event.txid, Key(event.key));
+            break;
+        case History::Commit:
+        case History::Abort:
+            finish(event.txid, event.op == History::Commit);
+            break;
+        default:
+            break;
     }
-    return ret;
 }
 
-void ConflictGraph::add_edge(int from, int to, ConflictType type) {
+bool ConflictGraph::add_edge(uint64_t from, uint64_t to) {
     if (from == to)  // don't add loop
+        return true;
+    Node& u = nodes_[from];
+    Node& v = nodes_[to];
+    if (u.out.count(to) > 0)
+        return true;
+
+    if (u.ord > v.ord) {
+        // The nodes between |v| and |u| in the order are reordered so that
+        // the ones reaching |u| come before the ones reachable from |v|.
+        vector<uint64_t> forward, backward;
+        if (!search(to, true, u.ord, from, &forward)) {
+            // |u| is reachable from |v|: the history is not serializable.
+            // (The edge is not added to keep the order.)
+            ncycles_++;
+            return false;
+        }
+        search(from, false, v.ord, 0, &backward);
+        auto by_ord = [this](uint64_t a, uint64_t b) {
+            return nodes_[a].ord < nodes_[b].ord;
+        };
+        sort(forward.begin(), forward.end(), by_ord);
+        sort(backward.begin(), backward.end(), by_ord);
+        vector<uint64_t> ords;
+        for (uint64_t n : backward) {
+            ords.push_back(nodes_[n].ord);
+        }
+        for (uint64_t n : forward) {
+            ords.push_back(nodes_[n].ord);
+        }
+        sort(ords.begin(), ords.end());
+        size_t i = 0;
+        for (uint64_t n : backward) {
+            nodes_[n].ord = ords[i++];
+        }
+        for (uint64_t n : forward) {
+            nodes_[n].ord = ords[i++];
+        }
+    }
+    u.out.insert(to);
+    v.in.insert(from);
+    return true;
+}
+
+bool ConflictGraph::search(uint64_t start, bool forward, uint64_t bound,
+                           uint64_t stop, vector<uint64_t>* visited) {
+    unordered_set<uint64_t> seen = {start};
+    vector<uint64_t> stack = {start};
+    while (!stack.empty()) {
+        uint64_t id = stack.back();
+        stack.pop_back();
+        visited->push_back(id);
+        Node& node = nodes_[id];
+        for (uint64_t next : forward ? node.out : node.in) {
+            if (next == stop)
+                return false;
+            uint64_t ord = nodes_[next].ord;
+            bool inside = forward ? ord < bound : ord > bound;
+            if (inside && seen.insert(next).second)
+                stack.push_back(next);
+        }
+    }
+    return true;
+}
+
+void ConflictGraph::forget_keys(uint64_t id) {
+    for (const auto& key : nodes_[id].keys) {
+        auto it = keys_.find(key);
+        if (it == keys_.end())
+            continue;
+        KeyState& state = it->second;
+        if (state.writer == id)
+            state.writer = 0;
+        erase(state.readers, id);
+        if (state.writer == 0 && state.readers.empty())
+            keys_.erase(it);
+    }
+}
+
+void ConflictGraph::prune(uint64_t id) {
+    vector<uint64_t> candidates = {id};
+    while (!candidates.empty()) {
+        id = candidates.back();
+        candidates.pop_back();
+        auto it = nodes_.find(id);
+        if (it == nodes_.end() || !it->second.committed ||
+            !it->second.in.empty())
+            continue;
+        for (uint64_t to : it->second.out) {
+            nodes_[to].in.erase(id);
+            candidates.push_back(to);
+        }
+        // Edges from it no longer matter, so the keys forget it too.
+        forget_keys(id);
+        ranged_.erase(id);
+        nodes_.erase(it);
+    }
+}
+
+// ---------------------------------- History ----------------------------------
+
+static const char kTraceMagic[8] = {'S', 'C', 'D', 'B', 'H', 'I', 'S', 'T'};
+
+History::~History() {
+    if (trace_) {
+        flush_trace();
+        fclose(trace_);
+    }
+}
+
+void History::trace(const string& filename) {
+    if (trace_) {
+        flush_trace();
+        fclose(trace_);
+    }
+    trace_ = fopen(filename.c_str(), "wb");
+    if (!trace_) {
+        perror("fopen");
+        exit(1);
+    }
+    trace_buf_.assign(kTraceMagic, sizeof(kTraceMagic));
+    defined_.assign(names_.size(), false);
+}
+
+uint32_t History::intern(const Key& key) {
+    auto it = ids_.find(key);
+    if (it != ids_.end())
+        return it->second;
+    uint32_t id;
+    if (free_ids_.empty()) {
+        id = names_.size();
+        names_.push_back(nullptr);
+        refs_.push_back(0);
+    } else {
+        id = free_ids_.back();
+        free_ids_.pop_back();
+    }
+    it = ids_.emplace(key, id).first;
+    names_[id] = &it->first;
+    return id;
+}
+
+void History::unref(uint32_t id) {
+    if (--refs_[id] > 0)
         return;
-    edges_.emplace_back(from, to, type);
+    ids_.erase(ids_.find(*names_[id]));
+    names_[id] = nullptr;
+    free_ids_.push_back(id);
+    // (defined again in the trace for the next key)
+    if (id < defined_.size())
+        defined_[id] = false;
+}
+
+void History::record(int txid, const Key& key, BaseOp rw) {
+    uint32_t id = intern(key);
+    if (trace_) {
+        if (id >= defined_.size())
+            defined_.resize(id + 1, false);
+        if (!defined_[id]) {
+            put<uint32_t>(trace_buf_, key.size());
+            put<uint32_t>(trace_buf_, id << kOpBits | Define);
+            trace_buf_ += key;
+            trace_buf_.append(-key.size() & 7, '\0');
+            defined_[id] = true;
+        }
+    }
+    append({(uint32_t) txid, id << kOpBits | (rw == ::Read ? Read : Write)});
+}
+
+void History::record_finish(int txid, bool committed) {
+    append({(uint32_t) txid, committed ? Commit : Abort});
+}
+
+void History::append(Record record) {
+    if (ring_.empty())
+        ring_.resize(capacity_);
+    // (counted first, since the record overwritten may have the same key)
+    if (has_key(record))
+        refs_[record.key_op >> kOpBits]++;
+    Record& slot = ring_[nrecords_++ % capacity_];
+    if (nrecords_ > capacity_ && has_key(slot))
+        unref(slot.key_op >> kOpBits);
+    slot = record;
+    if (!trace_)
+        return;
+    put<uint32_t>(trace_buf_, record.txid);
+    put<uint32_t>(trace_buf_, record.key_op);
+    if (trace_buf_.size() >= kTraceBufBytes)
+        flush_trace();
+}
+
+void History::flush_trace() {
+    if (fwrite(trace_buf_.data(), 1, trace_buf_.size(), trace_) !=
+        trace_buf_.size()) {
+        perror("fwrite");
+        exit(1);
+    }
+    fflush(trace_);
+    trace_buf_.clear();
+}
+
+void History::for_each(const function<void(const Event&)>& fn) const {
+    for (size_t i = nrecords_ - size(); i < nrecords_; i++) {
+        const Record& r = ring_[i % capacity_];
+        Op op = (Op) (r.key_op & kOpMask);
+        string_view key = (op == Read || op == Write)
+            ? string_view(*names_[r.key_op >> kOpBits]) : string_view();
+        fn({(int) r.txid, op, key});
+    }
+}
+
+bool History::replay(const string& filename,
+                     const function<void(const Event&)>& fn) {
+    FILE* fp = fopen(filename.c_str(), "rb");
+    if (!fp)
+        return false;
+    char magic[sizeof(kTraceMagic)];
+    bool ok = fread(magic, 1, sizeof(magic), fp) == sizeof(magic) &&
+              memcmp(magic, kTraceMagic, sizeof(magic)) == 0;
+    vector<string> names;
+    while (ok) {
+        Record r;
+        size_t n = fread(&r, 1, sizeof(r), fp);
+        if (n < sizeof(r)) {
+            ok = (n == 0);  // torn otherwise
+            break;
+        }
+        Op op = (Op) (r.key_op & kOpMask);
+        uint32_t id = r.key_op >> kOpBits;
+        if (op == Define) {
+            // |txid| is the length of the key
+            string key(r.txid + (-r.txid & 7), '\0');
+            ok = fread(key.data(), 1, key.size(), fp) == key.size();
+            key.resize(r.txid);
+            if (id >= names.size())
+                names.resize(id + 1);
+            names[id] = move(key);
+            continue;
+        }
+        if (op > Define || ((op == Read || op == Write) && id >= names.size())) {
+            ok = false;
+            break;
+        }
+        string_view key = (op == Read || op == Write)
+            ? string_view(names[id]) : string_view();
+        fn({(int) r.txid, op, key});
+    }
+    fclose(fp);
+    return ok;
+}
+
+void History::emit(const string& filename) const {
+    // The transactions in the ring. A transaction reused after it finished
+    // (e.g. retried) is another one.
+    struct Tx {
+        int txid;
+        bool finished = false;
+        bool committed = false;
+        map<size_t, const char*> out = {};  // edges and their labels
+        size_t nin = 0;
+    };
+    vector<Tx> txs;
+    vector<size_t> owner;  // event -> index in |txs|
+    unordered_map<int, size_t> running;
+    for_each([&](const Event& e) {
+        auto [it, inserted] = running.try_emplace(e.txid, txs.size());
+        if (inserted)
+            txs.push_back({e.txid});
+        owner.push_back(it->second);
+        if (e.op == Commit || e.op == Abort) {
+            txs[it->second].finished = true;
+            txs[it->second].committed = (e.op == Commit);
+            running.erase(it);
+        }
+    });
+
+    // conflicts between the transactions not aborted
+    struct Accessors {
+        size_t writer = SIZE_MAX;
+        vector<size_t> readers = {};
+    };
+    unordered_map<string_view, Accessors> keys;
+    auto add_edge = [&](size_t from, size_t to, const char* label) {
+        if (from != to && txs[from].out.emplace(to, label).second)
+            txs[to].nin++;
+    };
+    size_t i = 0;
+    for_each([&](const Event& e) {
+        size_t t = owner[i++];
+        if ((txs[t].finished && !txs[t].committed) ||
+            (e.op != Read && e.op != Write))
+            return;
+        Accessors& a = keys[e.key];
+        if (e.op == Read) {
+            if (a.writer != SIZE_MAX)
+                add_edge(a.writer, t, "w-r");
+            if (!vexists(a.readers, t))
+                a.readers.push_back(t);
+        } else {
+            for (size_t r : a.readers) {
+                add_edge(r, t, "r-w");
+            }
+            if (a.writer != SIZE_MAX)
+                add_edge(a.writer, t, "w-w");
+            a.writer = t;
+            a.readers.clear();
+        }
+    });
+
+    // a serial order (Kahn's algorithm); the transactions left are in cycles
+    vector<size_t> order;
+    vector<size_t> nin(txs.size());
+    deque<size_t> ready;
+    for (size_t t = 0; t < txs.size(); t++) {
+        nin[t] = txs[t].nin;
+        if (txs[t].committed || !txs[t].finished) {
+            if (nin[t] == 0)
+                ready.push_back(t);
+        }
+    }
+    while (!ready.empty()) {
+        size_t t = ready.front();
+        ready.pop_front();
+        order.push_back(t);
+        for (const auto& [to, label] : txs[t].out) {
+            if (--nin[to] == 0)
+                ready.push_back(to);
+        }
+    }
+    size_t nlive = count_if(txs.begin(), txs.end(), [](const Tx& t) {
+        return t.committed || !t.finished;
+    });
+
+    FILE* fp_out = fopen(filename.c_str(), "w");
+    fprintf(fp_out, "/*\n");
+    if (order.size() < nlive) {
+        fprintf(fp_out, "not serializable: %zu transactions in cycles\n",
+                nlive - order.size());
+    }
+    fprintf(fp_out, "serial schedule:\n");
+    for (size_t t : order) {
+        fprintf(fp_out, "%d%s\n", txs[t].txid,
+                txs[t].finished ? "" : " (running)");
+    }
+    fprintf(fp_out, " */\n");
+
+    fprintf(fp_out, "digraph g {\n");
+    for (const Tx& t : txs) {
+        if (t.committed || !t.finished)
+            fprintf(fp_out, "    Tx%d;\n", t.txid);
+    }
+    for (const Tx& t : txs) {
+        for (const auto& [to, label] : t.out) {
+            fprintf(fp_out, "    Tx%d -> Tx%d [label = \"%s\"];\n",
+                    t.txid, txs[to].txid, label);
+        }
+    }
+    fprintf(fp_out, "}\n");
+    fclose(fp_out);
 }
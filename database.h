@@ -1,14 +1,31 @@
 #ifndef __DATABASE_H__
 #define __DATABASE_H__
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <coroutine>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
 #include <functional>
+#include <future>
 #include <map>
+#include <memory_resource>
+#include <mutex>
 #include <optional>
+#include <set>
+#include <shared_mutex>
+#include <span>
 #include <string>
+#include <string_view>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
+#include "index.h"
 #include "utils.h"
 using namespace std;
 
@@ -26,173 +43,1094 @@ enum BaseOp {
     Write,
 };
 
-using Key = string;
-using DBDiff = map<Key, pair<ChangeMode, int>>;
+// (a write set allocates its nodes from Transaction::arena)
+using DBDiff = pmr::map<Key, pair<ChangeMode, Value>>;
+
+// Result of acquiring a lock (TwoPhaseLocking)
+enum LockResult {
+    Locked,
+    MustWait,   // RoundRobin: retry after handing over the CPU
+    MustDie,    // wait-die: the transaction has to abort
+    NoSuchKey,
+};
+
+// Reader/Writer locks of keys (TwoPhaseLocking).
+// A key is locked through its lock ID (32 bits of its hash). The lock word
+// of the slot of the ID in a fixed table has a cache line of its own, so
+// acquiring or releasing a lock is usually a CAS on a line which no other
+// slot shares, without any lookup nor mutex. The word is held for one key
+// at a time and carries the tag (the upper bits) of its ID. Keys whose slot
+// is held for another key are locked in a table of overflow locks under a
+// mutex instead, so keys sharing a slot don't conflict (only keys sharing
+// the ID do). Waiters sleep on the word (atomic wait/notify).
+// Deadlocks are prevented by wait-die: a transaction which requests a lock
+// held by others waits only if it is older (has a smaller timestamp) than
+// all of them, and dies otherwise.
+class LockManager {
+    public:
+        static const size_t kSlots = 1 << 16;
+        // (from the hash carried by the key)
+        static uint32_t lock_id(const Key& key) {
+            return key.hash() ^ (key.hash() >> 32);
+        }
+
+        LockManager() : words_(new Word[kSlots]) {}
+
+        // Acquires the lock |id| for the transaction |ts|. |upgrade| tells
+        // that |ts| holds the read lock and requests the write lock.
+        // If it has to wait, blocks if |block| and returns MustWait otherwise.
+        LockResult acquire(uint32_t id, int ts, BaseOp type, bool upgrade,
+                           bool block);
+        // Releases the lock |id| held in |type|
+        void release(uint32_t id, BaseOp type);
+
+    private:
+        // bits 0-13  -> number of readers
+        // bit 14     -> some IDs of the slot are locked in |overflow_|
+        // bit 15     -> write locked
+        // bits 16-31 -> tag of the ID the word is held for
+        // bits 32-63 -> timestamp of the writer, or a lower bound of the
+        //               timestamps of the readers (the smallest one since
+        //               the number of readers was last 0)
+        struct alignas(64) Word {
+            atomic<uint64_t> bits = 0;
+            atomic<uint32_t> nwaiters = 0;
+        };
+        static const uint64_t kReaderUnit = 1;
+        static const uint64_t kReaderMask = 0x3FFF;
+        static const uint64_t kOverflowBit = 1 << 14;
+        static const uint64_t kWriterBit = 1 << 15;
+        static const int kTagShift = 16;
+        static const uint64_t kTagMask = 0xFFFFull << kTagShift;
+        static const int kTsShift = 32;
+
+        static uint32_t slot_of(uint32_t id) { return id & (kSlots - 1); }
+        static uint64_t tag_of(uint32_t id) {
+            return (uint64_t) (id >> 16) << kTagShift;
+        }
+        // Sets |desired| to |bits| granting |type| to |ts| (with the tag of
+        // |bits|) and returns Locked, or returns the wait-die result if the
+        // lock is held in conflict. A full reader count is a conflict too.
+        static LockResult grant(uint64_t bits, int ts, BaseOp type,
+                                bool upgrade, uint64_t* desired);
+        // acquire() of an ID which may be in |overflow_|
+        LockResult acquire_overflow(uint32_t id, int ts, BaseOp type,
+                                    bool upgrade, bool block);
+        void release_overflow(uint32_t id, BaseOp type);
+        // Sleeps until |word| changes from |bits| (which is updated)
+        void wait(Word& word, uint64_t& bits);
+
+        unique_ptr<Word[]> words_;
+        // An ID is never locked both in its word and in |overflow_|: the
+        // word is taken while the overflow bit is set only under the mutex,
+        // after checking |overflow_|.
+        mutex overflow_mtx_;               // guards the members below
+        condition_variable overflow_cv_;   // waiters for overflow locks
+        unordered_map<uint32_t, uint64_t> overflow_;  // ID -> bits (no tag)
+        unordered_map<uint32_t, size_t> noverflow_;   // slot -> IDs in it
+};
+
+// Predicate locks of the key ranges read by scans (TwoPhaseLocking), which
+// keep other transactions from inserting phantoms into them. A read of a
+// nonexistent key locks the range of the key alone. An insert of a
+// nonexistent key declares its intent here first; an intent conflicts with
+// a range containing the key and with another intent on the key, if they
+// belong to different transactions.
+// (Reads and writes of existing keys are covered by LockManager.)
+// Conflicts are resolved by wait-die like LockManager, but the caller never
+// blocks: it retries after MustWait.
+class RangeLockTable {
+    public:
+        // Locks [begin, end) for |ts| (no upper bound if |end| is nullopt)
+        LockResult lock_range(int ts, const Key& begin, const optional<Key>& end);
+        // Declares that |ts| is going to insert |key|
+        LockResult lock_insert(int ts, const Key& key);
+        // Releases the ranges and the intents of |ts|
+        void release(int ts);
+
+    private:
+        struct Range {
+            int ts;
+            Key begin;
+            optional<Key> end;
+        };
+
+        mutex mtx_;  // guards the members below
+        vector<Range> ranges_;
+        multimap<Key, int> inserts_;  // key -> timestamp of the inserter
+};
+
+// Tunables of the group commit of the redo log.
+// Commit records of concurrent transactions are gathered into one batch,
+// which is written with a single write() and made durable with a single
+// fsync(). The batch is flushed when one of the following holds:
+//   * its size reaches |max_batch_bytes|
+//   * |max_wait| has passed since the first record entered the batch
+//   * every running transaction is already waiting in the batch
+struct GroupCommitConfig {
+    size_t max_batch_bytes = 1 << 20;
+    chrono::microseconds max_wait = chrono::microseconds(500);
+};
+
+// Concurrency control protocol
+enum CCProtocol {
+    // Strict 2PL with reader/writer locks on records
+    TwoPhaseLocking,
+    // Silo-style optimistic concurrency control. Reads take no locks and
+    // are recorded in the read set with the version they saw; commit locks
+    // the write set, validates the read set and installs the writes.
+    Optimistic,
+    // Serialization graph testing. Operations take no locks and never wait:
+    // a read sees the last committed value and adds its conflicts to a
+    // conflict graph right away, and commit adds those of the write set and
+    // installs it. A transaction whose operation would close a cycle in the
+    // graph is aborted, so every history admitted is serializable.
+    SerializationGraph,
+};
+
+// Options given at the construction of DataBase
+struct DBOptions {
+    CCProtocol protocol = TwoPhaseLocking;
+    GroupCommitConfig group_commit;
+    Index::Type index = Index::BPlusTree;
+    // Interval of the background checkpointer (0 disables it)
+    chrono::milliseconds checkpoint_interval = chrono::milliseconds(1000);
+    // Number of threads replaying the log on startup
+    size_t recovery_threads = thread::hardware_concurrency();
+    // Reports every operation to the serializability checker of the
+    // scheduler (see Scheduler::log), which checks them on a thread of its
+    // own
+    bool check_serializability = true;
+};
+
+// Return type of the logic of coroutine transactions (Scheduler::Coroutine).
+// The coroutine starts suspended and is resumed by the scheduler.
+class TxCoroutine {
+    public:
+        struct promise_type {
+            TxCoroutine get_return_object() {
+                return TxCoroutine(coroutine_handle<promise_type>::from_promise(*this));
+            }
+            suspend_always initial_suspend() noexcept { return {}; }
+            suspend_always final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+        };
+
+        TxCoroutine() = default;
+        explicit TxCoroutine(coroutine_handle<promise_type> handle)
+            : handle_(handle) {}
+        TxCoroutine(TxCoroutine&& other) noexcept
+            : handle_(exchange(other.handle_, nullptr)) {}
+        TxCoroutine& operator=(TxCoroutine&& other) noexcept {
+            swap(handle_, other.handle_);
+            return *this;
+        }
+        ~TxCoroutine() {
+            if (handle_)
+                handle_.destroy();
+        }
+
+        bool done() const { return handle_.done(); }
+        void resume() { handle_.resume(); }
+
+    private:
+        coroutine_handle<promise_type> handle_ = nullptr;
+};
 
 class Transaction {
     public:
         using Logic = function<void(Transaction*)>;
+        using CoLogic = function<TxCoroutine(Transaction*)>;
 
         Transaction(int id, Logic logic, DataBase* db, Scheduler* scheduler);
 
+        // Locks of TwoPhaseLocking are prioritized by id(); since the ID is
+        // kept across retries, a transaction killed by wait-die eventually
+        // becomes the oldest one.
         void begin();
-        void commit();
+        // Starts a read-only transaction which reads the snapshot as of its
+        // start. It takes no locks, never waits for writers and never aborts.
+        void begin_read_only();
+        // Returns false if the transaction has been aborted instead
+        // (validation failure of Optimistic, wait-die of TwoPhaseLocking or a
+        // cycle of SerializationGraph). Once killed by wait-die (or a cycle),
+        // the operations up to commit() do nothing.
+        bool commit();
+        // Same as commit(), but doesn't wait for the commit to be durable
+        // (see DataBase::apply_tx()); it is once DataBase::durable(*ticket).
+        bool commit(uint64_t* ticket);
         void abort();
+        // Lock requests of the transaction return MustWait instead of
+        // blocking, as in RoundRobin and Coroutine modes. For callers of
+        // try_*() which retry later (Server).
+        void set_nonblocking() { nonblocking_ = true; }
+        bool nonblocking() const { return nonblocking_; }
 
-        bool set(Key key, int val);  // insert & update
-        optional<int> get(Key key);  // read
-        bool del(Key key);           // delete
+        bool set(const Key& key, const Value& val);  // insert & update
+        // read (a string is shared with the record, not copied)
+        optional<Value> get(const Key& key);
+        bool del(const Key& key);           // delete
         // Returns a set of all the existing key names.
-        // keys() does *not* support reader/writer lock.
+        // keys() does *not* support reader/writer lock; use scan() instead.
         vector<string> keys();
         // Repeat 'get' until it succeeds (e.g. the return value is not nullopt)
-        // and returns the content of the value.
-        int get_until_success(Key key);
+        // and returns the content of the value (0 if killed by wait-die).
+        Value get_until_success(const Key& key);
+
+        // Iterator over the keys of a range and their values in key order
+        // (see scan()). It reads the index lazily, a batch of keys at a time,
+        // and merges the write set on the fly, so the transaction sees its
+        // own writes. The transaction must outlive it. e.g.
+        //   for (auto it = tx->scan("a", "b"); it.valid(); it.next())
+        //       use(it.key(), it.value());
+        class Scan {
+            public:
+                bool valid() const { return valid_; }
+                const Key& key() const { return key_; }
+                const Value& value() const { return value_; }
+                // Moves to the next key (waits for its lock if necessary).
+                // The scan ends early if the transaction is killed.
+                void next();
+
+            private:
+                friend class Transaction;
+                Scan(Transaction* tx, Key begin, optional<Key> end, size_t limit);
+                // Reads the next batch of keys from the index into |batch_|.
+                // Returns false if the transaction is killed.
+                bool fetch();
 
+                Transaction* tx_;
+                optional<Key> end_;         // exclusive
+                size_t limit_;              // number of keys left to return
+                Key next_;                  // the keys < |next_| are visited
+                Key fetch_from_;            // the keys < |fetch_from_| are read
+                bool exhausted_ = false;    // the index has no more keys
+                deque<Key> batch_ = {};     // keys read but not visited yet
+                size_t scan_entry_ = 0;     // in |scan_set| (Optimistic)
+                bool valid_ = false;
+                Key key_;
+                Value value_;
+        };
+        // Iterates over the keys in [begin, end) (no upper bound if |end| is
+        // nullopt), at most |limit| of them. The scan is serializable: the
+        // keys read are locked as by get(), and so is the range read against
+        // inserts (TwoPhaseLocking), or it is validated at commit
+        // (Optimistic), or inserts into it depend on the transaction
+        // (SerializationGraph; the whole range, even if |limit| stops the
+        // scan early). With Index::Hash, each batch costs a whole table walk.
+        Scan scan(Key begin, optional<Key> end = nullopt,
+                  size_t limit = SIZE_MAX);
+        // Iterates over the keys starting with |prefix|
+        Scan prefix(const Key& prefix, size_t limit = SIZE_MAX);
+
+        // Awaitable operation of coroutine transactions. On the next turn of
+        // the transaction, the scheduler calls |attempt| (again on the
+        // following turns while it returns false, e.g. waiting for a lock)
+        // and then resumes the coroutine with the result.
+        template<typename T, typename F>
+        class AsyncOp {
+            public:
+                AsyncOp(Transaction* tx, F attempt)
+                    : tx_(tx), attempt_(move(attempt)) {}
+                bool await_ready() const noexcept { return false; }
+                void await_suspend(coroutine_handle<>) noexcept {
+                    tx_->pending_op_ = this;
+                    tx_->attempt_ = [](void* op) {
+                        AsyncOp* self = static_cast<AsyncOp*>(op);
+                        return self->attempt_(&self->result_);
+                    };
+                }
+                T await_resume() { return move(result_); }
+
+            private:
+                Transaction* tx_;
+                F attempt_;
+                T result_ = {};
+        };
+
+        // Coroutine versions of the operations above, which give the same
+        // results (begin() and abort() give true). e.g.
+        //   optional<Value> x = co_await tx->async_get("key1");
+        auto async_begin() {
+            return make_async<bool>([this](bool* r) { begin(); return *r = true; });
+        }
+        auto async_begin_read_only() {
+            return make_async<bool>([this](bool* r) {
+                begin_read_only();
+                return *r = true;
+            });
+        }
+        auto async_commit() {
+            return make_async<bool>([this](bool* r) { *r = commit(); return true; });
+        }
+        auto async_abort() {
+            return make_async<bool>([this](bool* r) { abort(); return *r = true; });
+        }
+        auto async_set(Key key, Value val) {
+            return make_async<bool>([this, key = move(key), val = move(val)](bool* r) {
+                *r = false;
+                return try_set(key, val);
+            });
+        }
+        auto async_get(Key key) {
+            return make_async<optional<Value>>(
+                    [this, key = move(key)](optional<Value>* r) {
+                return try_get(key, r);
+            });
+        }
+        auto async_del(Key key) {
+            return make_async<bool>([this, key = move(key)](bool* r) {
+                return try_del(key, r);
+            });
+        }
+        auto async_keys() {
+            return make_async<vector<string>>([this](vector<string>* r) {
+                *r = list_keys();
+                return true;
+            });
+        }
+        auto async_get_until_success(Key key) {
+            return make_async<Value>([this, key = move(key)](Value* r) {
+                optional<Value> value;
+                if (!try_get(key, &value, false) || (!value && !killed_))
+                    return false;
+                *r = value.value_or(0);
+                return true;
+            });
+        }
+
+        // Body of the transaction thread. Runs |logic| (which may retry the
+        // transaction) and hands the CPU over to the scheduler at last.
+        void run();
         void set_thread(thread&& th) { thread_ = move(th); }
 
         // schedulerが起こすときに呼ぶ
         void notify() { turn_ = true; cv_.notify_one(); }
         void terminate() { thread_.join(); }
 
-        DBDiff write_set = {};
-        vector<Key> lock_set = {};  // lockをもっているkeyの集合
+        // Creates the coroutine of |co_logic|
+        void start_coroutine() { coroutine_ = co_logic(this); }
+        // Runs a turn of the coroutine. Returns false if it has finished.
+        bool step();
+
+        // read set of Optimistic
+        struct ReadEntry {
+            string_view key;     // in |arena|
+            RecordInfo* record;  // nullptr if |key| didn't exist
+            uint64_t tid;        // version seen by the read
+        };
+
+        // Backs the write set and the keys of the read set.
+        // It is reset, not freed, when the transaction finishes, and the
+        // vectors below keep their capacity, so a transaction reused (e.g.
+        // retried, or a session of Server) allocates almost nothing.
+        Arena arena;
+        DBDiff write_set{&arena};
+        FlatMap<BaseOp> lock_set;  // lockをもっているkeyのlock IDとそのmode
+        vector<ReadEntry> read_set = {};
+        // ranges read by scans of Optimistic, validated at commit
+        struct ScanEntry {
+            Key begin;
+            optional<Key> end;  // exclusive
+            size_t count;       // present records read in the range
+        };
+        vector<ScanEntry> scan_set = {};
+        bool range_locked = false;  // holds locks of RangeLockTable
         bool is_done = false;
         Logic logic;
+        CoLogic co_logic;  // for Scheduler::Coroutine
+
+        int id() const { return id_; }
+        // Result of the last commit()
+        bool committed() const { return committed_; }
 
     private:
         // 処理をschedulerに渡してwait
+        // (Concurrent modeでは何もしない)
         void wait();
-        // 処理をschedulerに渡すがwaitしない
+        // lockが取れなかったときに呼ぶ
+        // (RoundRobin modeではwait()と同じ, Concurrent modeではyield)
+        void backoff();
+        // Releases everything held by the transaction
         void finish();
+        // Releases the locks, empties the sets and resets |arena|
+        void clear_sets();
+        // The bodies of the operations, which return false if the
+        // transaction has to wait for a lock (RoundRobin and Coroutine)
+        bool try_set(const Key& key, const Value& val);
+        // (|lock_absence|: see lock_absent(); a caller which waits for the
+        // key to appear or holds a range covering it doesn't need it)
+        bool try_get(const Key& key, optional<Value>* value,
+                     bool lock_absence = true);
+        bool try_del(const Key& key, bool* absent);
+        vector<string> list_keys();
+        // Locks |key| unless it has to wait. Dies if wait-die tells so.
+        LockResult try_lock(const Key& key, BaseOp type);
+        // Locks the nonexistent |key| against inserts by others. Returns
+        // MustWait if it has to wait or if the key has been inserted
+        // meanwhile (then it is locked by try_lock() on the retry).
+        LockResult lock_absent(const Key& key);
+
+        template<typename T, typename F>
+        AsyncOp<T, F> make_async(F attempt) {
+            return AsyncOp<T, F>(this, move(attempt));
+        }
+
+        // Aborts as the victim of wait-die (releases the locks right away)
+        void die();
 
         // returns if |db_| or |write_set| has the specified key
-        bool has_key(Key key);
+        bool has_key(const Key& key);
+        bool optimistic() const;
+        // Reads take no locks (Optimistic and SerializationGraph)
+        bool lock_free() const;
+        // Reads |key| from |db_| without locking. Dies if the read would
+        // close a cycle (SerializationGraph).
+        optional<Value> read_unlocked(const Key& key);
 
         bool turn_ = false;
         int id_;
-        vector<Key> write_log_ = {};
+        bool read_only_ = false;
+        bool nonblocking_ = false;
+        bool killed_ = false;  // by wait-die (or a cycle)
+        bool committed_ = false;
+        uint64_t snapshot_ts_ = 0;  // see DataBase::register_tx()
+        size_t snapshot_slot_ = 0;
         unique_lock<mutex> lock_;
         condition_variable cv_;
         thread thread_;
         DataBase* db_;
         Scheduler* scheduler_;
+        TxCoroutine coroutine_;
+        void* pending_op_ = nullptr;  // AsyncOp awaited by |coroutine_|
+        bool (*attempt_)(void*) = nullptr;
+
+        friend class Server;  // runs the operations with try_*()
 };
 
-class Scheduler {
+// Recorder of the operations reported to the serializability checker.
+// Each key is interned into an ID, and each operation is packed into an
+// 8-byte record kept in a ring buffer of the last |capacity| records. An ID
+// is counted by the records in the ring and freed (for another key) when
+// the last one is overwritten, so the memory doesn't grow with the length
+// of the history nor with the number of distinct keys. Optionally, every
+// record is also appended to a binary trace file, which replay() streams
+// (e.g. into ConflictGraph, or an offline tool).
+// Trace file format (host byte order):
+//   "SCDBHIST" | record | record | ...
+// where a record is [txid: u32] [key << 3 | op: u32]. The first record of a
+// key since its ID was assigned is preceded by a Define record,
+// [keylen: u32] [key << 3 | Define: u32] followed by the key padded to 8
+// bytes. Commit and Abort have no key.
+// Not thread-safe.
+class History {
     public:
-        iterable_queue<unique_ptr<Transaction>> transactions;
+        enum Op : uint32_t {
+            Read,
+            Write,
+            Commit,
+            Abort,
+            Define,  // (only in trace files)
+        };
+        struct Event {
+            int txid;
+            Op op;
+            string_view key;  // empty for Commit and Abort
+        };
+        static const size_t kDefaultCapacity = 1 << 16;
 
-        ~Scheduler();
+        explicit History(size_t capacity = kDefaultCapacity)
+            : capacity_(capacity) {}
+        ~History();
+        History(const History&) = delete;
+        History& operator=(const History&) = delete;
+
+        // Appends the following records to |filename| too (truncated)
+        void trace(const string& filename);
+        void record(int txid, const Key& key, BaseOp rw);
+        void record_finish(int txid, bool committed);
 
-        struct Log {
-            int id;
-            Key key;
-            BaseOp op;
+        // number of records in the ring
+        size_t size() const { return min(nrecords_, capacity_); }
+        // number of keys interned (referred to by the ring)
+        size_t nkeys() const { return ids_.size(); }
+        // Calls |fn| for the records in the ring, the oldest first
+        void for_each(const function<void(const Event&)>& fn) const;
+        // Calls |fn| for the records of the trace file |filename|. Returns
+        // false if it is not a trace file or ends with a torn record.
+        static bool replay(const string& filename,
+                           const function<void(const Event&)>& fn);
+        // Emits the conflict graph of the transactions in the ring to
+        // |filename| in dot format for visualization
+        void emit(const string& filename) const;
 
-            Log(int id, Key key, BaseOp op)
-                : id(id), key(key), op(op) {}
+    private:
+        struct Record {
+            uint32_t txid;
+            uint32_t key_op;  // key << kOpBits | op
         };
+        static const int kOpBits = 3;
+        static const uint32_t kOpMask = (1 << kOpBits) - 1;
+        static const size_t kTraceBufBytes = 64 * 1024;
 
+        static bool has_key(Record record) {
+            Op op = (Op) (record.key_op & kOpMask);
+            return op == Read || op == Write;
+        }
+        uint32_t intern(const Key& key);
+        // Drops a reference to |id| by the ring, and frees it at last
+        void unref(uint32_t id);
+        void append(Record record);
+        void flush_trace();
+
+        const size_t capacity_;
+        vector<Record> ring_ = {};  // allocated by the first record
+        size_t nrecords_ = 0;       // records appended so far
+        unordered_map<Key, uint32_t> ids_;
+        vector<const Key*> names_ = {};  // ID -> key (in |ids_|)
+        vector<uint32_t> refs_ = {};     // ID -> records in the ring
+        vector<uint32_t> free_ids_ = {};
+        FILE* trace_ = nullptr;
+        string trace_buf_ = "";          // records not written to |trace_| yet
+        vector<bool> defined_ = {};      // IDs defined in |trace_|
+};
+
+// Online serializability checker of the history of committed transactions.
+// It keeps the conflict graph incrementally as the operations are reported
+// and finds a cycle (the history is not conflict-serializable) as soon as
+// the edge closing it is reported. Such an edge is not added, and the
+// operation is rejected, so the graph can also be used to admit operations
+// (see SerializationGraph).
+// A committed transaction without incoming edges can never join a cycle
+// (it has no more operations), so it is pruned together with its edges; an
+// aborted one is just forgotten. Each key remembers its last accessors
+// among the transactions in the graph. The graph thus only holds the
+// running transactions and the committed ones they still depend on, however
+// long the history is.
+// The nodes are kept in a topological order which is updated on every new
+// edge (Pearce-Kelly): an edge agreeing with the order costs O(1), and
+// otherwise only the nodes between its ends are searched and reordered.
+// Not thread-safe.
+class ConflictGraph {
+    public:
+        // Return false if the operation would close a cycle. The rejected
+        // operation is not recorded, but a write may leave some of its
+        // edges, so the transaction is to be aborted.
+        bool read(int txid, const Key& key);
+        bool write(int txid, const Key& key) {
+            return write(txid, span<const Key>(&key, 1));
+        }
+        // Writes all of |keys| or none of them
+        bool write(int txid, span<const Key> keys);
+        // Reads the range [begin, end) (no upper bound if |end| is nullopt)
+        // as a predicate: a later write of a key in it depends on the
+        // transaction. (The keys read in the range are reported by read().)
+        void read_range(int txid, const Key& begin, const optional<Key>& end);
+        // The transaction has committed or aborted. Its next operations (if
+        // the transaction object is reused) belong to a new node.
+        void finish(int txid, bool committed);
+        // Applies an event of History (e.g. streamed by History::replay())
+        void add(const History::Event& event);
+
+        // number of operations rejected for closing a cycle
+        size_t ncycles() const { return ncycles_; }
+        // number of transactions in the graph
+        size_t size() const { return nodes_.size(); }
+        // number of keys with accessors in the graph
+        size_t nkeys() const { return keys_.size(); }
+
+    private:
+        struct Range {
+            Key begin;
+            optional<Key> end;  // exclusive
+        };
+        struct Node {
+            uint64_t ord;  // position in the topological order
+            bool committed = false;
+            unordered_set<uint64_t> out = {};
+            unordered_set<uint64_t> in = {};
+            vector<Key> keys = {};  // keys whose |KeyState| has this node
+            vector<Range> ranges = {};
+        };
+        // the last writer of a key and the readers since (0: none)
+        struct KeyState {
+            uint64_t writer = 0;
+            vector<uint64_t> readers = {};
+        };
+
+        // Returns the node of the running transaction |txid|
+        uint64_t node_of(int txid);
+        // Returns false if the edge would close a cycle
+        bool add_edge(uint64_t from, uint64_t to);
+        // Collects the nodes reachable from |start| whose order is at most
+        // |ub| (forward) or the nodes reaching |start| whose order is at
+        // least |lb| (backward). Returns false if |stop| is reached.
+        bool search(uint64_t start, bool forward, uint64_t bound, uint64_t stop,
+                    vector<uint64_t>* visited);
+        // Removes |id| from the states of its keys
+        void forget_keys(uint64_t id);
+        // Prunes |id| if it is committed without incoming edges, and then
+        // the successors which become so
+        void prune(uint64_t id);
+
+        unordered_map<uint64_t, Node> nodes_;
+        unordered_map<int, uint64_t> running_;  // txid -> node
+        unordered_map<Key, KeyState> keys_;
+        unordered_set<uint64_t> ranged_;  // nodes with |ranges|
+        uint64_t next_id_ = 1;
+        uint64_t next_ord_ = 0;
+        size_t ncycles_ = 0;
+};
+
+class Scheduler {
+    public:
+        enum Mode {
+            // Transactions run simultaneously on a pool of worker threads and
+            // only contend on per-record locks. A transaction runs to the end
+            // once started, so it must not wait for the effects of another
+            // one which may not have started yet (unless |nworkers| is 0).
+            Concurrent,
+            // Only one transaction thread runs at a time and the CPU is handed
+            // over in round-robin order after every operation. Deterministic,
+            // so it is useful for debugging.
+            RoundRobin,
+            // Same as RoundRobin, but the transactions are C++20 coroutines
+            // (see add_coroutine_tx()) resumed by the scheduler on its own
+            // thread, so switching costs no context switch.
+            Coroutine,
+        };
+
+        iterable_queue<unique_ptr<Transaction>> transactions;
+
+        // |nworkers| is the size of the worker pool of Concurrent mode.
+        // 0 spawns a thread for every transaction instead.
+        explicit Scheduler(Mode mode = Concurrent,
+                           size_t nworkers = thread::hardware_concurrency());
+        ~Scheduler();
+
+        // add_tx() and add_coroutine_tx() must not be called while the
+        // scheduler is running; use submit() instead.
         void add_tx(Transaction::Logic logic);
+        // For Coroutine mode
+        void add_coroutine_tx(Transaction::CoLogic logic);
         void set_db(DataBase* db) { db_ = db; }
 
+        // Thread-safe submission of transactions (Concurrent and RoundRobin).
+        // Each future gets whether the last commit() of the transaction has
+        // succeeded, once its logic has returned. Transactions submitted
+        // while serve() is running are started right away; the others wait
+        // for the next start() or serve().
+        vector<future<bool>> submit(span<Transaction::Logic> logics);
+        future<bool> submit(Transaction::Logic logic);
+
         // starts spawning threads
         void start();
+        // Concurrent mode: runs the transactions like start(), and keeps
+        // running the submitted ones until close() is called
+        void serve();
+        // Makes serve() return once the transactions submitted so far have
+        // finished. Call it after the last submit() has returned.
+        void close();
 
         void notify() { turn_ = true; cv_.notify_one(); }
 
-        void log(int id, Key key, BaseOp rw) {
-            io_log_.emplace_back(id, key, rw);
+        // Turns the serializability checker on (see
+        // DBOptions::check_serializability) and starts its thread
+        void enable_checker();
+        // Reports an operation to the serializability checker, if it is on.
+        // Lock-free: the operations are queued in the order of the calls
+        // and checked by the thread of the checker.
+        void log(int id, const Key& key, BaseOp rw) {
+            if (checker_.load(memory_order_relaxed))
+                push_check({id, rw == Read ? History::Read : History::Write,
+                            key});
+        }
+        void log_finish(int id, bool committed) {
+            if (checker_.load(memory_order_relaxed))
+                push_check({id, committed ? History::Commit : History::Abort});
+        }
+        // Writes the operations reported from now on to the trace file
+        // |filename| (see History). Turns the checker on.
+        void trace(const string& filename) {
+            enable_checker();
+            flush_checks();
+            lock_guard<mutex> lock(graph_mtx_);
+            history_.trace(filename);
+        }
+        // Number of cycles found in the conflict graph so far (0 unless the
+        // history is not serializable). Waits for the operations reported
+        // so far to be checked.
+        size_t serializability_violations() {
+            flush_checks();
+            lock_guard<mutex> lock(graph_mtx_);
+            return graph_.ncycles();
         }
 
+        Mode mode() const { return mode_; }
+        // RoundRobin modeでCPUを持っているthreadが握るmutex
+        mutex& turn_mutex() { return turn_mtx_; }
+
     private:
         // Runs round-robin schedule
         void run();
+        // Runs all the transactions on |pool_| (or on their own threads)
+        // and waits for them. If |until_closed|, also runs the submitted
+        // transactions until close() is called.
+        void run_concurrently(bool until_closed);
+        // Moves the submitted transactions to |transactions|
+        void drain_inbox();
+        // Runs round-robin schedule of coroutines
+        void run_coroutines();
+        // An operation reported to the checker
+        struct CheckEvent {
+            int id = 0;
+            History::Op op = History::Read;  // Read, Write, Commit or Abort
+            Key key = {};
+            // fulfilled when the checker reaches the event (flush_checks())
+            promise<void>* done = nullptr;
+        };
+        void push_check(CheckEvent event);
+        // Waits until the checker has applied the events pushed so far
+        void flush_checks();
+        // Body of |checker_thread_|
+        void check_loop();
+        // Adds an event to |graph_| and |history_|
+        void check(const CheckEvent& event);
 
         void wait(Transaction* tx);
+        const Mode mode_;
+        unique_ptr<ThreadPool> pool_;
         bool turn_ = false;
         condition_variable cv_;
+        mutex turn_mtx_;
         unique_lock<mutex> lock_;
-        vector<Log> io_log_ = {};
+        atomic<bool> checker_ = false;
+        once_flag checker_once_;
+        thread checker_thread_;
+        MPSCQueue<CheckEvent> checks_;
+        // bumped by push_check() to wake up the checker if it sleeps
+        atomic<uint32_t> checker_signal_ = 0;
+        atomic<bool> checker_sleeping_ = false;
+        atomic<bool> stop_checker_ = false;
+        // guards |graph_| and |history_| (applied by the checker thread)
+        mutex graph_mtx_;
+        ConflictGraph graph_;
+        History history_;  // emitted to |graphfilename_| at last
+        const string graphfilename_ = "seccampDB_graph.dot";
         DataBase* db_;
+
+        MPSCQueue<Transaction::Logic> inbox_;  // see submit()
+        // bumped by submit() and close() to wake up serve()
+        atomic<uint64_t> inbox_signal_ = 0;
+        atomic<bool> closed_ = false;
 };
 
 class DataBase {
     public:
-        struct RecordInfo {
-            // TODO: allow other types (string, char, ...)
-            int value;
+        using RecordInfo = ::RecordInfo;
 
-            // Reader/Writer lock
-            // 0  -> no lock
-            // -1 -> write lock
-            // n > 0 -> read lock (by n threads)
-            int nlock = 0;
-        };
-
-        DataBase(Scheduler* scheduler, string dumpfilename, string logfilename);
+        DataBase(Scheduler* scheduler, string dumpfilename, string logfilename,
+                 DBOptions options = DBOptions());
         ~DataBase();
 
         unique_ptr<Transaction> generate_tx(Transaction::Logic logic);
-        bool get_lock(Transaction* tx, Key key, BaseOp locktype);
+        // Locks |key| for |tx|. Blocks while waiting in Concurrent mode.
+        LockResult get_lock(Transaction* tx, const Key& key, BaseOp locktype);
+        // Releases the lock |id| (see LockManager) held in |locktype|
+        void release_lock(uint32_t id, BaseOp locktype);
+        // Declares the insert of the nonexistent |key| by |tx| to the scans
+        // (see RangeLockTable). Never blocks.
+        LockResult lock_insert(Transaction* tx, const Key& key);
+        // Locks [key, key + '\0') for |tx|, i.e. the absence of |key|.
+        // Never blocks.
+        LockResult lock_absent(Transaction* tx, const Key& key);
+        void release_range_locks(Transaction* tx);
+        // Reads up to |n| keys >= |from| and < |end| of |table| in key order
+        // into |keys| (absent records included), and sets |exhausted| if
+        // there are no more keys in the range. If |tx| is not nullptr, the
+        // range read is locked for it before the latch is released, so that
+        // no insert commits into it unseen. Never blocks.
+        LockResult scan_keys(Transaction* tx, const Key& from,
+                             const optional<Key>& end, size_t n,
+                             vector<Key>* keys, bool* exhausted);
+
+        // Makes the write set of |tx| durable and applies it to |table|.
+        // Returns false if |tx| has to be aborted (Optimistic and
+        // SerializationGraph).
+        // With |ticket|, the writes are applied (and visible) without
+        // waiting for the durability, and |*ticket| is set to the ticket of
+        // the commit record to pass to durable(). A transaction which sees
+        // the writes is logged after them, so its ticket is not smaller.
+        bool apply_tx(Transaction* tx, uint64_t* ticket = nullptr);
+        // Ticket of the last commit record logged so far
+        uint64_t last_ticket();
+        // Whether the commit records up to |ticket| are durable
+        bool durable(uint64_t ticket) const { return ndurable_ >= ticket; }
+        // Has the log flusher call |fn| whenever records become durable (on
+        // its thread, with the log mutex held). nullptr unregisters it.
+        void on_durable(function<void()> fn);
+
+        CCProtocol protocol() const { return protocol_; }
+        Scheduler* scheduler() const { return scheduler_; }
+        // Reads |key| without locking and records it in the read set of |tx|
+        optional<Value> read_optimistic(Transaction* tx, const Key& key);
+        // SerializationGraph
+        // Reads the committed value of |key| for |tx|. Returns false (and
+        // aborts |tx| in the graph) if the read would close a cycle.
+        bool read_serialized(Transaction* tx, const Key& key,
+                             optional<Value>* value);
+        // Tells the graph that |tx| is going to scan [begin, end)
+        void scan_serialized(Transaction* tx, const Key& begin,
+                             const optional<Key>& end);
+        // Drops |tx| from the graph unless it has committed
+        void forget_serialized(Transaction* tx);
+
+        // Transactions notify their lifetime so that the group commit knows
+        // how many transactions could still join the current batch, and so
+        // that the versions (and records) they may see are not freed.
+        // Returns the snapshot timestamp of the transaction, which is
+        // published in |*slot| of |snapshots_| (lock-free unless every slot
+        // is taken).
+        uint64_t register_tx(size_t* slot);
+        void unregister_tx(uint64_t snapshot_ts, size_t slot);
 
-        void apply_tx(Transaction* tx);
+        // Multi-version storage
+        // Every commit installs new versions of the records it writes with
+        // its commit timestamp. The snapshot at |ts| contains exactly the
+        // commits with timestamps <= |ts|.
+        // Reads the snapshot without any lock (for read-only transactions).
+        optional<Value> read_snapshot(const Key& key, uint64_t ts);
+        vector<Key> keys_snapshot(uint64_t ts);
+        // Frees the versions older than the oldest active snapshot and
+        // removes the deleted records. Called by the background checkpointer.
+        void collect_garbage();
+        // number of versions in |table| (for testing)
+        size_t count_versions();
 
-        // TODO: impl B+-tree (future work)
-        map<Key, RecordInfo> table = {};
+        // number of write()+fsync() issued for the redo log (for testing)
+        size_t log_flush_count() const { return nflushes_; }
+
+        // Fuzzy checkpoint. Writes a snapshot of |table| while transactions
+        // keep running and truncates the log records covered by it.
+        // Called periodically by the background checkpointer.
+        void checkpoint();
+
+        // Accessors which are safe to call from concurrent transactions.
+        // The caller must hold the lock of |key| to read a consistent value.
+        // (Absent records of Optimistic are regarded as nonexistent.)
+        bool has_key(const Key& key);
+        optional<Value> read(const Key& key);
+        vector<Key> keys();
+
+        // primary index (see DBOptions::index)
+        unique_ptr<Index> table;
 
     private:
+        // Lock, validate and install phases of Optimistic
+        // (|ticket|: see apply_tx())
+        bool commit_optimistic(Transaction* tx, uint64_t* ticket);
+        // Adds the writes of |tx| to the graph of SerializationGraph and
+        // installs them
+        bool commit_serialized(Transaction* tx, uint64_t* ticket);
+        // Applies the write set of |tx| to |table| with a new commit
+        // timestamp. Each record is installed under its lock bit; only the
+        // insert of a new key takes the exclusive latch.
+        void install_writes(Transaction* tx);
+        // Same with the records of the write set locked by lock_record()
+        // (nullptr for a delete of a nonexistent key), which it unlocks
+        void install_writes(Transaction* tx, span<RecordInfo* const> records);
+        // Sets the lock bit of the record of |key|, inserting an absent
+        // record if it doesn't exist (unless |create| is false; then it
+        // returns nullptr)
+        RecordInfo* lock_record(const Key& key, bool create);
+        // Reads |record| consistently with respect to concurrent installs.
+        // Returns the TID word seen (without the lock bit).
+        uint64_t stable_read(RecordInfo* record, Value* value);
+        // Tells the checkpointer that the record of |lsn| is in |table|
+        void mark_applied(uint64_t lsn);
+
+        // MVCC
+        // Assigns a commit timestamp, which becomes visible to new snapshots
+        // when end_commit() has been called for it and all the earlier ones.
+        // Lock-free: end_commit() marks |ts| in |ended_| and advances
+        // |visible_ts_| over the ended ones.
+        uint64_t begin_commit();
+        void end_commit(uint64_t ts);
+        // The oldest snapshot of the active transactions (kNoSnapshot if
+        // none), computed on demand from |snapshots_| for the GC
+        uint64_t oldest_snapshot();
+        // Prepends the version written at |ts| to the chain of |record|
+        void install_version(RecordInfo* record, uint64_t ts,
+                             ChangeMode mode, const Value& value);
+        // Frees the versions of |record| invisible to snapshots >= |horizon|.
+        // Returns true if the record is deleted as of |horizon|.
+        bool prune_versions(RecordInfo* record, uint64_t horizon);
+
         // Persistence
-        void recover();
+        // Returns true if the dump file was of the former text format (and
+        // has to be rewritten as a snapshot)
+        bool load_dump();
+        // Loads the "<key> <value>" lines of the former text format.
+        // Returns false (loading nothing) if a line is malformed.
+        bool load_text_dump(size_t* nrecords);
+        // Replays the records in |filename| newer than |ckpt_lsn_| with
+        // |recovery_threads_| threads.
+        // Returns the length of the valid prefix of the file.
+        size_t recover(const string& filename);
+        // Whether |filename| is a redo log of the former text format
+        bool is_text_log(const string& filename);
+        // Replays the complete transactions of a text log. Returns how many
+        // have been replayed.
+        size_t recover_text_log(const string& filename);
+
+        // Checkpointing
+        // Writes every record of |table| to the dump file as a snapshot
+        // which covers the log up to |lsn|.
+        void write_snapshot(uint64_t lsn);
+        // Has the flusher switch to a new log file; the current one is
+        // renamed to |oldlogfilename_|. Returns the LSN of the last record
+        // in the old file.
+        uint64_t rotate_log();
+        // Body of |checkpointer_|
+        void checkpoint_loop();
 
-        string serialize(DBDiff diff);
-        void deserialize(DBDiff& diff, vector<string> buf);
-        string make_log_format(ChangeMode mode, Key key, int value);
+        // Group commit
+        // Appends the commit record of |tx| to the current batch and blocks
+        // until it is durable. Returns the LSN of the record.
+        uint64_t append_log(Transaction* tx);
+        // The two halves of append_log(). enqueue_log() sets the ticket to
+        // wait for.
+        uint64_t enqueue_log(Transaction* tx, uint64_t* ticket);
+        void wait_durable(uint64_t ticket);
+        // Body of |log_flusher_|
+        void flush_log_loop();
+
+        // Redo log record (binary, host byte order).
+        // Each record holds the whole write set of one committed transaction:
+        //   LogRecordHeader | entry | entry | ...
+        // where each entry is
+        //   [mode: u8] [keylen: u32] [value: i32] [key: keylen bytes]
+        // (valueはDeleteの場合0)
+        // If the top bit of keylen (kBytesFlag) is set, the value is a
+        // string: the i32 field holds its length and its bytes follow the
+        // key.
+        struct LogRecordHeader {
+            uint64_t lsn;
+            uint32_t length;    // bytes of the whole record incl. this header
+            uint32_t txid;
+            uint32_t crc;       // crc32c of the whole record with crc = 0
+            uint32_t nentries;
+        };
+
+        // Snapshot (dump file) format (binary, host byte order).
+        // The file is mmap-ed and bulk-loaded on startup.
+        // Page 0 holds SnapshotHeader and blocks follow it, each starting at
+        // a page-aligned offset:
+        //   SnapshotBlockHeader | entry | entry | ... | padding
+        // where each entry is [keylen: u32] [value: i32] [key: keylen bytes]
+        // (a string value is encoded the same way as in the log)
+        struct SnapshotHeader {
+            char magic[8];      // "SCDBSNAP"
+            uint32_t version;
+            uint32_t crc;       // crc32c of this header with crc = 0
+            uint64_t lsn;       // checkpoint LSN
+            uint64_t nrecords;
+            uint64_t nblocks;
+        };
+        struct SnapshotBlockHeader {
+            uint32_t crc;       // crc32c of the entries in the block
+            uint32_t nentries;
+            uint64_t length;    // bytes of the entries
+        };
+
+        // Appends a log record for |diff| to |buf| in place
+        void serialize(string& buf, uint64_t lsn, int txid, const DBDiff& diff);
+        // Validates the record at the head of |rec| (|len| bytes available)
+        // and calls |fn| with (key, keylen, mode, value) for each entry
+        // unless the dump already covers the record.
+        // Returns the record length, or 0 if the record is torn or corrupted.
+        // Thread-safe (may modify the record in |rec| only).
+        size_t deserialize(char* rec, size_t len,
+                const function<void(const char*, uint32_t, ChangeMode, Value)>& fn);
+        void make_log_format(string& buf, ChangeMode mode, const Key& key,
+                             const Value& value);
 
         Scheduler* scheduler_;
+        const CCProtocol protocol_;
         const string dumpfilename_;
         const string logfilename_;
+        const string oldlogfilename_;  // log file before the last rotation
+        const size_t recovery_threads_;
         int fd_log_;
-        int id_counter_ = 0;  // for transaction ID
-
-        // format of output files:
-        // DB file:  [key] [value]
-        // log file: [checksum] [key] [0/1] [value] (valueはDeleteの場合0)
-};
-
-class ConflictGraph {
-    public:
-        ConflictGraph(vector<Scheduler::Log> logs);
+        atomic<int> id_counter_ = 0;  // for transaction ID
 
-        // Emits graph information to *.dot file for visualization
-        void emit();
-
-    private:
-        enum ConflictType {
-            ReadWrite,
-            WriteRead,
-            WriteWrite,
-        };
+        // Latch protecting the structure of |table|. Lookups take it shared,
+        // inserting/erasing records takes it exclusively. Logical isolation
+        // is provided by |locks_| (or the TID words of Optimistic).
+        shared_mutex latch_;
+        LockManager locks_;
+        RangeLockTable range_locks_;
+        // SerializationGraph: the graph admitting the operations. Only the
+        // graph updates are serialized by |graph_mtx_|; a commit locks its
+        // records in it, so the values are seen and installed in the order
+        // of the graph (see commit_serialized()).
+        mutex graph_mtx_;
+        ConflictGraph graph_;
 
-        struct EdgeInfo {
-            int from;
-            int to;
-            ConflictType type;
+        const GroupCommitConfig group_commit_;
+        atomic<int> nactive_txs_ = 0;
+        mutex log_mtx_;                  // guards the members below
+        condition_variable log_cv_;      // flusher waits for records
+        condition_variable durable_cv_;  // committers wait for durability
+        uint64_t next_lsn_ = 1;
+        uint64_t flushed_lsn_ = 0;       // last LSN handed to flusher
+        set<uint64_t> unapplied_lsns_;   // logged but not applied to |table|
+        bool rotate_requested_ = false;
+        uint64_t rotated_lsn_ = 0;
+        condition_variable ckpt_cv_;     // checkpointer waits for rotation
+        string log_batch_ = "";          // records not yet handed to flusher
+        string log_flushing_ = "";       // records being written by flusher
+        size_t nwaiting_commits_ = 0;    // committers in |log_batch_|
+        uint64_t nappended_ = 0;         // number of records appended so far
+        atomic<uint64_t> ndurable_ = 0;  // number of records made durable
+        function<void()> durable_callback_;  // see on_durable()
+        atomic<size_t> nflushes_ = 0;
+        bool stop_flusher_ = false;
+        thread log_flusher_;
 
-            EdgeInfo(int from, int to, ConflictType type)
-                : from(from), to(to), type(type) {}
+        static const size_t kEndedSlots = 1 << 16;
+        atomic<uint64_t> commit_ts_ = 0;    // last assigned commit timestamp
+        atomic<uint64_t> visible_ts_ = 0;   // timestamp of new snapshots
+        // |ended_[ts % kEndedSlots]| is |ts| once end_commit(ts) is called
+        unique_ptr<atomic<uint64_t>[]> ended_;
+        // Snapshot timestamps of the active transactions, one per slot
+        // (kNoSnapshot if free). A thread starts looking for a free slot
+        // at a slot of its own, so the slots are rarely contended.
+        static const size_t kSnapshotSlots = 1024;
+        static const uint64_t kNoSnapshot = UINT64_MAX;
+        struct alignas(64) SnapshotSlot {
+            atomic<uint64_t> ts = kNoSnapshot;
         };
+        unique_ptr<SnapshotSlot[]> snapshots_;
+        mutex mvcc_mtx_;                    // guards the members below
+        // snapshots of the transactions which found no free slot
+        multiset<uint64_t> overflow_snapshots_;
+        // records removed from |table|, which are freed when no transaction
+        // begun before the removal (at the timestamp) is active
+        vector<pair<uint64_t, unique_ptr<RecordInfo>>> retired_;
 
-        // Returns a serial schedule of transactions which is equivalent to
-        // the actual history
-        vector<int> serialize();
-
-        void add_edge(int from, int to, ConflictType type);
+        const chrono::milliseconds checkpoint_interval_;
+        uint64_t ckpt_lsn_ = 0;  // the log up to this LSN is in the dump
+        mutex ckpt_mtx_;         // serializes checkpoints
+        mutex ckpt_stop_mtx_;
+        condition_variable ckpt_stop_cv_;
+        bool stop_checkpointer_ = false;
+        thread checkpointer_;
 
-        vector<int> nodes_;
-        vector<EdgeInfo> edges_;
-        const string graphfilename_ = "seccampDB_graph.dot";
+        // format of output files:
+        // DB file:  binary snapshot (see SnapshotHeader)
+        // log file: sequence of binary records (see LogRecordHeader)
 };
 
 #endif  // __DATABASE_H__
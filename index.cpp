@@ -0,0 +1,393 @@
+#include "index.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <endian.h>  // be64toh
+
+using namespace std;
+
+unique_ptr<Index> Index::create(Type type) {
+    switch (type) {
+        case BPlusTree:
+            return make_unique<BPlusTreeIndex>();
+        case Hash:
+            return make_unique<HashIndex>();
+    }
+    return nullptr;
+}
+
+// ------------------------------- BPlusTreeIndex ------------------------------
+
+BPlusTreeIndex::BPlusTreeIndex() {
+    head_ = new Leaf();
+    tail_ = head_;
+    root_ = head_;
+}
+
+BPlusTreeIndex::~BPlusTreeIndex() {
+    destroy(root_);
+}
+
+void BPlusTreeIndex::destroy(Node* node) {
+    if (node->is_leaf) {
+        Leaf* leaf = static_cast<Leaf*>(node);
+        for (int i = 0; i < leaf->nkeys; i++) {
+            delete leaf->records[i];
+        }
+        delete leaf;
+        return;
+    }
+    Inner* inner = static_cast<Inner*>(node);
+    for (int i = 0; i <= inner->nkeys; i++) {
+        destroy(inner->children[i]);
+    }
+    delete inner;
+}
+
+// The first 8 bytes of |key| (zero-padded) as a big-endian integer, so that
+// prefixes compare as the bytes of the keys do
+static uint64_t key_prefix(const Key& key) {
+    uint64_t prefix = 0;
+    memcpy(&prefix, key.data(), min(key.size(), sizeof(prefix)));
+    return be64toh(prefix);
+}
+
+int BPlusTreeIndex::Node::lower_bound(uint64_t prefix, const Key& key) const {
+    int lo = 0, hi = nkeys;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (prefixes[mid] < prefix ||
+            (prefixes[mid] == prefix && keys[mid] < key))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int BPlusTreeIndex::Node::upper_bound(uint64_t prefix, const Key& key) const {
+    int lo = 0, hi = nkeys;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (prefixes[mid] < prefix ||
+            (prefixes[mid] == prefix && !(key < keys[mid])))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+BPlusTreeIndex::Leaf* BPlusTreeIndex::find_leaf(
+        const Key& key, uint64_t prefix, Path* path) {
+    Node* node = root_;
+    while (!node->is_leaf) {
+        Inner* inner = static_cast<Inner*>(node);
+        int idx = inner->upper_bound(prefix, key);
+        if (path)
+            path->nodes[path->depth++] = {inner, idx};
+        node = inner->children[idx];
+    }
+    return static_cast<Leaf*>(node);
+}
+
+RecordInfo* BPlusTreeIndex::find(const Key& key) {
+    uint64_t prefix = key_prefix(key);
+    Leaf* leaf = find_leaf(key, prefix, nullptr);
+    int pos = leaf->lower_bound(prefix, key);
+    if (pos == leaf->nkeys || leaf->prefixes[pos] != prefix ||
+        leaf->keys[pos] != key)
+        return nullptr;
+    return leaf->records[pos];
+}
+
+RecordInfo* BPlusTreeIndex::insert(const Key& key) {
+    return insert_record(key, nullptr);
+}
+
+RecordInfo* BPlusTreeIndex::insert_record(const Key& key, RecordInfo* record) {
+    uint64_t prefix = key_prefix(key);
+    Path path;
+    Leaf* leaf = find_leaf(key, prefix, &path);
+    int n = leaf->nkeys;
+    int pos = leaf->lower_bound(prefix, key);
+    if (pos < n && leaf->prefixes[pos] == prefix && leaf->keys[pos] == key) {
+        if (record) {
+            delete leaf->records[pos];
+            leaf->records[pos] = record;
+        }
+        return leaf->records[pos];
+    }
+
+    for (int i = n; i > pos; i--) {
+        leaf->move_key(i, leaf, i - 1);
+        leaf->records[i] = leaf->records[i - 1];
+    }
+    leaf->set_key(pos, key, prefix);
+    if (!record)
+        record = new RecordInfo();
+    leaf->records[pos] = record;
+    leaf->nkeys = ++n;
+    size_++;
+
+    if (n <= kMaxKeys)
+        return record;
+
+    // Split the leaf in half. When appending to the rightmost leaf (e.g.
+    // bulk-loading sorted keys), keep the left leaf full instead.
+    bool append = (!leaf->next && pos == n - 1);
+    Leaf* right = new Leaf();
+    int mid = append ? n - 1 : n / 2;
+    for (int i = mid; i < n; i++) {
+        right->move_key(i - mid, leaf, i);
+        right->records[i - mid] = leaf->records[i];
+    }
+    right->nkeys = n - mid;
+    leaf->nkeys = mid;
+    right->next = leaf->next;
+    leaf->next = right;
+    if (!right->next)
+        tail_ = right;
+    insert_into_parent(path, right->keys[0], right, append);
+    return record;
+}
+
+void BPlusTreeIndex::append(const Key& key, unique_ptr<RecordInfo> record) {
+    Leaf* leaf = tail_;
+    int n = leaf->nkeys;
+    // (an empty tail may follow erased keys greater than |key|)
+    if (n == 0 ? size_ > 0 : !(leaf->keys[n - 1] < key)) {
+        insert_record(key, record.release());
+        return;
+    }
+
+    size_++;
+    if (n < kMaxKeys) {
+        leaf->set_key(n, key, key_prefix(key));
+        leaf->records[n] = record.release();
+        leaf->nkeys = n + 1;
+        return;
+    }
+
+    // the tail is full: start a new one, as insert() splits on appending
+    Leaf* right = new Leaf();
+    right->set_key(0, key, key_prefix(key));
+    right->records[0] = record.release();
+    right->nkeys = 1;
+    leaf->next = right;
+    tail_ = right;
+    Path path;
+    for (Node* node = root_; !node->is_leaf;) {
+        Inner* inner = static_cast<Inner*>(node);
+        path.nodes[path.depth++] = {inner, inner->nkeys};
+        node = inner->children[inner->nkeys];
+    }
+    insert_into_parent(path, key, right, true);
+}
+
+void BPlusTreeIndex::insert_into_parent(
+        Path& path, Key sep, Node* right, bool append) {
+    uint64_t prefix = key_prefix(sep);
+    while (true) {
+        if (path.depth == 0) {
+            // the root has been split
+            Inner* root = new Inner();
+            root->set_key(0, move(sep), prefix);
+            root->children[0] = root_;
+            root->children[1] = right;
+            root->nkeys = 1;
+            root_ = root;
+            return;
+        }
+
+        auto [parent, idx] = path.nodes[--path.depth];
+
+        int n = parent->nkeys;
+        for (int i = n; i > idx; i--) {
+            parent->move_key(i, parent, i - 1);
+            parent->children[i + 1] = parent->children[i];
+        }
+        parent->set_key(idx, move(sep), prefix);
+        parent->children[idx + 1] = right;
+        parent->nkeys = ++n;
+
+        if (n <= kMaxKeys)
+            return;
+
+        // split the inner node; the middle key moves up to the parent
+        Inner* new_inner = new Inner();
+        int mid = append ? n - 1 : n / 2;
+        for (int i = mid + 1; i < n; i++) {
+            new_inner->move_key(i - mid - 1, parent, i);
+        }
+        for (int i = mid + 1; i <= n; i++) {
+            new_inner->children[i - mid - 1] = parent->children[i];
+        }
+        new_inner->nkeys = n - mid - 1;
+        parent->nkeys = mid;
+        sep = move(parent->keys[mid]);
+        prefix = parent->prefixes[mid];
+        right = new_inner;
+    }
+}
+
+unique_ptr<RecordInfo> BPlusTreeIndex::release(const Key& key) {
+    uint64_t prefix = key_prefix(key);
+    Leaf* leaf = find_leaf(key, prefix, nullptr);
+    int n = leaf->nkeys;
+    int pos = leaf->lower_bound(prefix, key);
+    if (pos == n || leaf->prefixes[pos] != prefix || leaf->keys[pos] != key)
+        return nullptr;
+
+    unique_ptr<RecordInfo> record(leaf->records[pos]);
+    for (int i = pos; i < n - 1; i++) {
+        leaf->move_key(i, leaf, i + 1);
+        leaf->records[i] = leaf->records[i + 1];
+    }
+    leaf->keys[n - 1] = Key();
+    leaf->nkeys--;
+    size_--;
+    return record;
+}
+
+void BPlusTreeIndex::for_each(
+        const function<bool(const Key&, RecordInfo&)>& fn) {
+    for (Leaf* leaf = head_; leaf; leaf = leaf->next) {
+        for (int i = 0; i < leaf->nkeys; i++) {
+            if (!fn(leaf->keys[i], *leaf->records[i]))
+                return;
+        }
+    }
+}
+
+void BPlusTreeIndex::for_each_from(const Key& start,
+        const function<bool(const Key&, RecordInfo&)>& fn) {
+    uint64_t prefix = key_prefix(start);
+    Leaf* leaf = find_leaf(start, prefix, nullptr);
+    int i = leaf->lower_bound(prefix, start);
+    for (; leaf; leaf = leaf->next, i = 0) {
+        for (; i < leaf->nkeys; i++) {
+            if (!fn(leaf->keys[i], *leaf->records[i]))
+                return;
+        }
+    }
+}
+
+// --------------------------------- HashIndex ---------------------------------
+
+HashIndex::HashIndex() {
+    rehash(16);
+}
+
+HashIndex::~HashIndex() {
+    for (auto& slot : slots_) {
+        delete slot.record;
+    }
+}
+
+size_t HashIndex::probe(const Key& key, size_t hash) const {
+    size_t i = hash & mask_;
+    while (slots_[i].record &&
+           !(slots_[i].hash == hash && slots_[i].key == key)) {
+        i = (i + 1) & mask_;
+    }
+    return i;
+}
+
+RecordInfo* HashIndex::find(const Key& key) {
+    return slots_[probe(key, std::hash<Key>{}(key))].record;
+}
+
+RecordInfo* HashIndex::insert(const Key& key) {
+    return insert_record(key, nullptr);
+}
+
+void HashIndex::append(const Key& key, unique_ptr<RecordInfo> record) {
+    insert_record(key, record.release());
+}
+
+RecordInfo* HashIndex::insert_record(const Key& key, RecordInfo* record) {
+    // keep the load factor under 0.7
+    if ((size_ + 1) * 10 > slots_.size() * 7)
+        rehash(slots_.size() * 2);
+
+    size_t hash = std::hash<Key>{}(key);
+    Slot& slot = slots_[probe(key, hash)];
+    if (slot.record) {
+        if (record) {
+            delete slot.record;
+            slot.record = record;
+        }
+        return slot.record;
+    }
+    slot.hash = hash;
+    slot.key = key;
+    slot.record = record ? record : new RecordInfo();
+    size_++;
+    return slot.record;
+}
+
+unique_ptr<RecordInfo> HashIndex::release(const Key& key) {
+    size_t i = probe(key, std::hash<Key>{}(key));
+    if (!slots_[i].record)
+        return nullptr;
+    unique_ptr<RecordInfo> record(slots_[i].record);
+    size_--;
+
+    // shift back the following entries of the cluster to fill the hole
+    size_t j = i;
+    while (true) {
+        j = (j + 1) & mask_;
+        if (!slots_[j].record)
+            break;
+        size_t home = slots_[j].hash & mask_;
+        if (((j - home) & mask_) >= ((j - i) & mask_)) {
+            slots_[i] = move(slots_[j]);
+            i = j;
+        }
+    }
+    slots_[i].record = nullptr;
+    slots_[i].key = Key();
+    return record;
+}
+
+void HashIndex::reserve(size_t n) {
+    size_t capacity = slots_.size();
+    while (n * 10 > capacity * 7) {
+        capacity *= 2;
+    }
+    if (capacity > slots_.size())
+        rehash(capacity);
+}
+
+void HashIndex::rehash(size_t capacity) {
+    vector<Slot> old = move(slots_);
+    slots_ = vector<Slot>(capacity);
+    mask_ = capacity - 1;
+    for (auto& slot : old) {
+        if (!slot.record)
+            continue;
+        size_t i = slot.hash & mask_;
+        while (slots_[i].record) {
+            i = (i + 1) & mask_;
+        }
+        slots_[i] = move(slot);
+    }
+}
+
+void HashIndex::for_each(
+        const function<bool(const Key&, RecordInfo&)>& fn) {
+    for (auto& slot : slots_) {
+        if (slot.record && !fn(slot.key, *slot.record))
+            return;
+    }
+}
+
+void HashIndex::for_each_from(const Key& start,
+        const function<bool(const Key&, RecordInfo&)>& fn) {
+    for (auto& slot : slots_) {
+        if (slot.record && slot.key >= start && !fn(slot.key, *slot.record))
+            return;
+    }
+}
@@ -0,0 +1,229 @@
+#ifndef __INDEX_H__
+#define __INDEX_H__
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "key.h"
+#include "value.h"
+
+using namespace std;
+
+struct RecordInfo {
+    Value value;
+
+    // TID word (Optimistic)
+    // bit 0 -> locked by a committing transaction
+    // bit 1 -> absent (deleted, or inserted by a commit in progress)
+    // bit 2 -> obsolete (removed from the index by the garbage collector)
+    // the rest -> version, which is bumped by every commit
+    atomic<uint64_t> tid = 0;
+    static const uint64_t kLockBit = 1;
+    static const uint64_t kAbsentBit = 2;
+    static const uint64_t kObsoleteBit = 4;
+    static const uint64_t kVersionMask = ~(kLockBit | kAbsentBit | kObsoleteBit);
+    static const uint64_t kVersionUnit = 8;
+
+    // Committed versions for snapshot reads, newest first.
+    // |base| is the version loaded on startup (timestamp 0); a record
+    // created by a transaction has a deleted base.
+    struct Version {
+        uint64_t ts = 0;  // commit timestamp
+        Value value;
+        bool deleted = false;
+        Version* older = nullptr;
+    };
+    Version base;
+    atomic<Version*> versions = &base;
+
+    RecordInfo() = default;
+    ~RecordInfo() {
+        Version* v = versions.load();
+        while (v) {
+            Version* older = v->older;
+            if (v != &base)
+                delete v;
+            v = older;
+        }
+    }
+
+    bool present() const { return !(tid.load() & kAbsentBit); }
+    // Sets the value read from the dump or the log
+    void load(const Value& v) {
+        value = v;
+        base.value = v;
+    }
+};
+
+// Primary index of DataBase: maps a key to its record.
+// The index owns the records and a record never moves while it is in the
+// index, so RecordInfo* stays valid until the key is erased or released.
+// Not thread-safe; DataBase protects it with its latch.
+class Index {
+    public:
+        enum Type {
+            BPlusTree,  // ordered (keys are visited in ascending order)
+            Hash,       // unordered, for point lookups
+        };
+
+        static unique_ptr<Index> create(Type type);
+
+        virtual ~Index() = default;
+
+        // Returns the record of |key|, or nullptr if it doesn't exist
+        virtual RecordInfo* find(const Key& key) = 0;
+        // Returns the record of |key|, inserting an empty one if necessary
+        virtual RecordInfo* insert(const Key& key) = 0;
+        // Adds |key| with |record| (which replaces the record of |key| if
+        // any). Cheaper than insert() if |key| is greater than every key in
+        // the index, i.e. when bulk-loading sorted keys (the snapshot).
+        virtual void append(const Key& key, unique_ptr<RecordInfo> record) = 0;
+        // Returns false if |key| didn't exist
+        bool erase(const Key& key) { return release(key) != nullptr; }
+        // Removes |key| and hands its record over to the caller
+        // (nullptr if |key| didn't exist)
+        virtual unique_ptr<RecordInfo> release(const Key& key) = 0;
+        virtual size_t size() const = 0;
+        // Hint that |n| keys are about to be inserted
+        virtual void reserve(size_t) {}
+        // Calls |fn| for every record (in key order if the index is ordered)
+        // while |fn| returns true.
+        virtual void for_each(
+                const function<bool(const Key&, RecordInfo&)>& fn) = 0;
+        // Same as for_each() but only visits keys >= |start|
+        // (an unordered index has to visit every slot to find them)
+        virtual void for_each_from(const Key& start,
+                const function<bool(const Key&, RecordInfo&)>& fn) = 0;
+        virtual bool ordered() const = 0;
+
+        size_t count(const Key& key) { return find(key) != nullptr; }
+        RecordInfo& operator[](const Key& key) { return *insert(key); }
+};
+
+// In-memory B+-tree. Each node keeps its keys in a sorted array, and leaves
+// are chained for ordered iteration. The first 8 bytes of the keys are also
+// kept inline in an array of integers, which the binary search compares
+// first; the keys themselves are compared only on ties.
+// Erasing a key doesn't merge underfull nodes (lazy deletion).
+class BPlusTreeIndex : public Index {
+    public:
+        BPlusTreeIndex();
+        ~BPlusTreeIndex() override;
+
+        RecordInfo* find(const Key& key) override;
+        RecordInfo* insert(const Key& key) override;
+        // Fills the rightmost leaf without searching the tree
+        void append(const Key& key, unique_ptr<RecordInfo> record) override;
+        unique_ptr<RecordInfo> release(const Key& key) override;
+        size_t size() const override { return size_; }
+        void for_each(
+                const function<bool(const Key&, RecordInfo&)>& fn) override;
+        void for_each_from(const Key& start,
+                const function<bool(const Key&, RecordInfo&)>& fn) override;
+        bool ordered() const override { return true; }
+
+    private:
+        // max number of keys in a node (one extra slot is allocated so that
+        // a node can overflow temporarily before it is split)
+        static const int kMaxKeys = 32;
+
+        // deep enough for any tree (a split node keeps at least half of
+        // kMaxKeys, or the rightmost one is appended to)
+        static const int kMaxDepth = 16;
+
+        struct Node {
+            bool is_leaf;
+            int nkeys = 0;
+            uint64_t prefixes[kMaxKeys + 1];  // see key_prefix()
+            Key keys[kMaxKeys + 1];
+
+            explicit Node(bool is_leaf) : is_leaf(is_leaf) {}
+            // Index of the first key >= |key| (lower) or > |key| (upper),
+            // whose prefix is |prefix|
+            int lower_bound(uint64_t prefix, const Key& key) const;
+            int upper_bound(uint64_t prefix, const Key& key) const;
+            void set_key(int i, Key key, uint64_t prefix) {
+                keys[i] = move(key);
+                prefixes[i] = prefix;
+            }
+            // keys[i] = keys[j] of |from| (moved)
+            void move_key(int i, Node* from, int j) {
+                set_key(i, move(from->keys[j]), from->prefixes[j]);
+            }
+        };
+        struct Leaf : Node {
+            RecordInfo* records[kMaxKeys + 1];
+            Leaf* next = nullptr;
+
+            Leaf() : Node(true) {}
+        };
+        struct Inner : Node {
+            // children[i] has keys in [keys[i-1], keys[i])
+            Node* children[kMaxKeys + 2];
+
+            Inner() : Node(false) {}
+        };
+
+        // The inner nodes from the root to a leaf, and the index of the
+        // child taken in each
+        struct Path {
+            pair<Inner*, int> nodes[kMaxDepth];
+            int depth = 0;
+        };
+
+        // Inserts |key| with |record| (a new one if nullptr) and returns
+        // the record of |key|
+        RecordInfo* insert_record(const Key& key, RecordInfo* record);
+        Leaf* find_leaf(const Key& key, uint64_t prefix, Path* path);
+        // Inserts (|sep|, |right|) into the parents on |path| after a split.
+        // |append| is true if |right| is the new rightmost node.
+        void insert_into_parent(Path& path, Key sep, Node* right, bool append);
+        void destroy(Node* node);
+
+        Node* root_;
+        Leaf* head_;  // leftmost leaf
+        Leaf* tail_;  // rightmost leaf
+        size_t size_ = 0;
+};
+
+// Open-addressing hash table with linear probing and backward-shift
+// deletion (no tombstones). Slots are stored in one contiguous array.
+class HashIndex : public Index {
+    public:
+        HashIndex();
+        ~HashIndex() override;
+
+        RecordInfo* find(const Key& key) override;
+        RecordInfo* insert(const Key& key) override;
+        void append(const Key& key, unique_ptr<RecordInfo> record) override;
+        unique_ptr<RecordInfo> release(const Key& key) override;
+        size_t size() const override { return size_; }
+        void reserve(size_t n) override;
+        void for_each(
+                const function<bool(const Key&, RecordInfo&)>& fn) override;
+        void for_each_from(const Key& start,
+                const function<bool(const Key&, RecordInfo&)>& fn) override;
+        bool ordered() const override { return false; }
+
+    private:
+        struct Slot {
+            size_t hash = 0;
+            RecordInfo* record = nullptr;  // nullptr -> empty slot
+            Key key;
+        };
+
+        // Returns the slot of |key| or the empty slot where it would go
+        size_t probe(const Key& key, size_t hash) const;
+        // Same as BPlusTreeIndex::insert_record()
+        RecordInfo* insert_record(const Key& key, RecordInfo* record);
+        void rehash(size_t capacity);
+
+        vector<Slot> slots_;
+        size_t mask_;
+        size_t size_ = 0;
+};
+
+#endif  // __INDEX_H__
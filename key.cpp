@@ -0,0 +1,75 @@
+#include "key.h"
+
+#include <new>
+
+using namespace std;
+
+size_t Key::empty_hash() {
+    static const size_t hash = std::hash<string_view>{}(string_view());
+    return hash;
+}
+
+Key::Key(string_view bytes) : hash_(std::hash<string_view>{}(bytes)) {
+    if (bytes.size() <= kInlineBytes) {
+        memcpy(rep_, bytes.data(), bytes.size());
+        rep_[bytes.size()] = '\0';
+        len_ = bytes.size();
+        return;
+    }
+    void* mem = ::operator new(sizeof(Block) + bytes.size() + 1);
+    Block* b = new (mem) Block();
+    b->refs.store(1, memory_order_relaxed);
+    b->len = bytes.size();
+    memcpy(b->data(), bytes.data(), bytes.size());
+    b->data()[bytes.size()] = '\0';
+    memcpy(rep_, &b, sizeof(b));
+    len_ = kHeap;
+}
+
+Key::Key(const Key& other) : hash_(other.hash_), len_(other.len_) {
+    memcpy(rep_, other.rep_, sizeof(rep_));
+    if (len_ == kHeap)
+        block()->refs.fetch_add(1, memory_order_relaxed);
+}
+
+Key::Key(Key&& other) noexcept : hash_(other.hash_), len_(other.len_) {
+    memcpy(rep_, other.rep_, sizeof(rep_));
+    other.hash_ = empty_hash();
+    other.rep_[0] = '\0';
+    other.len_ = 0;
+}
+
+Key& Key::operator=(const Key& other) {
+    if (this != &other)
+        *this = Key(other);
+    return *this;
+}
+
+Key& Key::operator=(Key&& other) noexcept {
+    if (this == &other)
+        return *this;
+    release();
+    memcpy(rep_, other.rep_, sizeof(rep_));
+    hash_ = other.hash_;
+    len_ = other.len_;
+    other.hash_ = empty_hash();
+    other.rep_[0] = '\0';
+    other.len_ = 0;
+    return *this;
+}
+
+void Key::release() {
+    if (len_ != kHeap)
+        return;
+    Block* b = block();
+    if (b->refs.fetch_sub(1, memory_order_acq_rel) != 1)
+        return;
+    b->~Block();
+    ::operator delete(b);
+}
+
+Key Key::operator+(char c) const {
+    string bytes(string_view(*this));
+    bytes += c;
+    return Key(bytes);
+}
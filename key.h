@@ -0,0 +1,91 @@
+#ifndef __KEY_H__
+#define __KEY_H__
+
+#include <atomic>
+#include <compare>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+using namespace std;
+
+// Key of a record: an immutable byte string which carries its hash.
+// The hash is computed once when the key is made from bytes, so the lock
+// table, the hash index and the conflict graph don't hash the key again on
+// every hop, and keys with different hashes compare unequal right away.
+// A key of up to kInlineBytes is stored in the Key itself (NUL-terminated),
+// and a longer one in a reference-counted block, so copying a Key never
+// copies the bytes.
+class Key {
+    public:
+        static const size_t kInlineBytes = 21;
+
+        Key() : hash_(empty_hash()), len_(0) { rep_[0] = '\0'; }
+        Key(string_view bytes);
+        Key(const char* bytes) : Key(string_view(bytes)) {}
+        Key(const string& bytes) : Key(string_view(bytes)) {}
+
+        Key(const Key& other);
+        Key(Key&& other) noexcept;
+        Key& operator=(const Key& other);
+        Key& operator=(Key&& other) noexcept;
+        ~Key() { release(); }
+
+        const char* data() const {
+            return len_ == kHeap ? block()->data() : rep_;
+        }
+        const char* c_str() const { return data(); }
+        size_t size() const { return len_ == kHeap ? block()->len : len_; }
+        bool empty() const { return size() == 0; }
+        char back() const { return data()[size() - 1]; }
+        size_t hash() const { return hash_; }
+        operator string_view() const { return string_view(data(), size()); }
+        string str() const { return string(data(), size()); }
+
+        bool operator==(const Key& other) const {
+            return hash_ == other.hash_ &&
+                   string_view(*this) == string_view(other);
+        }
+        strong_ordering operator<=>(const Key& other) const {
+            return string_view(*this).compare(string_view(other)) <=> 0;
+        }
+        // The key followed by |c|. (key + '\0' is the smallest key greater
+        // than |key|.)
+        Key operator+(char c) const;
+
+    private:
+        // Header of an out-of-line key, followed by the bytes and a NUL
+        struct Block {
+            atomic<uint32_t> refs;
+            uint32_t len;
+
+            char* data() { return reinterpret_cast<char*>(this + 1); }
+        };
+        static const uint8_t kHeap = 0xFF;  // |len_| of an out-of-line key
+
+        static size_t empty_hash();
+        Block* block() const {
+            Block* b;
+            memcpy(&b, rep_, sizeof(b));
+            return b;
+        }
+        void release();
+
+        size_t hash_;
+        char rep_[kInlineBytes + 1];  // the bytes and a NUL, or the Block*
+        uint8_t len_;  // length of the inline key, or kHeap
+};
+
+inline ostream& operator<<(ostream& os, const Key& key) {
+    return os << string_view(key);
+}
+
+template<>
+struct std::hash<Key> {
+    size_t operator()(const Key& key) const { return key.hash(); }
+};
+
+#endif  // __KEY_H__
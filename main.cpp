@@ -40,14 +40,14 @@ void transaction3(Transaction* tx) {
 
 void transaction4(Transaction* tx) {
     tx->begin();
-    int x = tx->get_until_success("key1");
+    int x = tx->get_until_success("key1").as_int();
     tx->set("key2", x + 10);
     tx->commit();
 }
 
 void transaction5(Transaction* tx) {
     tx->begin();
-    int x = tx->get_until_success("key2");
+    int x = tx->get_until_success("key2").as_int();
     tx->set("key1", x + 1);
     tx->commit();
 }
@@ -0,0 +1,393 @@
+#include "server.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+
+#include <arpa/inet.h>  // htonl
+#include <fcntl.h>
+#include <netinet/in.h>  // sockaddr_in
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std;
+
+#ifdef NLOG  // for benchmarks
+#define LOG
+#else
+#define LOG   printf("[LOG]          %s::%d\n", __FUNCTION__, __LINE__);
+#endif
+#define UNREACHABLE \
+    fprintf(stderr, "Shouldn't reach here: %s::%d\n", __FUNCTION__, __LINE__);
+
+// bytes read() at a time
+static const size_t kReadBytes = 64 * 1024;
+// a client sending a longer line is disconnected
+static const size_t kMaxLineBytes = 1 << 20;
+// interval of retrying the commands waiting for locks
+static const int kRetryMillis = 1;
+
+static void set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("fcntl");
+        exit(1);
+    }
+}
+
+Server::Server(DataBase* db, uint16_t port) : db_(db) {
+    LOG;
+    listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd_ < 0) {
+        perror("socket");
+        exit(1);
+    }
+    int one = 1;
+    setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(listen_fd_, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        exit(1);
+    }
+    if (listen(listen_fd_, SOMAXCONN) < 0) {
+        perror("listen");
+        exit(1);
+    }
+    socklen_t len = sizeof(addr);
+    getsockname(listen_fd_, (sockaddr*)&addr, &len);
+    port_ = ntohs(addr.sin_port);
+    set_nonblocking(listen_fd_);
+
+    epoll_fd_ = epoll_create1(0);
+    stop_fd_ = eventfd(0, EFD_NONBLOCK);
+    durable_fd_ = eventfd(0, EFD_NONBLOCK);
+    if (epoll_fd_ < 0 || stop_fd_ < 0 || durable_fd_ < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    for (int fd : {listen_fd_, stop_fd_, durable_fd_}) {
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev);
+    }
+    int durable_fd = durable_fd_;
+    db_->on_durable([durable_fd] {
+        uint64_t one = 1;
+        if (write(durable_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            perror("write");
+    });
+}
+
+Server::~Server() {
+    LOG;
+    while (!sessions_.empty()) {
+        close_session(sessions_.begin()->first);
+    }
+    db_->on_durable(nullptr);
+    close(durable_fd_);
+    close(stop_fd_);
+    close(epoll_fd_);
+    close(listen_fd_);
+}
+
+void Server::stop() {
+    uint64_t one = 1;
+    if (write(stop_fd_, &one, sizeof(one)) < 0)
+        perror("write");
+}
+
+void Server::run() {
+    LOG;
+    const int kMaxEvents = 64;
+    epoll_event events[kMaxEvents];
+    while (true) {
+        // poll while some commands are waiting for locks
+        int timeout = waiting_.empty() ? -1 : kRetryMillis;
+        int n = epoll_wait(epoll_fd_, events, kMaxEvents, timeout);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            exit(1);
+        }
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == stop_fd_)
+                return;
+            if (fd == listen_fd_) {
+                accept_clients();
+                continue;
+            }
+            if (fd == durable_fd_) {
+                send_durable();
+                continue;
+            }
+            auto it = sessions_.find(fd);
+            if (it == sessions_.end())
+                continue;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                receive(*it->second);
+                // (the session may have been closed)
+                it = sessions_.find(fd);
+            }
+            if (it != sessions_.end() && (events[i].events & EPOLLOUT))
+                send(*it->second);
+        }
+
+        // retry the waiting commands (ones received above have been run
+        // once by receive())
+        vector<int> waiting(waiting_.begin(), waiting_.end());
+        for (int fd : waiting) {
+            auto it = sessions_.find(fd);
+            if (it != sessions_.end())
+                execute(*it->second);
+        }
+    }
+}
+
+void Server::accept_clients() {
+    while (true) {
+        int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept4");
+            return;
+        }
+        auto s = make_unique<Session>();
+        s->fd = fd;
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev);
+        sessions_[fd] = move(s);
+    }
+}
+
+void Server::receive(Session& s) {
+    // read directly into the tail of |in|
+    size_t old_size = s.in.size();
+    s.in.resize(old_size + kReadBytes);
+    ssize_t n = read(s.fd, s.in.data() + old_size, kReadBytes);
+    s.in.resize(old_size + (n > 0 ? n : 0));
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return;
+        close_session(s.fd);
+        return;
+    }
+    if (n == 0)
+        s.closing = true;
+    execute(s);
+}
+
+void Server::execute(Session& s) {
+    // Pipelined commands which arrived together are parsed in one pass,
+    // in place in the receive buffer.
+    s.batch.clear();
+    size_t done = parse_queries(s.in, &s.batch);
+    bool waiting = false;
+    for (const Query& q : s.batch) {
+        if (!execute(s, q)) {
+            done = q.text.data() - s.in.data();
+            waiting = true;
+            break;
+        }
+    }
+    s.batch.clear();  // (refers to |in|)
+    s.in.erase(0, done);
+
+    if (waiting) {
+        waiting_.insert(s.fd);
+    } else {
+        waiting_.erase(s.fd);
+        if (s.in.size() > kMaxLineBytes) {
+            close_session(s.fd);
+            return;
+        }
+    }
+    send(s);
+}
+
+bool Server::execute(Session& s, const Query& q) {
+    switch (q.cmd) {
+        case Query::Begin:
+            if (s.in_tx) {
+                s.out += "ERR already in a transaction\n";
+                return true;
+            }
+            begin(s);
+            s.autocommit = false;
+            s.out += "OK\n";
+            return true;
+        case Query::Commit:
+        case Query::Abort:
+            if (!s.in_tx) {
+                s.out += "ERR not in a transaction\n";
+                return true;
+            }
+            if (q.cmd == Query::Abort) {
+                s.in_tx = false;
+                s.tx->abort();
+                s.out += "OK\n";
+            } else {
+                commit(s, "OK");
+            }
+            return true;
+        case Query::Unknown:
+            s.out += "ERR ";
+            s.out += describe(q.error);
+            s.out += '\n';
+            return true;
+        default:
+            break;
+    }
+
+    if (!s.in_tx) {
+        begin(s);
+        s.autocommit = true;
+    }
+    Transaction* tx = s.tx.get();
+    string reply;
+    switch (q.cmd) {
+        case Query::Set:
+            if (!tx->try_set(Key(q.arg1), q.is_str ? Value(q.str) : Value(q.arg2)))
+                return false;
+            reply = "OK";
+            break;
+        case Query::Get: {
+            optional<Value> value;
+            if (!tx->try_get(Key(q.arg1), &value))
+                return false;
+            reply = value ? value->to_string() : "NOT_FOUND";
+            break;
+        }
+        case Query::Del: {
+            bool absent;
+            if (!tx->try_del(Key(q.arg1), &absent))
+                return false;
+            reply = absent ? "NOT_FOUND" : "OK";
+            break;
+        }
+        case Query::Keys:
+            for (const auto& key : tx->list_keys()) {
+                if (!reply.empty())
+                    reply += ' ';
+                reply += key;
+            }
+            break;
+        default:
+            UNREACHABLE;
+            break;
+    }
+    // killed by wait-die (or a cycle); commit will fail too
+    if (tx->killed_)
+        reply = "ABORTED";
+    if (s.autocommit) {
+        commit(s, reply);
+        return true;
+    }
+    s.out += reply;
+    s.out += '\n';
+    return true;
+}
+
+void Server::begin(Session& s) {
+    s.tx = db_->generate_tx(nullptr);
+    s.tx->set_nonblocking();
+    s.tx->begin();
+    s.in_tx = true;
+}
+
+void Server::commit(Session& s, string reply) {
+    s.in_tx = false;
+    uint64_t ticket;
+    if (!s.tx->commit(&ticket))
+        reply = "ABORTED";
+    // (a read-only commit waits for the commits it may have read)
+    if (!db_->durable(ticket))
+        s.held.push_back({s.out.size(), ticket});
+    s.out += reply;
+    s.out += '\n';
+}
+
+void Server::send(Session& s) {
+    size_t n_sendable = sendable(s);
+    if (s.held.empty())
+        undurable_.erase(s.fd);
+    else
+        undurable_.insert(s.fd);
+    size_t sent = 0;
+    while (sent < n_sendable) {
+        ssize_t n = ::send(s.fd, s.out.data() + sent, n_sendable - sent,
+                           MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno == EINTR)
+                continue;
+            close_session(s.fd);
+            return;
+        }
+        sent += n;
+    }
+    s.out.erase(0, sent);
+    for (auto& held : s.held) {
+        held.first -= sent;
+    }
+    if (s.closing && s.out.empty() && !waiting_.count(s.fd)) {
+        close_session(s.fd);
+        return;
+    }
+    update_events(s);
+}
+
+size_t Server::sendable(Session& s) {
+    while (!s.held.empty() && db_->durable(s.held.front().second)) {
+        s.held.pop_front();
+    }
+    return s.held.empty() ? s.out.size() : s.held.front().first;
+}
+
+void Server::send_durable() {
+    uint64_t count;
+    if (read(durable_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("read");
+    vector<int> ready;
+    for (int fd : undurable_) {
+        const Session& s = *sessions_.at(fd);
+        if (db_->durable(s.held.front().second))
+            ready.push_back(fd);
+    }
+    for (int fd : ready) {
+        send(*sessions_.at(fd));
+    }
+}
+
+void Server::update_events(Session& s) {
+    epoll_event ev = {};
+    ev.events = 0;
+    if (!s.closing)
+        ev.events |= EPOLLIN;
+    if (sendable(s) > 0)
+        ev.events |= EPOLLOUT;
+    ev.data.fd = s.fd;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, s.fd, &ev);
+}
+
+void Server::close_session(int fd) {
+    auto it = sessions_.find(fd);
+    if (it == sessions_.end())
+        return;
+    // releases the locks of the unfinished transaction
+    if (it->second->in_tx)
+        it->second->tx->abort();
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    waiting_.erase(fd);
+    undurable_.erase(fd);
+    sessions_.erase(it);
+}
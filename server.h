@@ -0,0 +1,101 @@
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "database.h"
+#include "utils.h"
+
+using namespace std;
+
+// TCP front-end of DataBase speaking the line protocol of parse_query():
+//   set <key> <value> / get <key> / del <key> / begin / commit / abort / keys
+// where a value is an int, or a string (without whitespace) otherwise.
+// Every command gets one line of reply:
+//   set, begin, abort      -> OK
+//   get                    -> <value> or NOT_FOUND
+//   del                    -> OK or NOT_FOUND
+//   commit                 -> OK or ABORTED
+//   keys                   -> the keys separated by spaces
+//   (malformed or misplaced commands) -> ERR <reason>
+// A command outside begin/commit runs in a transaction of its own, which
+// replies ABORTED instead if it fails to commit.
+//
+// Each connection is a session running one Transaction at a time (each with
+// a fresh ID, so that wait-die doesn't always favor the same sessions). All
+// the sessions are multiplexed on the thread of run() with epoll, so nothing
+// blocks the thread: a command which has to wait for a lock is retried on the
+// next turn (the transactions are nonblocking), and a commit does not wait
+// for its log record. The reply of a commit (and the ones after it) is held
+// back until the commits logged up to then are durable; the log flusher wakes
+// the loop through an eventfd. The commits of all the sessions are thus
+// flushed together. Clients may pipeline commands; the replies come back in
+// order.
+class Server {
+    public:
+        // Listens on 127.0.0.1:|port| (0 picks a free port)
+        Server(DataBase* db, uint16_t port);
+        ~Server();
+
+        uint16_t port() const { return port_; }
+        // Serves the clients until stop() is called
+        void run();
+        // Thread-safe
+        void stop();
+
+    private:
+        struct Session {
+            int fd;
+            unique_ptr<Transaction> tx;
+            bool in_tx = false;
+            bool autocommit = false;  // |tx| runs a single command
+            string in;                // received commands not executed yet
+            string out;               // replies not sent yet
+            vector<Query> batch;      // commands parsed out of |in|
+            bool closing = false;     // the client has shut down
+            // (offset in |out|, ticket) of the commit replies waiting for
+            // the log; |out| is sent up to the first one
+            deque<pair<size_t, uint64_t>> held;
+        };
+
+        void accept_clients();
+        // Reads from the socket and executes the commands
+        void receive(Session& s);
+        // Executes the complete lines in |in| until a command has to wait
+        // (it is parsed again on the next try)
+        void execute(Session& s);
+        // Returns false if |q| has to wait for a lock
+        bool execute(Session& s, const Query& q);
+        // Starts a transaction with a new ID
+        void begin(Session& s);
+        // Commits the transaction and appends the reply
+        void commit(Session& s, string reply);
+        // Sends |out| as far as the socket accepts, up to the first reply
+        // which is not durable yet
+        void send(Session& s);
+        // The bytes of |out| which may be sent
+        size_t sendable(Session& s);
+        // Sends the replies of the sessions whose commits have become durable
+        void send_durable();
+        // Waits for EPOLLOUT iff |out| is not empty and can be sent
+        void update_events(Session& s);
+        void close_session(int fd);
+
+        DataBase* db_;
+        int listen_fd_;
+        int epoll_fd_;
+        int stop_fd_;  // eventfd written by stop()
+        int durable_fd_;  // eventfd written by the log flusher
+        uint16_t port_;
+        unordered_map<int, unique_ptr<Session>> sessions_;
+        unordered_set<int> waiting_;  // sessions whose command waits for a lock
+        unordered_set<int> undurable_;  // sessions whose replies wait for fsync
+};
+
+#endif  // __SERVER_H__
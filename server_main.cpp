@@ -0,0 +1,34 @@
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include "database.h"
+#include "server.h"
+
+using namespace std;
+
+const string dumpfilename = ".seccampDB_dump";
+const string logfilename = ".seccampDB_log";
+
+static Server* server = nullptr;
+
+static void handle_signal(int) {
+    server->stop();
+}
+
+// usage: ./server [port]
+int main(int argc, char** argv)
+{
+    uint16_t port = argc > 1 ? atoi(argv[1]) : 5555;
+    // (no workers: the transactions are run by the server itself)
+    Scheduler scheduler = Scheduler(Scheduler::Concurrent, 0);
+    DataBase db = DataBase(&scheduler, dumpfilename, logfilename);
+    Server srv(&db, port);
+    server = &srv;
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+    printf("listening on 127.0.0.1:%d\n", srv.port());
+    fflush(stdout);
+    srv.run();
+    return 0;
+}
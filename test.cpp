@@ -1,13 +1,22 @@
+#include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <future>
 #include <cassert>
+#include <map>
 #include <memory>
 #include <unistd.h>
 #include <stdio.h>
 #include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
 #include <thread>
 #include "utils.h"
 #include "database.h"
+#include "server.h"
 using namespace std;
 
 #define TEST(x) init(); x(); cout << "\e[32mpassed " << #x << "\e[m" << endl;
@@ -21,10 +30,20 @@ void init() {
     ofstream ofs_log(logfilename, ofstream::trunc);
     ofs_dump.close();
     ofs_log.close();
+    remove((logfilename + ".old").c_str());
 }
 
+size_t file_size(string filename) {
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0)
+        return 0;
+    return st.st_size;
+}
+
+// absent keys are regarded as 0
 void assert_value(DataBase* db, Key key, int expected_value) {
-    assert(db->table[key].value == expected_value);
+    DataBase::RecordInfo* record = db->table->find(key);
+    assert((record && record->present() ? record->value : 0) == expected_value);
 }
 
 void tx_basics1(Transaction* tx) {
@@ -37,8 +56,8 @@ void tx_basics1(Transaction* tx) {
 void tx_basics2(Transaction* tx) {
     tx->begin();
     tx->set("key1", 1);
-    optional<int> result = tx->get("key1");
-    tx->set("key1", result.value() + 1);
+    optional<Value> result = tx->get("key1");
+    tx->set("key1", result.value().as_int() + 1);
     tx->commit();
 }
 
@@ -137,7 +156,6 @@ void test_recover() {
     } else {
         // parent process (pid : pid of child proc)
         sleep(1);
-        cat(logfilename);
         Scheduler scheduler = Scheduler();
         DataBase db = DataBase(&scheduler, dumpfilename, logfilename);
 
@@ -146,6 +164,125 @@ void test_recover() {
     }
 }
 
+void test_torn_log() {
+    pid_t pid;
+    pid = fork();
+    if (pid == -1) {
+        perror("cannot fork");
+        return;
+    }
+
+    if (pid == 0) {
+        // child process
+        Scheduler scheduler = Scheduler();
+        DataBase db = DataBase(&scheduler, dumpfilename, logfilename);
+
+        scheduler.add_tx(move(tx_basics1));
+        scheduler.start();
+        scheduler.add_tx([](Transaction* tx) {
+            tx->begin();
+            tx->set("key3", 3);
+            tx->commit();
+        });
+        scheduler.start();
+        exit(0);
+    } else {
+        // parent process (pid : pid of child proc)
+        waitpid(pid, nullptr, 0);
+
+        // simulate a crash in the middle of writing the last record
+        struct stat st;
+        stat(logfilename.c_str(), &st);
+        assert(truncate(logfilename.c_str(), st.st_size - 3) == 0);
+
+        Scheduler scheduler = Scheduler();
+        DataBase db = DataBase(&scheduler, dumpfilename, logfilename);
+
+        assert_value(&db, "key1", 1);
+        assert_value(&db, "key2", 2);
+        assert(db.table->count("key3") == 0);
+    }
+}
+
+void test_text_log() {
+    // a log of the former text format, whose last transaction is torn
+    auto line = [](const string& key, int mode, int value) {
+        string seed = key + to_string(mode) + to_string(value);
+        return to_string(crc32(seed.data(), seed.size())) + " " + key + " " +
+               to_string(mode) + " " + to_string(value) + "\n";
+    };
+    {
+        ofstream ofs(logfilename, ofstream::trunc);
+        ofs << "{\n" << line("key1", 0, 1) << line("key2", 0, 2) << "}\n";
+        ofs << "{\n" << line("key2", 1, 0) << "}\n";
+        ofs << "{\n" << line("key3", 0, 3);
+    }
+    // converted on the first start, and read back as a snapshot
+    for (int round = 0; round < 2; round++) {
+        Scheduler scheduler = Scheduler();
+        DataBase db = DataBase(&scheduler, dumpfilename, logfilename);
+        assert_value(&db, "key1", 1);
+        assert(db.table->count("key2") == 0);
+        assert(db.table->count("key3") == 0);
+    }
+}
+
+void test_text_dump() {
+    // a dump of the former text format, with the text log after it
+    {
+        ofstream ofs(dumpfilename, ofstream::trunc);
+        ofs << "key1 1\n" << "key2 2\n";
+    }
+    {
+        string seed = "key2" + to_string(1) + to_string(0);
+        ofstream ofs(logfilename, ofstream::trunc);
+        ofs << "{\n" << crc32(seed.data(), seed.size()) << " key2 1 0\n}\n";
+    }
+    for (int round = 0; round < 2; round++) {
+        Scheduler scheduler = Scheduler();
+        DataBase db = DataBase(&scheduler, dumpfilename, logfilename);
+        assert_value(&db, "key1", 1);
+        assert(db.table->count("key2") == 0);
+    }
+}
+
+void test_parallel_recovery() {
+    // The log grows larger than a chunk (8MiB) of the recovery
+    const int ntx = 10;
+    const int nkeys = 5000;
+    const string prefix(400, 'k');
+    Scheduler scheduler = Scheduler();
+    DBOptions options;
+    options.checkpoint_interval = chrono::milliseconds(0);
+    options.recovery_threads = 4;
+    unique_ptr<DataBase> db1(
+            new DataBase(&scheduler, dumpfilename, logfilename, options));
+    for (int n = 0; n < ntx; n++) {
+        scheduler.add_tx([&, n](Transaction* tx) {
+            tx->begin();
+            for (int i = 0; i < nkeys; i++) {
+                // later transactions overwrite the keys of earlier ones
+                if (i % ntx >= n)
+                    tx->set(prefix + to_string(i), n);
+            }
+            tx->del(prefix + to_string(n));
+            tx->commit();
+        });
+        scheduler.start();
+    }
+    db1.reset();
+    assert(file_size(logfilename) > (8 << 20));
+
+    unique_ptr<DataBase> db2(
+            new DataBase(&scheduler, dumpfilename, logfilename, options));
+    for (int i = 0; i < nkeys; i++) {
+        if (i < ntx)
+            assert(db2->table->count(prefix + to_string(i)) == 0);
+        else
+            assert_value(db2.get(), prefix + to_string(i), i % ntx);
+    }
+}
+
 void test_read_read_conflict() {
     // shouldn't conflict
     Scheduler scheduler = Scheduler();
@@ -169,7 +306,1315 @@ void test_huge() {
     }
     scheduler.start();
 
-    int val = db.table["key0"].value;
+    int val = db.table->find("key0")->value.as_int();
+    for (int i = 0; i < 100; i++) {
+        assert_value(&db, "key" + to_string(i), val);
+    }
+}
+
+void test_round_robin() {
+    Scheduler scheduler = Scheduler(Scheduler::RoundRobin);
+    DataBase db = DataBase(&scheduler, dumpfilename, logfilename);
+
+    scheduler.add_tx(move(tx_basics1));
+    scheduler.add_tx(move(tx_read_read_conflict1));
+    scheduler.add_tx(move(tx_read_read_conflict2));
+    scheduler.start();
+
+    assert_value(&db, "key1", 1);
+    assert_value(&db, "key2", 2);
+}
+
+void test_coroutine() {
+    Scheduler scheduler = Scheduler(Scheduler::Coroutine);
+    DataBase db = DataBase(&scheduler, dumpfilename, logfilename);
+    scheduler.add_coroutine_tx([](Transaction* tx) -> TxCoroutine {
+        co_await tx->async_begin();
+        co_await tx->async_set("key1", 1);
+        co_await tx->async_set("key2", 2);
+        co_await tx->async_commit();
+    });
+    scheduler.start();
+
+    // same as test_wait_die: tx2 dies and succeeds on retry
+    bool committed1 = false;
+    vector<bool> committed2;
+    scheduler.add_coroutine_tx([&](Transaction* tx) -> TxCoroutine {
+        co_await tx->async_begin();
+        co_await tx->async_set("key1", 10);
+        co_await tx->async_set("key2", 20);
+        committed1 = co_await tx->async_commit();
+    });
+    scheduler.add_coroutine_tx([&](Transaction* tx) -> TxCoroutine {
+        bool ok;
+        do {
+            co_await tx->async_begin();
+            int x = (co_await tx->async_get_until_success("key2")).as_int();
+            co_await tx->async_set("key1", x + 100);
+            committed2.push_back(ok = co_await tx->async_commit());
+        } while (!ok);
+    });
+    scheduler.start();
+
+    assert(committed1);
+    assert((committed2 == vector<bool>{false, true}));
+    assert_value(&db, "key1", 120);
+    assert_value(&db, "key2", 20);
+}
+
+void test_concurrent() {
+    Scheduler scheduler = Scheduler(Scheduler::Concurrent);
+    DataBase db = DataBase(&scheduler, dumpfilename, logfilename);
+
+    // populate keys first so that every writer takes write locks
+    scheduler.add_tx([](Transaction* tx) { tx_huge(0, tx); });
+    scheduler.start();
+
+    for (int n = 1; n <= 16; n++) {
+        scheduler.add_tx([n](Transaction* tx) { tx_huge(n, tx); });
+    }
+    scheduler.start();
+
+    int val = db.table->find("key0")->value.as_int();
+    assert(val > 0);
+    for (int i = 0; i < 100; i++) {
+        assert_value(&db, "key" + to_string(i), val);
+    }
+}
+
+void test_conflict_graph() {
+    // r1(x) w2(x) w2(y) c2 r1(y): 1 -> 2 -> 1
+    ConflictGraph g;
+    g.read(1, "x");
+    g.write(2, "x");
+    g.write(2, "y");
+    g.finish(2, true);
+    assert(g.ncycles() == 0);
+    g.read(1, "y");
+    assert(g.ncycles() == 1);
+    g.finish(1, true);
+
+    // edges against the order of creation are fine until a cycle closes
+    ConflictGraph h;
+    h.read(10, "p");
+    h.read(11, "q");
+    h.read(12, "r");
+    h.write(10, "q");  // 11 -> 10
+    h.write(11, "r");  // 12 -> 11
+    assert(h.ncycles() == 0 && h.size() == 3);
+    h.write(12, "p");  // 10 -> 12
+    assert(h.ncycles() == 1);
+
+    // committed transactions are pruned, however long the history is
+    ConflictGraph k;
+    for (int i = 0; i < 100000; i++) {
+        k.read(i, "counter");
+        k.write(i, "counter");
+        k.write(i, "key" + to_string(i % 100));
+        k.finish(i, true);
+    }
+    assert(k.ncycles() == 0 && k.size() == 0 && k.nkeys() == 0);
+    // a transaction waits for the ones it depends on
+    k.read(1, "a");
+    k.write(2, "a");  // 1 -> 2
+    k.finish(2, true);
+    assert(k.size() == 2);
+    // an aborted one is forgotten
+    k.finish(1, false);
+    assert(k.size() == 0);
+
+    // checked online by the scheduler
+    Scheduler scheduler = Scheduler(Scheduler::Concurrent);
+    DataBase db = DataBase(&scheduler, dumpfilename, logfilename);
+    scheduler.add_tx([](Transaction* tx) { tx_huge(0, tx); });
+    scheduler.start();
+    for (int n = 1; n <= 16; n++) {
+        scheduler.add_tx([n](Transaction* tx) { tx_huge(n, tx); });
+    }
+    scheduler.start();
+    assert(scheduler.serializability_violations() == 0);
+}
+
+void test_history() {
+    const string tracefile = ".seccampDB_trace";
+    {
+        // r1(x) w2(x) w2(y) c2 r1(y) c1: 1 -> 2 -> 1
+        History h(4);
+        h.trace(tracefile);
+        h.record(1, "x", Read);
+        h.record(2, "x", Write);
+        h.record(2, "y", Write);
+        h.record_finish(2, true);
+        h.record(1, "y", Read);
+        h.record_finish(1, true);
+
+        // the ring keeps the last 4 records
+        vector<History::Event> events;
+        h.for_each([&](const History::Event& e) { events.push_back(e); });
+        assert(h.size() == 4 && events.size() == 4);
+        assert(events[0].txid == 2 && events[0].op == History::Write &&
+               events[0].key == "y");
+        assert(events[3].txid == 1 && events[3].op == History::Commit &&
+               events[3].key.empty());
+    }
+    // the trace has them all
+    ConflictGraph g;
+    size_t n = 0;
+    assert(History::replay(tracefile, [&](const History::Event& e) {
+        g.add(e);
+        n++;
+    }));
+    assert(n == 6 && g.ncycles() == 1);
+    // a torn record
+    assert(truncate(tracefile.c_str(), file_size(tracefile) - 3) == 0);
+    n = 0;
+    assert(!History::replay(tracefile, [&](const History::Event&) { n++; }));
+    assert(n == 5);
+
+    // the ID of a key is freed when the ring has no more records of it, and
+    // reused for another key (defined again in the trace)
+    {
+        History h(4);
+        h.trace(tracefile);
+        for (int i = 0; i < 100; i++) {
+            h.record(i, "key" + to_string(i), Write);
+            h.record_finish(i, true);
+        }
+        assert(h.nkeys() == 2);
+        vector<string> keys;
+        h.for_each([&](const History::Event& e) {
+            if (e.op == History::Write)
+                keys.push_back(string(e.key));
+        });
+        assert((keys == vector<string>{"key98", "key99"}));
+    }
+    n = 0;
+    assert(History::replay(tracefile, [&](const History::Event& e) {
+        if (e.op == History::Write) {
+            assert(e.key == "key" + to_string(e.txid));
+            n++;
+        }
+    }));
+    assert(n == 100);
+
+    // traced by the scheduler
+    {
+        Scheduler scheduler = Scheduler(Scheduler::Concurrent);
+        scheduler.trace(tracefile);
+        DataBase db = DataBase(&scheduler, dumpfilename, logfilename);
+        for (int n = 0; n < 16; n++) {
+            scheduler.add_tx([n](Transaction* tx) { tx_huge(n, tx); });
+        }
+        scheduler.start();
+    }
+    ConflictGraph h;
+    size_t nfinished = 0;  // (some may be killed by wait-die)
+    assert(History::replay(tracefile, [&](const History::Event& e) {
+        h.add(e);
+        nfinished += (e.op == History::Commit || e.op == History::Abort);
+    }));
+    assert(nfinished == 16 && h.ncycles() == 0 && h.size() == 0);
+    remove(tracefile.c_str());
+}
+
+void test_thread_pool() {
+    const int ntx = 200;
+    Scheduler scheduler = Scheduler(Scheduler::Concurrent, 4);
+    DataBase db = DataBase(&scheduler, dumpfilename, logfilename);
+
+    // many more transactions than workers
+    for (int n = 0; n < ntx; n++) {
+        scheduler.add_tx([](Transaction* tx) {
+            do {
+                tx->begin();
+                int x = tx->get("counter").value_or(0).as_int();
+                tx->set("counter", x + 1);
+            } while (!tx->commit());
+        });
+    }
+    scheduler.start();
+    assert_value(&db, "counter", ntx);
+}
+
+void test_submit() {
+    const int nproducers = 4;
+    const int ntx = 50;  // per producer
+    Scheduler scheduler = Scheduler(Scheduler::Concurrent, 4);
+    DataBase db = DataBase(&scheduler, dumpfilename, logfilename);
+
+    // producers feed batches while the scheduler is serving
+    thread server(&Scheduler::serve, &scheduler);
+    vector<thread> producers;
+    vector<vector<future<bool>>> outcomes(nproducers);
+    for (int p = 0; p < nproducers; p++) {
+        producers.emplace_back([&, p]() {
+            for (int batch = 0; batch < ntx / 10; batch++) {
+                vector<Transaction::Logic> logics;
+                for (int n = 0; n < 10; n++) {
+                    logics.push_back([](Transaction* tx) {
+                        do {
+                            tx->begin();
+                            int x = tx->get("counter").value_or(0).as_int();
+                            tx->set("counter", x + 1);
+                        } while (!tx->commit());
+                    });
+                }
+                for (auto& f : scheduler.submit(logics)) {
+                    outcomes[p].push_back(move(f));
+                }
+            }
+        });
+    }
+    for (auto& th : producers) {
+        th.join();
+    }
+    future<bool> aborted = scheduler.submit([](Transaction* tx) {
+        tx->begin();
+        tx->set("counter", -1);
+        tx->abort();
+    });
+    scheduler.close();
+    server.join();
+
+    for (auto& futures : outcomes) {
+        assert((int)futures.size() == ntx);
+        for (auto& f : futures) {
+            assert(f.get());
+        }
+    }
+    assert(!aborted.get());
+    assert_value(&db, "counter", nproducers * ntx);
+
+    // submitted before start()
+    future<bool> outcome = scheduler.submit([](Transaction* tx) {
+        tx->begin();
+        tx->del("counter");
+        tx->commit();
+    });
+    scheduler.start();
+    assert(outcome.get());
+    assert_value(&db, "counter", 0);
+}
+
+void test_arena() {
+    Arena arena;
+    for (int round = 0; round < 2; round++) {
+        vector<string_view> copies;
+        for (int i = 0; i < 1000; i++) {
+            copies.push_back(arena.copy("key" + to_string(i)));
+        }
+        assert(copies[0] == "key0" && copies[999] == "key999");
+        // blocks bigger than a chunk
+        string_view big = arena.copy(string(100000, 'x'));
+        assert(big.size() == 100000 && big[99999] == 'x');
+        size_t nchunks = arena.nchunks();
+        arena.reset();
+        // the second round reuses the chunks
+        assert(round == 0 || arena.nchunks() == nchunks);
+    }
+
+    FlatMap<int> map;
+    for (uint32_t i = 0; i < 1000; i++) {
+        map.insert(i * 65536, i);
+    }
+    assert(map.size() == 1000 && *map.find(999 * 65536) == 999);
+    assert(!map.find(1) && !map.find(1000 * 65536));
+    map.clear();
+    assert(map.empty() && !map.find(0));
+
+    // A retried transaction reuses its arena
+    for (CCProtocol protocol :
+         {TwoPhaseLocking, Optimistic, SerializationGraph}) {
+        init();
+        Scheduler scheduler = Scheduler();
+        DBOptions options;
+        options.protocol = protocol;
+        options.checkpoint_interval = chrono::milliseconds(0);
+        DataBase db = DataBase(&scheduler, dumpfilename, logfilename, options);
+        scheduler.add_tx([&](Transaction* tx) {
+            size_t nchunks = 0;
+            for (int round = 0; round < 3; round++) {
+                tx->begin();
+                for (int i = 0; i < 500; i++) {
+                    Key key = "key" + to_string(i);
+                    tx->set(key, tx->get(key).value_or(0).as_int() + 1);
+                }
+                assert(tx->commit());
+                if (round == 1)
+                    nchunks = tx->arena.nchunks();
+                assert(round < 2 || tx->arena.nchunks() == nchunks);
+            }
+            assert(tx->write_set.empty() && tx->lock_set.empty());
+        });
+        scheduler.start();
+        assert_value(&db, "key0", 3);
+        assert_value(&db, "key499", 3);
+    }
+}
+
+void test_crc32c() {
+    // check value of CRC-32C
+    assert(crc32c("123456789") == 0xE3069283);
+    assert(crc32c("") == 0);
+
+    // every implementation, length and alignment gives the same result
+    string data;
+    for (int i = 0; i < 300; i++) {
+        data += (char)(i * 131 + 7);
+    }
+    for (size_t off = 0; off < 8; off++) {
+        for (size_t len = 0; off + len <= data.size(); len += 13) {
+            const char* p = data.data() + off;
+            uint32_t crc = crc32c_slicing8(0, p, len);
+            if (has_sse42())
+                assert(crc32c_sse42(0, p, len) == crc);
+            assert(crc32c(p, len) == crc);
+
+            // incremental
+            Crc32c inc;
+            inc.update(p, len / 3);
+            inc.update(string_view(p + len / 3, len - len / 3));
+            assert(inc.value() == crc);
+        }
+    }
+
+    Crc32c zeros;
+    zeros.update("ab", 2);
+    zeros.update_zeros(100);
+    assert(zeros.value() == crc32c(string("ab") + string(100, '\0')));
+}
+
+void test_parser() {
+    Query q = parse_query("  set key1\t-42 ");
+    assert(q.ok() && q.cmd == Query::Set && q.arg1 == "key1" && q.arg2 == -42);
+    q = parse_query("get key2\r");
+    assert(q.ok() && q.cmd == Query::Get && q.arg1 == "key2");
+    assert(parse_query("abort").cmd == Query::Abort);
+    assert(parse_query("").error == Query::Empty);
+    assert(parse_query("put a 1").error == Query::UnknownCommand);
+    assert(parse_query("set a").error == Query::WrongArity);
+    assert(parse_query("keys a").error == Query::WrongArity);
+    assert(parse_query("set a 99999999999").error == Query::BadInteger);
+    assert(parse_query("set a -").cmd == Query::Set);
+    q = parse_query("set a 1x");
+    assert(q.ok() && q.is_str && q.str == "1x");
+
+    // a batch of pipelined commands; the incomplete last line is left
+    string input = "begin\nset a 1\n\nget a\ncommit\nkey";
+    vector<Query> queries;
+    size_t consumed = parse_queries(input, &queries);
+    assert(consumed == input.size() - 3);
+    assert(queries.size() == 4);
+    assert(queries[1].cmd == Query::Set && queries[1].arg1 == "a");
+    assert(queries[1].text == "set a 1");
+    assert(queries[3].cmd == Query::Commit);
+}
+
+static int connect_to(uint16_t port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    assert(connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0);
+    return fd;
+}
+
+static void send_str(int fd, const string& str) {
+    assert(write(fd, str.data(), str.size()) == (ssize_t)str.size());
+}
+
+// Reads |n| lines of reply
+static vector<string> recv_lines(int fd, int n) {
+    string buf;
+    while (count(buf.begin(), buf.end(), '\n') < n) {
+        char tmp[256];
+        ssize_t len = read(fd, tmp, sizeof(tmp));
+        assert(len > 0);
+        buf.append(tmp, len);
+    }
+    vector<string> lines;
+    size_t start = 0, end;
+    while ((end = buf.find('\n', start)) != string::npos) {
+        lines.push_back(buf.substr(start, end - start));
+        start = end + 1;
+    }
+    return lines;
+}
+
+void test_server() {
+    Scheduler scheduler = Scheduler(Scheduler::Concurrent, 0);
+    DataBase db = DataBase(&scheduler, dumpfilename, logfilename);
+    Server server(&db, 0);
+    thread th(&Server::run, &server);
+
+    int c1 = connect_to(server.port());
+    int c2 = connect_to(server.port());
+
+    // pipelined commands in one write, and a command split across writes
+    send_str(c1, "set key1 10\nset key2 20\nget key1\nget nokey\nkeys\n"
+                 "del key2\ndel key2\nbogus\nset key1\nabort\nge");
+    send_str(c1, "t key2\r\nset key3 hello\nget key3\ndel key3\n");
+    assert((recv_lines(c1, 14) == vector<string>{
+        "OK", "OK", "10", "NOT_FOUND", "key1 key2", "OK", "NOT_FOUND",
+        "ERR unknown command", "ERR wrong number of arguments",
+        "ERR not in a transaction", "NOT_FOUND", "OK", "hello", "OK"}));
+
+    // c1 waits for the write lock of c2 (c1 began first and is older, so it
+    // doesn't die)
+    send_str(c1, "begin\n");
+    assert((recv_lines(c1, 1) == vector<string>{"OK"}));
+    send_str(c2, "begin\nset key1 11\n");
+    assert((recv_lines(c2, 2) == vector<string>{"OK", "OK"}));
+    send_str(c1, "get key1\n");
+    send_str(c2, "commit\n");
+    assert((recv_lines(c2, 1) == vector<string>{"OK"}));
+    send_str(c1, "commit\n");
+    assert((recv_lines(c1, 2) == vector<string>{"11", "OK"}));
+
+    // the younger one dies instead (each transaction gets a new ID)
+    send_str(c1, "begin\nset key1 12\n");
+    assert((recv_lines(c1, 2) == vector<string>{"OK", "OK"}));
+    send_str(c2, "begin\nget key1\ncommit\n");
+    assert((recv_lines(c2, 3) == vector<string>{"OK", "ABORTED", "ABORTED"}));
+    send_str(c1, "abort\n");
+    assert((recv_lines(c1, 1) == vector<string>{"OK"}));
+
+    // an unfinished transaction is aborted on disconnect
+    send_str(c1, "begin\nset key1 12\n");
+    assert((recv_lines(c1, 2) == vector<string>{"OK", "OK"}));
+    close(c1);
+    send_str(c2, "get key1\n");
+    assert((recv_lines(c2, 1) == vector<string>{"11"}));
+
+    // pipelined commits don't wait for each other's fsync, so they share it
+    const int ncommits = 50;
+    size_t nflushes = db.log_flush_count();
+    string commands;
+    for (int i = 0; i < ncommits; i++) {
+        commands += "set key" + to_string(i) + " " + to_string(i) + "\n";
+    }
+    send_str(c2, commands);
+    assert(recv_lines(c2, ncommits) == vector<string>(ncommits, "OK"));
+    assert(db.log_flush_count() - nflushes < ncommits / 2);
+    close(c2);
+
+    server.stop();
+    th.join();
+    assert_value(&db, "key1", 1);
+    assert_value(&db, "key2", 2);
+}
+
+void test_group_commit() {
+    const int ntx = 16;
+    // every transaction needs its own worker to run at the same time
+    Scheduler scheduler = Scheduler(Scheduler::Concurrent, ntx);
+    DBOptions options;
+    options.group_commit.max_wait = chrono::seconds(1);
+    DataBase db = DataBase(&scheduler, dumpfilename, logfilename, options);
+
+    atomic<int> nbegun = 0;
+    for (int n = 0; n < ntx; n++) {
+        scheduler.add_tx([n, &nbegun](Transaction* tx) {
+            tx->begin();
+            tx->set("key" + to_string(n), n);
+            // make sure that all the transactions are running at commit time
+            nbegun++;
+            while (nbegun < ntx)
+                this_thread::yield();
+            tx->commit();
+        });
+    }
+    scheduler.start();
+
+    assert(db.log_flush_count() < ntx);
+    for (int n = 0; n < ntx; n++) {
+        assert_value(&db, "key" + to_string(n), n);
+    }
+}
+
+void check_index(Index::Type type) {
+    unique_ptr<Index> index = Index::create(type);
+    map<Key, int> expected;
+    srand(0);
+
+    for (int i = 0; i < 20000; i++) {
+        Key key = "key" + to_string(rand() % 5000);
+        if (rand() % 3 == 0) {
+            assert(index->erase(key) == (expected.erase(key) > 0));
+        } else {
+            index->insert(key)->value = i;
+            expected[key] = i;
+        }
+    }
+
+    assert(index->size() == expected.size());
+    for (const auto& [key, value] : expected) {
+        assert(index->find(key) != nullptr);
+        assert(index->find(key)->value == value);
+    }
+    assert(index->find("not_found") == nullptr);
+
+    vector<Key> keys;
+    index->for_each([&](const Key& key, RecordInfo&) {
+        keys.push_back(key);
+        return true;
+    });
+    assert(keys.size() == expected.size());
+    if (index->ordered()) {
+        assert(is_sorted(keys.begin(), keys.end()));
+    }
+
+    // sorted insertion (e.g. loading a snapshot), by insert() and append()
+    unique_ptr<Index> sorted = Index::create(type);
+    unique_ptr<Index> appended = Index::create(type);
+    char buf[16];
+    for (int i = 0; i < 10000; i++) {
+        snprintf(buf, sizeof(buf), "key%05d", i);
+        sorted->insert(buf)->value = i;
+        auto record = make_unique<RecordInfo>();
+        record->value = i;
+        appended->append(buf, move(record));
+    }
+    // out of order, and replacing a record
+    for (int i : {-1, 5000, 9999}) {
+        auto record = make_unique<RecordInfo>();
+        record->value = i;
+        appended->append(i < 0 ? "key" : "key0" + to_string(i), move(record));
+    }
+    appended->insert("key05000a")->value = 5000;
+    for (int i = 0; i < 10000; i++) {
+        snprintf(buf, sizeof(buf), "key%05d", i);
+        assert(sorted->find(buf)->value == i);
+        assert(appended->find(buf)->value == i);
+    }
+    assert(appended->size() == 10002 && appended->find("key")->value == -1);
+    keys.clear();
+    appended->for_each([&](const Key& key, RecordInfo&) {
+        keys.push_back(key);
+        return true;
+    });
+    assert(keys.size() == 10002);
+    if (appended->ordered()) {
+        assert(is_sorted(keys.begin(), keys.end()));
+    }
+
+    // keys which differ only after their first 8 bytes, or by trailing NULs
+    unique_ptr<Index> prefixed = Index::create(type);
+    vector<Key> long_keys = {string("ab", 2), string("ab\0", 3),
+                             string("ab\0\0", 4)};
+    for (int i = 0; i < 1000; i++) {
+        long_keys.push_back("common_prefix" + to_string(i * 7919 % 1000));
+    }
+    for (size_t i = 0; i < long_keys.size(); i++) {
+        prefixed->insert(long_keys[i])->value = (int)i;
+    }
+    for (size_t i = 0; i < long_keys.size(); i++) {
+        assert(prefixed->find(long_keys[i])->value == (int)i);
+    }
+    assert(prefixed->find("common_prefix") == nullptr);
+    keys.clear();
+    prefixed->for_each([&](const Key& key, RecordInfo&) {
+        keys.push_back(key);
+        return true;
+    });
+    assert(keys.size() == long_keys.size());
+    if (prefixed->ordered()) {
+        assert(is_sorted(keys.begin(), keys.end()));
+    }
+}
+
+void test_index() {
+    check_index(Index::BPlusTree);
+    check_index(Index::Hash);
+
+    Scheduler scheduler = Scheduler();
+    DBOptions options;
+    options.index = Index::Hash;
+    unique_ptr<DataBase> db1(
+            new DataBase(&scheduler, dumpfilename, logfilename, options));
+    scheduler.add_tx(move(tx_basics1));
+    scheduler.start();
+    db1.reset();
+
+    unique_ptr<DataBase> db2(
+            new DataBase(&scheduler, dumpfilename, logfilename, options));
+    assert_value(db2.get(), "key1", 1);
+    assert_value(db2.get(), "key2", 2);
+}
+
+void test_checkpoint() {
+    Scheduler scheduler = Scheduler();
+    DBOptions options;
+    options.checkpoint_interval = chrono::milliseconds(0);  // manual
+    unique_ptr<DataBase> db1(
+            new DataBase(&scheduler, dumpfilename, logfilename, options));
+
+    scheduler.add_tx(move(tx_basics1));
+    scheduler.start();
+    assert(file_size(logfilename) > 0);
+    db1->checkpoint();
+    assert(file_size(logfilename) == 0);
+    assert(access((logfilename + ".old").c_str(), F_OK) != 0);
+
+    scheduler.add_tx([](Transaction* tx) {
+        tx->begin();
+        tx->set("key3", 3);
+        tx->commit();
+    });
+    scheduler.start();
+    db1.reset();
+
+    // the dump + the records after the checkpoint
+    unique_ptr<DataBase> db2(
+            new DataBase(&scheduler, dumpfilename, logfilename, options));
+    assert_value(db2.get(), "key1", 1);
+    assert_value(db2.get(), "key2", 2);
+    assert_value(db2.get(), "key3", 3);
+    db2.reset();
+
+    // crash in the middle of a checkpoint (after the log rotation)
+    rename(logfilename.c_str(), (logfilename + ".old").c_str());
+    unique_ptr<DataBase> db3(
+            new DataBase(&scheduler, dumpfilename, logfilename, options));
+    assert_value(db3.get(), "key3", 3);
+    assert(access((logfilename + ".old").c_str(), F_OK) != 0);
+    assert(file_size(logfilename) == 0);
+}
+
+void test_values() {
+    // inline and out-of-line strings
+    Value small("hello");
+    string blob(4096, '\0');
+    for (size_t i = 0; i < blob.size(); i++) {
+        blob[i] = (char)(i * 7);
+    }
+    Value large(blob);
+    assert(small.type() == Value::Bytes && small.as_bytes() == "hello");
+    assert(large.as_bytes() == blob && large.as_int() == 0);
+    assert(Value(42).as_int() == 42 && Value(42).as_bytes().empty());
+    assert(Value(42) == 42 && !(Value(42) == Value("42")));
+    assert(Value("42").to_string() == "42" && Value(-7).to_string() == "-7");
+    // copies share the bytes
+    Value copy = large;
+    assert(copy.as_bytes().data() == large.as_bytes().data());
+    large = small;
+    assert(copy.as_bytes() == blob && large == small);
+    // moved-from values are the int 0
+    Value moved = std::move(copy);
+    assert(moved.as_bytes() == blob);
+    assert(copy.is_int() && copy.as_int() == 0 && copy.to_string() == "0");
+    large = std::move(moved);
+    assert(moved == Value(0) && large.as_bytes() == blob);
+
+    for (CCProtocol protocol :
+         {TwoPhaseLocking, Optimistic, SerializationGraph}) {
+        init();
+        Scheduler scheduler = Scheduler();
+        DBOptions options;
+        options.protocol = protocol;
+        options.checkpoint_interval = chrono::milliseconds(0);
+        unique_ptr<DataBase> db1(
+                new DataBase(&scheduler, dumpfilename, logfilename, options));
+        scheduler.add_tx([&](Transaction* tx) {
+            tx->begin();
+            tx->set("int", 1);
+            tx->set("small", "abc");
+            tx->set("blob", blob);
+            tx->set("empty", "");
+            assert(tx->get("blob").value().as_bytes() == blob);
+            assert(tx->commit());
+        });
+        scheduler.start();
+        scheduler.add_tx([&](Transaction* tx) {
+            tx->begin();
+            assert(tx->get("small").value() == "abc");
+            assert(tx->get("blob").value().as_bytes() == blob);
+            tx->set("small", tx->get("small")->to_string() + "def");
+            assert(tx->commit());
+        });
+        scheduler.start();
+
+        // from the log
+        db1.reset();
+        unique_ptr<DataBase> db2(
+                new DataBase(&scheduler, dumpfilename, logfilename, options));
+        assert(db2->table->find("small")->value == "abcdef");
+        assert(db2->table->find("blob")->value.as_bytes() == blob);
+        assert(db2->table->find("empty")->value == "");
+        assert_value(db2.get(), "int", 1);
+
+        // from the snapshot
+        db2->checkpoint();
+        db2.reset();
+        unique_ptr<DataBase> db3(
+                new DataBase(&scheduler, dumpfilename, logfilename, options));
+        assert(db3->table->find("small")->value == "abcdef");
+        assert(db3->table->find("blob")->value.as_bytes() == blob);
+        assert(db3->table->find("empty")->value == "");
+        assert_value(db3.get(), "int", 1);
+    }
+}
+
+void test_scan() {
+    auto collect = [](Transaction::Scan it) {
+        vector<pair<Key, int>> v;
+        for (; it.valid(); it.next()) {
+            v.emplace_back(it.key(), it.value().as_int());
+        }
+        return v;
+    };
+    auto key = [](int i) {
+        char buf[16];
+        snprintf(buf, sizeof(buf), "k%03d", i);
+        return Key(buf);
+    };
+
+    for (CCProtocol protocol :
+         {TwoPhaseLocking, Optimistic, SerializationGraph}) {
+        for (Index::Type index : {Index::BPlusTree, Index::Hash}) {
+            init();
+            Scheduler scheduler = Scheduler();
+            DBOptions options;
+            options.protocol = protocol;
+            options.index = index;
+            options.checkpoint_interval = chrono::milliseconds(0);
+            DataBase db = DataBase(&scheduler, dumpfilename, logfilename, options);
+            scheduler.add_tx([&](Transaction* tx) {
+                tx->begin();
+                for (int i = 0; i < 200; i++) {
+                    tx->set(key(i), i);
+                }
+                tx->set("j", -1);
+                tx->set("l", -1);
+                tx->set("k050", 0);
+                tx->del("k050");
+                assert(tx->commit());
+            });
+            scheduler.start();
+
+            scheduler.add_tx([&](Transaction* tx) {
+                tx->begin();
+                auto v = collect(tx->scan("k010", "k020"));
+                assert(v.size() == 10 && v[0].first == "k010" && v[9].second == 19);
+                v = collect(tx->scan("k010", nullopt, 5));
+                assert(v.size() == 5 && v[4].first == "k014");
+                // deleted keys are skipped
+                v = collect(tx->prefix("k0"));
+                assert(v.size() == 99 && v[50].first == "k051");
+                v = collect(tx->prefix("k1"));
+                assert(v.size() == 100 && v.back() == make_pair(key(199), 199));
+                assert(collect(tx->scan("k", "k")).empty());
+                assert(collect(tx->prefix("m")).empty());
+
+                // the write set is merged
+                tx->set("k0105", 1000);
+                tx->set("k011", 1011);
+                tx->del("k012");
+                tx->set("k050", 50);
+                v = collect(tx->scan("k010", "k014"));
+                vector<pair<Key, int>> expected = {
+                    {"k010", 10}, {"k0105", 1000}, {"k011", 1011}, {"k013", 13}};
+                assert(v == expected);
+                assert(collect(tx->prefix("k0")).size() == 100);
+                assert(tx->commit());
+            });
+            scheduler.start();
+
+            scheduler.add_tx([&](Transaction* tx) {
+                tx->begin_read_only();
+                assert(collect(tx->prefix("k01")).size() == 10);
+                tx->commit();
+            });
+            scheduler.start();
+        }
+    }
+
+    // phantoms: an insert into the range scanned by another transaction
+    for (CCProtocol protocol :
+         {TwoPhaseLocking, Optimistic, SerializationGraph}) {
+        init();
+        Scheduler scheduler = Scheduler(Scheduler::RoundRobin);
+        DBOptions options;
+        options.protocol = protocol;
+        options.checkpoint_interval = chrono::milliseconds(0);
+        DataBase db = DataBase(&scheduler, dumpfilename, logfilename, options);
+        scheduler.add_tx([&](Transaction* tx) {
+            tx->begin();
+            for (int i = 0; i < 10; i++) {
+                tx->set(key(i), i);
+            }
+            tx->commit();
+        });
+        scheduler.start();
+
+        bool scanner_committed = false, inserter_committed = false;
+        size_t first = 0, second = 0;
+        scheduler.add_tx([&](Transaction* tx) {
+            tx->begin();
+            first = collect(tx->prefix("k00")).size();
+            tx->get(key(0));
+            tx->get(key(0));
+            second = collect(tx->prefix("k00")).size();
+            scanner_committed = tx->commit();
+        });
+        scheduler.add_tx([&](Transaction* tx) {
+            tx->begin();
+            while (first == 0) {  // (either may begin first)
+                tx->get(key(0));
+            }
+            tx->set("k0055", 1);
+            inserter_committed = tx->commit();
+        });
+        scheduler.start();
+        // 2PL: the younger inserter dies (wait-die).
+        // OCC: the insert commits first and the scanner fails validation.
+        // SGT: the second scan sees the insert, which closes a cycle.
+        assert(first == 10);
+        if (protocol == TwoPhaseLocking) {
+            assert(scanner_committed && !inserter_committed && second == 10);
+        } else {
+            assert(!scanner_committed && inserter_committed);
+        }
+    }
+
+    // 2PL: the younger scanner dies if the range has a pending insert
+    init();
+    Scheduler scheduler = Scheduler(Scheduler::RoundRobin);
+    DBOptions options;
+    options.checkpoint_interval = chrono::milliseconds(0);
+    DataBase db = DataBase(&scheduler, dumpfilename, logfilename, options);
+    bool inserted = false, inserter_committed = false, scanner_committed = true;
+    scheduler.add_tx([&](Transaction* tx) {
+        tx->begin();
+        tx->set("k005", 5);
+        inserted = true;
+        tx->get("k005");
+        inserter_committed = tx->commit();
+    });
+    scheduler.add_tx([&](Transaction* tx) {
+        tx->begin();
+        while (!inserted) {
+            tx->get("j");
+        }
+        assert(collect(tx->scan("k", "l")).empty());
+        scanner_committed = tx->commit();
+    });
+    scheduler.start();
+    assert(inserter_committed && !scanner_committed);
+    assert_value(&db, "k005", 5);
+}
+
+void test_snapshot() {
+    const int nkeys = 20000;  // spans multiple blocks
+    Scheduler scheduler = Scheduler();
+    DBOptions options;
+    options.checkpoint_interval = chrono::milliseconds(0);
+    unique_ptr<DataBase> db1(
+            new DataBase(&scheduler, dumpfilename, logfilename, options));
+    scheduler.add_tx([](Transaction* tx) {
+        tx->begin();
+        for (int i = 0; i < nkeys; i++) {
+            tx->set("key" + to_string(i), i);
+        }
+        tx->commit();
+    });
+    scheduler.start();
+    db1->checkpoint();
+    db1.reset();
+
+    unique_ptr<DataBase> db2(
+            new DataBase(&scheduler, dumpfilename, logfilename, options));
+    assert(db2->table->size() == nkeys);
+    for (int i = 0; i < nkeys; i++) {
+        assert_value(db2.get(), "key" + to_string(i), i);
+    }
+    db2.reset();
+
+    // flip a byte in the first block
+    FILE* fp = fopen(dumpfilename.c_str(), "r+");
+    fseek(fp, 4096 + 100, SEEK_SET);
+    int c = fgetc(fp);
+    fseek(fp, 4096 + 100, SEEK_SET);
+    fputc(c ^ 0xff, fp);
+    fclose(fp);
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        fclose(stderr);
+        DataBase db = DataBase(&scheduler, dumpfilename, logfilename, options);
+        exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) != 0);
+}
+
+void test_background_checkpoint() {
+    Scheduler scheduler = Scheduler();
+    DBOptions options;
+    options.checkpoint_interval = chrono::milliseconds(10);
+    unique_ptr<DataBase> db1(
+            new DataBase(&scheduler, dumpfilename, logfilename, options));
+
+    scheduler.add_tx(move(tx_basics1));
+    scheduler.start();
+    usleep(200 * 1000);
+    assert(file_size(logfilename) == 0);
+    db1.reset();
+
+    unique_ptr<DataBase> db2(
+            new DataBase(&scheduler, dumpfilename, logfilename, options));
+    assert_value(db2.get(), "key1", 1);
+    assert_value(db2.get(), "key2", 2);
+}
+
+void test_occ_validation() {
+    Scheduler scheduler = Scheduler(Scheduler::RoundRobin);
+    DBOptions options;
+    options.protocol = Optimistic;
+    DataBase db = DataBase(&scheduler, dumpfilename, logfilename, options);
+    scheduler.add_tx(move(tx_basics1));
+    scheduler.start();
+
+    // tx1 reads key1, which is overwritten by tx2 before tx1 commits
+    bool committed1 = true, committed2 = false;
+    scheduler.add_tx([&](Transaction* tx) {
+        tx->begin();
+        int x = tx->get("key1").value().as_int();
+        tx->set("key2", x + 100);
+        committed1 = tx->commit();
+    });
+    scheduler.add_tx([&](Transaction* tx) {
+        tx->begin();
+        tx->set("key1", 10);
+        committed2 = tx->commit();
+    });
+    scheduler.start();
+
+    assert(!committed1);
+    assert(committed2);
+    assert_value(&db, "key1", 10);
+    assert_value(&db, "key2", 2);
+}
+
+void test_occ() {
+    const int ntx = 16;
+    Scheduler scheduler = Scheduler(Scheduler::Concurrent);
+    DBOptions options;
+    options.protocol = Optimistic;
+    unique_ptr<DataBase> db1(
+            new DataBase(&scheduler, dumpfilename, logfilename, options));
+
+    // read-modify-write on the same key, retried until the commit succeeds
+    for (int n = 0; n < ntx; n++) {
+        scheduler.add_tx([](Transaction* tx) {
+            do {
+                tx->begin();
+                optional<Value> x = tx->get("counter");
+                tx->set("counter", x.value_or(0).as_int() + 1);
+                tx->del("garbage");
+            } while (!tx->commit());
+        });
+    }
+    scheduler.add_tx([](Transaction* tx) {
+        tx->begin();
+        tx->set("garbage", 1);
+        tx->commit();
+    });
+    scheduler.start();
+    assert_value(db1.get(), "counter", ntx);
+    db1.reset();
+
+    unique_ptr<DataBase> db2(
+            new DataBase(&scheduler, dumpfilename, logfilename, options));
+    assert_value(db2.get(), "counter", ntx);
+}
+
+void test_sgt() {
+    Scheduler scheduler = Scheduler(Scheduler::Coroutine);
+    DBOptions options;
+    options.protocol = SerializationGraph;
+    unique_ptr<DataBase> db1(
+            new DataBase(&scheduler, dumpfilename, logfilename, options));
+    // operations never wait, so two transactions are interleaved by hand
+    unique_ptr<Transaction> tx1 = db1->generate_tx(nullptr);
+    unique_ptr<Transaction> tx2 = db1->generate_tx(nullptr);
+    tx1->begin();
+    tx1->set("key1", 1);
+    tx1->set("key2", 2);
+    assert(tx1->commit());
+
+    // r1(key1) w2(key1) c2 w1(key2) c1 is serializable (1 -> 2), though
+    // OCC would abort tx1
+    tx1->begin();
+    int x = tx1->get("key1").value().as_int();
+    tx2->begin();
+    tx2->set("key1", 10);
+    assert(tx2->commit());
+    tx1->set("key2", x + 100);
+    assert(tx1->commit());
+    assert_value(db1.get(), "key1", 10);
+    assert_value(db1.get(), "key2", 101);
+
+    // r1(key1) w2(key1) w2(key2) c2 r1(key2): the read closes 1 -> 2 -> 1
+    tx1->begin();
+    tx1->get("key1");
+    tx2->begin();
+    tx2->set("key1", 20);
+    tx2->set("key2", 200);
+    assert(tx2->commit());
+    assert(!tx1->get("key2").has_value());
+    assert(!tx1->commit());
+
+    // write skew: r1(a) r2(b) w1(b) c1 w2(a) c2, whose commit closes the cycle
+    tx1->begin();
+    tx2->begin();
+    tx1->get("a");
+    tx2->get("b");
+    tx1->set("b", 1);
+    assert(tx1->commit());
+    tx2->set("a", 1);
+    assert(!tx2->commit());
+    assert_value(db1.get(), "a", 0);
+
+    // phantom: tx2 inserts into the range scanned by tx1 (1 -> 2) and tx1
+    // reads a write of tx2 (2 -> 1)
+    tx1->begin();
+    int n = 0;
+    for (auto it = tx1->prefix("key"); it.valid(); it.next()) {
+        n++;
+    }
+    assert(n == 2);
+    tx2->begin();
+    tx2->set("key3", 3);
+    tx2->set("c", 3);
+    assert(tx2->commit());
+    assert(!tx1->get("c").has_value());
+    assert(!tx1->commit());
+    assert(scheduler.serializability_violations() == 0);
+    tx1.reset();
+    tx2.reset();
+    db1.reset();
+
+    // read-modify-write on the same key, retried until the commit succeeds
+    const int ntx = 16;
+    Scheduler concurrent = Scheduler(Scheduler::Concurrent);
+    unique_ptr<DataBase> db2(
+            new DataBase(&concurrent, dumpfilename, logfilename, options));
+    for (int i = 0; i < ntx; i++) {
+        concurrent.add_tx([](Transaction* tx) {
+            do {
+                tx->begin();
+                optional<Value> x = tx->get("counter");
+                tx->set("counter", x.value_or(0).as_int() + 1);
+            } while (!tx->commit());
+        });
+    }
+    concurrent.start();
+    assert_value(db2.get(), "counter", ntx);
+    assert(concurrent.serializability_violations() == 0);
+    db2.reset();
+
+    unique_ptr<DataBase> db3(
+            new DataBase(&concurrent, dumpfilename, logfilename, options));
+    assert_value(db3.get(), "counter", ntx);
+    assert_value(db3.get(), "key1", 20);
+}
+
+void test_mvcc() {
+    Scheduler scheduler = Scheduler(Scheduler::RoundRobin);
+    DBOptions options;
+    options.checkpoint_interval = chrono::milliseconds(0);  // manual GC
+    DataBase db = DataBase(&scheduler, dumpfilename, logfilename, options);
+    scheduler.add_tx(move(tx_basics1));
+    scheduler.start();
+
+    // tx1 keeps reading its snapshot while tx2 updates and deletes keys
+    optional<Value> first, last, deleted;
+    vector<string> keys;
+    scheduler.add_tx([&](Transaction* tx) {
+        tx->begin_read_only();
+        first = tx->get("key1");
+        tx->get("key1");
+        tx->get("key1");
+        last = tx->get("key1");
+        deleted = tx->get("key2");
+        keys = tx->keys();
+        assert(tx->commit());
+    });
+    scheduler.add_tx([](Transaction* tx) {
+        tx->begin();
+        tx->set("key1", 10);
+        tx->del("key2");
+        tx->set("key3", 3);
+        tx->commit();
+    });
+    scheduler.start();
+
+    assert(first == 1 && last == 1);
+    assert(deleted == 2);
+    assert(keys.size() == 2);
+    assert_value(&db, "key1", 10);
+    assert_value(&db, "key2", 0);
+
+    // only the latest versions survive, and key2 is gone
+    assert(db.count_versions() > 3);
+    db.collect_garbage();
+    assert(db.count_versions() == 2);
+    assert(db.table->count("key2") == 0);
+}
+
+void test_mvcc_concurrent() {
+    const int naccounts = 8;
+    Scheduler scheduler = Scheduler(Scheduler::Concurrent);
+    DBOptions options;
+    options.protocol = Optimistic;
+    options.checkpoint_interval = chrono::milliseconds(1);
+    DataBase db = DataBase(&scheduler, dumpfilename, logfilename, options);
+    scheduler.add_tx([](Transaction* tx) {
+        tx->begin();
+        for (int i = 0; i < naccounts; i++) {
+            tx->set("account" + to_string(i), 100);
+        }
+        tx->commit();
+    });
+    scheduler.start();
+
+    // transfers keep the total, which every snapshot has to see
+    for (int n = 0; n < 8; n++) {
+        scheduler.add_tx([n](Transaction* tx) {
+            for (int i = 0; i < 50; i++) {
+                Key from = "account" + to_string((n + i) % naccounts);
+                Key to = "account" + to_string((n + i + 1) % naccounts);
+                do {
+                    tx->begin();
+                    int x = tx->get(from).value().as_int();
+                    int y = tx->get(to).value().as_int();
+                    tx->set(from, x - 1);
+                    tx->set(to, y + 1);
+                } while (!tx->commit());
+            }
+        });
+        scheduler.add_tx([](Transaction* tx) {
+            for (int i = 0; i < 50; i++) {
+                tx->begin_read_only();
+                int total = 0;
+                for (int j = 0; j < naccounts; j++) {
+                    total += tx->get("account" + to_string(j)).value().as_int();
+                }
+                assert(total == 100 * naccounts);
+                tx->commit();
+            }
+        });
+    }
+    scheduler.start();
+}
+
+void test_lock_manager() {
+    LockManager locks;
+    // IDs sharing a slot don't conflict
+    const uint32_t a = 1;
+    const uint32_t b = 1 + LockManager::kSlots;
+    const uint32_t c = 1 + 2 * LockManager::kSlots;
+    assert(locks.acquire(a, 1, Write, false, false) == Locked);
+    assert(locks.acquire(b, 5, Write, false, false) == Locked);
+    assert(locks.acquire(c, 6, Read, false, false) == Locked);
+    // the same ID does (wait-die)
+    assert(locks.acquire(b, 1, Read, false, false) == MustWait);
+    assert(locks.acquire(b, 7, Write, false, false) == MustDie);
+    assert(locks.acquire(c, 7, Read, false, false) == Locked);
+    assert(locks.acquire(c, 8, Write, false, false) == MustDie);
+    // the lock of |b| outlives the one of |a| in the slot
+    locks.release(a, Write);
+    assert(locks.acquire(b, 7, Read, false, false) == MustDie);
+    assert(locks.acquire(a, 2, Read, false, false) == Locked);
+    // an older transaction waits for it
+    thread waiter([&] {
+        assert(locks.acquire(b, 1, Write, false, true) == Locked);
+        locks.release(b, Write);
+    });
+    this_thread::sleep_for(chrono::milliseconds(10));
+    locks.release(b, Write);
+    waiter.join();
+    locks.release(a, Read);
+    locks.release(c, Read);
+    locks.release(c, Read);
+    assert(locks.acquire(b, 9, Write, false, false) == Locked);
+    locks.release(b, Write);
+
+    // the count of readers doesn't overflow into the other bits
+    const int nreaders = 0x3FFF;
+    for (int ts = 1; ts <= nreaders; ts++) {
+        assert(locks.acquire(a, ts, Read, false, false) == Locked);
+    }
+    assert(locks.acquire(a, 0, Read, false, false) == MustWait);
+    assert(locks.acquire(a, nreaders + 1, Read, false, false) == MustDie);
+    assert(locks.acquire(a, 0, Write, false, false) == MustWait);
+    for (int ts = 1; ts <= nreaders; ts++) {
+        locks.release(a, Read);
+    }
+    assert(locks.acquire(a, 0, Write, false, false) == Locked);
+    locks.release(a, Write);
+}
+
+void test_wait_die() {
+    Scheduler scheduler = Scheduler(Scheduler::RoundRobin);
+    DataBase db = DataBase(&scheduler, dumpfilename, logfilename);
+    scheduler.add_tx(move(tx_basics1));
+    scheduler.start();
+
+    // tx1 and tx2 lock the keys in the opposite order. The younger tx2 dies
+    // instead of deadlocking, and succeeds on retry.
+    bool committed1 = false;
+    vector<bool> committed2;
+    scheduler.add_tx([&](Transaction* tx) {
+        tx->begin();
+        tx->set("key1", 10);
+        tx->set("key2", 20);
+        committed1 = tx->commit();
+    });
+    scheduler.add_tx([&](Transaction* tx) {
+        bool ok;
+        do {
+            tx->begin();
+            int x = tx->get_until_success("key2").as_int();
+            tx->set("key1", x + 100);
+            committed2.push_back(ok = tx->commit());
+        } while (!ok);
+    });
+    scheduler.start();
+
+    assert(committed1);
+    assert((committed2 == vector<bool>{false, true}));
+    assert_value(&db, "key1", 120);
+    assert_value(&db, "key2", 20);
+}
+
+void test_deadlock() {
+    const int ntx = 16;
+    Scheduler scheduler = Scheduler(Scheduler::Concurrent);
+    DataBase db = DataBase(&scheduler, dumpfilename, logfilename);
+    scheduler.add_tx([](Transaction* tx) { tx_huge(0, tx); });
+    scheduler.start();
+
+    // half of the transactions lock the keys in the reverse order
+    for (int n = 0; n < ntx; n++) {
+        scheduler.add_tx([n](Transaction* tx) {
+            do {
+                tx->begin();
+                for (int i = 0; i < 100; i++) {
+                    int k = (n % 2 == 0) ? i : 99 - i;
+                    tx->set("key" + to_string(k), n + 1);
+                }
+            } while (!tx->commit());
+        });
+    }
+    scheduler.start();
+
+    int val = db.table->find("key0")->value.as_int();
+    assert(val > 0);
     for (int i = 0; i < 100; i++) {
         assert_value(&db, "key" + to_string(i), val);
     }
@@ -182,7 +1627,37 @@ int main()
     TEST(test_persistence);
     TEST(test_abort);
     TEST(test_recover);
+    TEST(test_torn_log);
+    TEST(test_text_log);
+    TEST(test_text_dump);
+    TEST(test_parallel_recovery);
     TEST(test_read_read_conflict);
+    TEST(test_lock_manager);
+    TEST(test_wait_die);
+    TEST(test_deadlock);
+    TEST(test_round_robin);
+    TEST(test_coroutine);
+    TEST(test_concurrent);
+    TEST(test_thread_pool);
+    TEST(test_conflict_graph);
+    TEST(test_history);
+    TEST(test_submit);
+    TEST(test_arena);
+    TEST(test_crc32c);
+    TEST(test_parser);
+    TEST(test_server);
+    TEST(test_group_commit);
+    TEST(test_index);
+    TEST(test_checkpoint);
+    TEST(test_snapshot);
+    TEST(test_values);
+    TEST(test_scan);
+    TEST(test_background_checkpoint);
+    TEST(test_occ_validation);
+    TEST(test_occ);
+    TEST(test_sgt);
+    TEST(test_mvcc);
+    TEST(test_mvcc_concurrent);
     // TEST(test_huge);
     init();
     return 0;
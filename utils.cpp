@@ -1,37 +1,17 @@
 #include "utils.h"
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <charconv>
+#include <cstring>
 
 #include <iostream>
 #include <fstream>
-using namespace std;
-
-vector<string> words(const string &str) {
-    vector<string> v;
-    int start_pos = 0;
-    bool in_word = false;
-
-    for (size_t i = 0; i < str.size(); i++) {
-        if (str[i] == ' ' || str[i] == '\n' || str[i] == '\t') {
-            if (!in_word)
-                continue;
-            in_word = false;
-            v.push_back(str.substr(start_pos, i - start_pos));
-            continue;
-        }
-
-        if (in_word)
-            continue;
 
-        in_word = true;
-        start_pos = i;
-    }
-
-    if (in_word) {
-        v.push_back(str.substr(start_pos, str.size() - start_pos));
-    }
-
-    return v;
-}
+#if defined(__x86_64__)
+#include <nmmintrin.h>  // _mm_crc32_*
+#endif
+using namespace std;
 
 // for debug
 void cat(string filename) {
@@ -41,41 +21,121 @@ void cat(string filename) {
         cout << str << endl;
 }
 
-Query parse_query(string input) {
+static bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// Cuts the next whitespace-separated token out of |rest|
+static string_view next_token(string_view* rest) {
+    size_t i = 0;
+    while (i < rest->size() && is_space((*rest)[i]))
+        i++;
+    size_t start = i;
+    while (i < rest->size() && !is_space((*rest)[i]))
+        i++;
+    string_view token = rest->substr(start, i - start);
+    rest->remove_prefix(i);
+    return token;
+}
+
+const char* describe(Query::Error error) {
+    switch (error) {
+        case Query::None:
+            return "no error";
+        case Query::Empty:
+            return "empty command";
+        case Query::UnknownCommand:
+            return "unknown command";
+        case Query::WrongArity:
+            return "wrong number of arguments";
+        case Query::BadInteger:
+            return "value is not an integer";
+    }
+    return "";
+}
+
+Query parse_query(string_view input) {
     Query q = Query();
-    vector<string> fields = words(input);
-
-    if (fields[0] == "set") {
-        assert(fields.size() == 3);
-        q.cmd = Query::Set;
-        q.arg1 = fields[1];
-        q.arg2 = stoi(fields[2]);
-    } else if (fields[0] == "get") {
-        assert(fields.size() == 2);
-        q.cmd = Query::Get;
-        q.arg1 = fields[1];
-    } else if (fields[0] == "del") {
-        assert(fields.size() == 2);
-        q.cmd = Query::Del;
-        q.arg1 = fields[1];
-    } else if (fields[0] == "begin") {
-        assert(fields.size() == 1);
-        q.cmd = Query::Begin;
-    } else if (fields[0] == "commit") {
-        assert(fields.size() == 1);
-        q.cmd = Query::Commit;
-    } else if (fields[0] == "abort") {
-        assert(fields.size() == 2);
-        q.cmd = Query::Abort;
-    } else if (fields[0] == "keys") {
-        assert(fields.size() == 1);
-        q.cmd = Query::Keys;
-    } else {
-        q.cmd = Query::Unknown;
+    q.text = input;
+    string_view rest = input;
+    string_view name = next_token(&rest);
+    if (name.empty()) {
+        q.error = Query::Empty;
+        return q;
+    }
+
+    static const struct {
+        string_view name;
+        Query::Commands cmd;
+        int nargs;
+    } kCommands[] = {
+        {"set", Query::Set, 2},
+        {"get", Query::Get, 1},
+        {"del", Query::Del, 1},
+        {"begin", Query::Begin, 0},
+        {"commit", Query::Commit, 0},
+        {"abort", Query::Abort, 0},
+        {"keys", Query::Keys, 0},
+    };
+    Query::Commands cmd = Query::Unknown;
+    int nargs = 0;
+    for (const auto& command : kCommands) {
+        if (name == command.name) {
+            cmd = command.cmd;
+            nargs = command.nargs;
+            break;
+        }
+    }
+    if (cmd == Query::Unknown) {
+        q.error = Query::UnknownCommand;
+        return q;
+    }
+
+    string_view args[2];
+    for (int i = 0; i < nargs; i++) {
+        args[i] = next_token(&rest);
+        if (args[i].empty()) {
+            q.error = Query::WrongArity;
+            return q;
+        }
+    }
+    if (!next_token(&rest).empty()) {
+        q.error = Query::WrongArity;
+        return q;
     }
+    if (cmd == Query::Set) {
+        string_view v = args[1];
+        size_t ndigits = (v[0] == '-') ? v.size() - 1 : v.size();
+        bool number = ndigits > 0 &&
+            v.find_first_not_of("0123456789", v.size() - ndigits) == string_view::npos;
+        if (number) {
+            auto [ptr, ec] = from_chars(v.data(), v.data() + v.size(), q.arg2);
+            if (ec != errc()) {
+                q.error = Query::BadInteger;
+                return q;
+            }
+        } else {
+            q.str = v;
+            q.is_str = true;
+        }
+    }
+    q.cmd = cmd;
+    q.arg1 = args[0];
     return q;
 }
 
+size_t parse_queries(string_view input, vector<Query>* queries) {
+    size_t start = 0;
+    size_t end;
+    while ((end = input.find('\n', start)) != string_view::npos) {
+        Query q = parse_query(input.substr(start, end - start));
+        start = end + 1;
+        if (q.error != Query::Empty)
+            queries->push_back(q);
+    }
+    return start;
+}
+
 
 static const unsigned int crc32tab[256] = {
     0x00000000, 0x77073096, 0xee0e612c, 0x990951ba,
@@ -145,13 +205,224 @@ static const unsigned int crc32tab[256] = {
 };
 
 
-unsigned int crc32(string str) {
+unsigned int crc32(const char* data, size_t len) {
     unsigned int crcinit = 0;
     unsigned int crc = 0;
 
     crc = crcinit ^ 0xFFFFFFFF;
-    for (size_t i = 0; i < str.size(); i++) {
-        crc = ((crc >> 8) & 0x00FFFFFF) ^ crc32tab[(crc ^ (str[i])) & 0xFF];
+    for (size_t i = 0; i < len; i++) {
+        crc = ((crc >> 8) & 0x00FFFFFF) ^ crc32tab[(crc ^ (data[i])) & 0xFF];
     }
     return crc ^ 0xFFFFFFFF;
 }
+
+// ----------------------------------- CRC32C ----------------------------------
+
+// kCrc32cTable[k][b] is the CRC of byte b followed by k zero bytes, so that
+// 8 bytes are folded with 8 independent lookups (slicing-by-8).
+static constexpr auto kCrc32cTable = []() {
+    const uint32_t kPoly = 0x82F63B78;  // reversed Castagnoli polynomial
+    array<array<uint32_t, 256>, 8> table = {};
+    for (uint32_t b = 0; b < 256; b++) {
+        uint32_t crc = b;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ (crc & 1 ? kPoly : 0);
+        }
+        table[0][b] = crc;
+    }
+    for (uint32_t b = 0; b < 256; b++) {
+        for (int k = 1; k < 8; k++) {
+            uint32_t prev = table[k - 1][b];
+            table[k][b] = (prev >> 8) ^ table[0][prev & 0xFF];
+        }
+    }
+    return table;
+}();
+
+uint32_t crc32c_slicing8(uint32_t crc, const char* data, size_t len) {
+    const auto& t = kCrc32cTable;
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+    crc = ~crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));  // (little endian)
+        word ^= crc;
+        crc = t[7][word & 0xFF] ^ t[6][(word >> 8) & 0xFF] ^
+              t[5][(word >> 16) & 0xFF] ^ t[4][(word >> 24) & 0xFF] ^
+              t[3][(word >> 32) & 0xFF] ^ t[2][(word >> 40) & 0xFF] ^
+              t[1][(word >> 48) & 0xFF] ^ t[0][word >> 56];
+    }
+    for (; len > 0; p++, len--) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xFF];
+    }
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const char* data, size_t len) {
+    uint64_t c = ~crc;
+    for (; len >= 8; data += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        c = _mm_crc32_u64(c, word);
+    }
+    uint32_t c32 = c;
+    for (; len > 0; data++, len--) {
+        c32 = _mm_crc32_u8(c32, *data);
+    }
+    return ~c32;
+}
+
+bool has_sse42() {
+    static const bool supported = __builtin_cpu_supports("sse4.2");
+    return supported;
+}
+#else
+uint32_t crc32c_sse42(uint32_t crc, const char* data, size_t len) {
+    return crc32c_slicing8(crc, data, len);
+}
+
+bool has_sse42() { return false; }
+#endif
+
+uint32_t crc32c_extend(uint32_t crc, const char* data, size_t len) {
+    // resolved on the first call
+    static const auto impl = has_sse42() ? crc32c_sse42 : crc32c_slicing8;
+    return impl(crc, data, len);
+}
+
+uint32_t crc32c(const char* data, size_t len) {
+    return crc32c_extend(0, data, len);
+}
+
+void Crc32c::update_zeros(size_t len) {
+    static const char zeros[64] = {};
+    for (; len > sizeof(zeros); len -= sizeof(zeros)) {
+        update(zeros, sizeof(zeros));
+    }
+    update(zeros, len);
+}
+
+// ----------------------------------- Arena -----------------------------------
+
+Arena::~Arena() {
+    for (size_t i = 1; i < chunks_.size(); i++) {
+        delete[] chunks_[i].data;
+    }
+}
+
+void Arena::reset() {
+    current_ = 0;
+    used_ = 0;
+}
+
+string_view Arena::copy(string_view s) {
+    char* p = static_cast<char*>(allocate(s.size() ? s.size() : 1, 1));
+    memcpy(p, s.data(), s.size());
+    return string_view(p, s.size());
+}
+
+void* Arena::do_allocate(size_t bytes, size_t align) {
+    while (true) {
+        Chunk& c = chunks_[current_];
+        size_t offset = (used_ + align - 1) & ~(align - 1);
+        if (offset + bytes <= c.size) {
+            used_ = offset + bytes;
+            return c.data + offset;
+        }
+        // Chunks kept by reset() are reused in order. One too small for
+        // this request is skipped (until the next reset()).
+        current_++;
+        used_ = 0;
+        if (current_ == chunks_.size()) {
+            size_t size = max(kChunkBytes, bytes + align);
+            chunks_.push_back({new char[size], size});
+        }
+    }
+}
+
+// -------------------------------- ThreadPool ---------------------------------
+
+ThreadPool::ThreadPool(size_t nworkers) {
+    for (size_t i = 0; i < nworkers; i++) {
+        workers_.push_back(make_unique<Worker>());
+    }
+    for (size_t i = 0; i < nworkers; i++) {
+        threads_.emplace_back(&ThreadPool::work, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        lock_guard<mutex> lock(mtx_);
+        stop_ = true;
+    }
+    work_cv_.notify_all();
+    for (auto& th : threads_) {
+        th.join();
+    }
+}
+
+void ThreadPool::submit(function<void()> task) {
+    // (counted first so that |nqueued_| never goes below zero)
+    npending_++;
+    nqueued_++;
+    Worker& worker = *workers_[next_++ % workers_.size()];
+    {
+        lock_guard<mutex> lock(worker.mtx);
+        worker.tasks.push_back(move(task));
+    }
+    // A worker counts itself in |nsleeping_| before it checks |nqueued_|
+    // (both seq_cst), so either it sees the task or it is seen here.
+    if (nsleeping_ > 0) {
+        lock_guard<mutex> lock(mtx_);
+        work_cv_.notify_one();
+    }
+}
+
+void ThreadPool::wait_idle() {
+    unique_lock<mutex> lock(mtx_);
+    idle_cv_.wait(lock, [this]{ return npending_ == 0; });
+}
+
+bool ThreadPool::pop(size_t id, function<void()>* task) {
+    for (size_t i = 0; i < workers_.size(); i++) {
+        Worker& worker = *workers_[(id + i) % workers_.size()];
+        lock_guard<mutex> lock(worker.mtx);
+        if (worker.tasks.empty())
+            continue;
+        if (i == 0) {
+            *task = move(worker.tasks.front());
+            worker.tasks.pop_front();
+        } else {
+            *task = move(worker.tasks.back());
+            worker.tasks.pop_back();
+        }
+        return true;
+    }
+    return false;
+}
+
+void ThreadPool::work(size_t id) {
+    while (true) {
+        function<void()> task;
+        if (pop(id, &task)) {
+            nqueued_--;
+            task();
+            task = nullptr;  // (frees the captures before wait_idle() returns)
+            if (--npending_ == 0) {
+                lock_guard<mutex> lock(mtx_);
+                idle_cv_.notify_all();
+            }
+            continue;
+        }
+
+        unique_lock<mutex> lock(mtx_);
+        nsleeping_++;
+        work_cv_.wait(lock, [this]{ return stop_ || nqueued_ > 0; });
+        nsleeping_--;
+        if (stop_ && nqueued_ == 0)
+            return;
+    }
+}
@@ -1,37 +1,106 @@
 #ifndef __UTILS_H__
 #define __UTILS_H__
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
 #include <queue>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
 using namespace std;
 
-vector<string> words(const string &str);
-
 // for debug
 void cat(string filename);
 
+// A command of the line protocol. |arg1| and |text| point into the input
+// given to the parser, so they are valid only while it is.
 class Query {
     public:
         enum Commands {
-            Set,
-            Get,
-            Del,
-            Begin,
-            Commit,
-            Abort,
-            Keys,
+            Set,     // set <key> <int or string>
+            Get,     // get <key>
+            Del,     // del <key>
+            Begin,   // begin
+            Commit,  // commit
+            Abort,   // abort
+            Keys,    // keys
             Unknown,
         };
+        enum Error {
+            None,
+            Empty,           // no command
+            UnknownCommand,
+            WrongArity,      // wrong number of arguments
+            BadInteger,      // not an int (or out of range)
+        };
         Commands cmd = Commands::Unknown;
-        string arg1 = "";
+        string_view arg1 = {};
+        // value of set: an int if it is a decimal number, a string otherwise
         int arg2 = 0;
+        string_view str = {};
+        bool is_str = false;
+        Error error = Error::None;  // cmd is Unknown unless None
+        string_view text = {};      // the whole command
+
+        bool ok() const { return error == None; }
 };
 
-Query parse_query(string input);
+// Message of |error| for clients
+const char* describe(Query::Error error);
+
+// Parses a command without allocating (tokens are string_views over
+// |input|). Errors are reported in Query::error.
+Query parse_query(string_view input);
+// Parses every complete (newline-terminated) line of |input| in one pass and
+// appends the commands to |queries|, skipping blank lines. Returns the
+// number of bytes consumed; an incomplete last line is left over.
+size_t parse_queries(string_view input, vector<Query>* queries);
+
+// CRC-32 (the polynomial of zlib), one byte at a time. Only for converting
+// the log of the former text format; use crc32c() instead.
+unsigned int crc32(const char* data, size_t len);
+
+// CRC-32C (Castagnoli) of the checksums of the log and the snapshot.
+// Uses the crc32 instruction of SSE4.2 if CPUID says the CPU has it and
+// slicing-by-8 tables otherwise.
+uint32_t crc32c(const char* data, size_t len);
+inline uint32_t crc32c(string_view data) {
+    return crc32c(data.data(), data.size());
+}
+// Incremental version: crc32c_extend(crc32c(a), b) == crc32c(a + b)
+uint32_t crc32c_extend(uint32_t crc, const char* data, size_t len);
+
+// Checksums a record given in pieces, e.g.
+//   Crc32c crc;
+//   crc.update(header, sizeof(header));
+//   crc.update(body);
+class Crc32c {
+    public:
+        void update(const void* data, size_t len) {
+            crc_ = crc32c_extend(crc_, static_cast<const char*>(data), len);
+        }
+        void update(string_view data) { update(data.data(), data.size()); }
+        // Same as update() with |len| zero bytes
+        void update_zeros(size_t len);
+        uint32_t value() const { return crc_; }
+
+    private:
+        uint32_t crc_ = 0;
+};
 
-unsigned int crc32(string str);
+// The implementations behind crc32c_extend() (for tests and benchmarks)
+uint32_t crc32c_slicing8(uint32_t crc, const char* data, size_t len);
+uint32_t crc32c_sse42(uint32_t crc, const char* data, size_t len);
+bool has_sse42();
 
 // https://stackoverflow.com/questions/1259099/stdqueue-iteration
 template<typename T, typename Container=std::deque<T> >
@@ -47,8 +116,193 @@ public:
     const_iterator end() const { return this->c.end(); }
 };
 
+// Fixed-size pool of worker threads with work stealing.
+// Each worker runs the tasks of its own deque from the front, and steals
+// from the back of the others' when its deque is empty.
+class ThreadPool {
+    public:
+        explicit ThreadPool(size_t nworkers);
+        ~ThreadPool();
+
+        // Queues |task| to the workers in round-robin order
+        void submit(function<void()> task);
+        // Blocks until every submitted task has finished
+        void wait_idle();
+        size_t size() const { return workers_.size(); }
+
+    private:
+        struct Worker {
+            mutex mtx;  // guards |tasks|
+            deque<function<void()>> tasks;
+        };
+
+        // Body of the |id|-th worker thread
+        void work(size_t id);
+        // Takes a task from the deque of |id| or steals one
+        bool pop(size_t id, function<void()>* task);
+
+        vector<unique_ptr<Worker>> workers_;
+        vector<thread> threads_;
+        atomic<size_t> next_ = 0;    // worker to queue the next task to
+        atomic<size_t> nqueued_ = 0; // tasks in the deques
+        atomic<size_t> npending_ = 0;  // tasks not finished yet
+        // Only parking and waking up take |mtx_|: a submitter notifies
+        // |work_cv_| only if some worker sleeps, and a worker notifies
+        // |idle_cv_| only when the last task finishes.
+        atomic<size_t> nsleeping_ = 0;  // workers waiting on |work_cv_|
+        mutex mtx_;
+        condition_variable work_cv_; // idle workers wait for tasks
+        condition_variable idle_cv_; // wait_idle() waits for the tasks
+        bool stop_ = false;          // (guarded by |mtx_|)
+};
+
+// Unbounded lock-free queue with multiple producers and a single consumer
+// (Vyukov's MPSC queue). push() is wait-free; pop() may miss an element
+// whose push() hasn't finished yet.
+template<typename T>
+class MPSCQueue {
+    public:
+        MPSCQueue() : head_(new Node()), tail_(head_) {}
+        ~MPSCQueue() {
+            while (head_) {
+                Node* next = head_->next.load();
+                delete head_;
+                head_ = next;
+            }
+        }
+        MPSCQueue(const MPSCQueue&) = delete;
+        MPSCQueue& operator=(const MPSCQueue&) = delete;
+
+        // Thread-safe
+        void push(T value) {
+            Node* node = new Node();
+            node->value = move(value);
+            Node* prev = tail_.exchange(node, memory_order_acq_rel);
+            prev->next.store(node, memory_order_release);
+        }
+        // Only one thread may call this at a time.
+        // Returns false if the queue is empty.
+        bool pop(T* value) {
+            Node* next = head_->next.load(memory_order_acquire);
+            if (!next)
+                return false;
+            *value = move(next->value);
+            delete head_;
+            head_ = next;  // |next| becomes the dummy node
+            return true;
+        }
+        // Only by the thread calling pop()
+        bool empty() const {
+            return !head_->next.load(memory_order_acquire);
+        }
+
+    private:
+        struct Node {
+            atomic<Node*> next = nullptr;
+            T value = {};
+        };
+
+        Node* head_;  // dummy node; the consumer pops its successor
+        alignas(64) atomic<Node*> tail_;  // producers append after this
+};
+
+// Bump allocator for the state of a transaction (see Transaction::arena).
+// Deallocation is a no-op, and reset() rewinds the arena without freeing
+// its chunks, so a reused transaction doesn't call the allocator again.
+// The first chunk is embedded. Not thread-safe.
+class Arena : public pmr::memory_resource {
+    public:
+        Arena() { chunks_.push_back({inline_, sizeof(inline_)}); }
+        ~Arena() override;
+        Arena(const Arena&) = delete;
+        Arena& operator=(const Arena&) = delete;
+
+        // Frees everything allocated at once (the memory is kept)
+        void reset();
+        // Copies |s| into the arena
+        string_view copy(string_view s);
+        // number of chunks obtained from the allocator (for testing)
+        size_t nchunks() const { return chunks_.size() - 1; }
+
+    private:
+        struct Chunk {
+            char* data;
+            size_t size;
+        };
+        static const size_t kChunkBytes = 64 * 1024;
+
+        void* do_allocate(size_t bytes, size_t align) override;
+        void do_deallocate(void*, size_t, size_t) override {}
+        bool do_is_equal(const pmr::memory_resource& other) const noexcept override {
+            return this == &other;
+        }
+
+        alignas(max_align_t) char inline_[2048];
+        vector<Chunk> chunks_;  // chunks_[0] is |inline_|
+        size_t current_ = 0;    // chunk being filled
+        size_t used_ = 0;       // bytes used in the current chunk
+};
+
+// Map from uint32_t to small values in a flat open-addressing table
+// (linear probing). clear() keeps the capacity. Iterates in insertion order.
+template<typename V>
+class FlatMap {
+    public:
+        // Returns nullptr if |key| is not in the map
+        V* find(uint32_t key) {
+            if (slots_.empty())
+                return nullptr;
+            size_t mask = slots_.size() - 1;
+            for (size_t i = hash_of(key) & mask; slots_[i] != 0;
+                 i = (i + 1) & mask) {
+                if (entries_[slots_[i] - 1].first == key)
+                    return &entries_[slots_[i] - 1].second;
+            }
+            return nullptr;
+        }
+        // |key| must not be in the map
+        void insert(uint32_t key, V value) {
+            if ((entries_.size() + 1) * 2 > slots_.size())
+                grow();
+            entries_.emplace_back(key, value);
+            place(entries_.size() - 1);
+        }
+        size_t size() const { return entries_.size(); }
+        bool empty() const { return entries_.empty(); }
+        void clear() {
+            entries_.clear();
+            fill(slots_.begin(), slots_.end(), 0);
+        }
+
+        auto begin() const { return entries_.begin(); }
+        auto end() const { return entries_.end(); }
+
+    private:
+        static size_t hash_of(uint32_t key) {
+            return (key * 0x9E3779B97F4A7C15ull) >> 32;
+        }
+        void place(size_t index) {
+            size_t mask = slots_.size() - 1;
+            size_t i = hash_of(entries_[index].first) & mask;
+            while (slots_[i] != 0) {
+                i = (i + 1) & mask;
+            }
+            slots_[i] = index + 1;
+        }
+        void grow() {
+            slots_.assign(max<size_t>(16, slots_.size() * 2), 0);
+            for (size_t k = 0; k < entries_.size(); k++) {
+                place(k);
+            }
+        }
+
+        vector<pair<uint32_t, V>> entries_;
+        // 1 + the index in |entries_| (0: empty); the size is a power of two
+        vector<uint32_t> slots_;
+};
+
 template<typename T>
-bool vexists(vector<T> vec, T key) {
+bool vexists(const vector<T>& vec, const T& key) {
     return count(vec.begin(), vec.end(), key) > 0;
 }
 
@@ -0,0 +1,125 @@
+#include "value.h"
+
+#include <mutex>
+#include <new>
+#include <vector>
+
+using namespace std;
+
+// Blocks of strings are allocated from slabs by size class. Class c holds
+// blocks of kMinBlockBytes << c bytes (header included), which are carved
+// out of kSlabBytes slabs and recycled through a free list. Slabs are
+// never returned to the system. Blocks larger than every class are
+// allocated with new.
+static const size_t kMinBlockBytes = 32;
+static const uint32_t kNumClasses = 9;  // up to 8KB
+static const size_t kSlabBytes = 64 * 1024;
+
+struct SizeClass {
+    mutex mtx;  // guards |free|
+    vector<void*> free;
+};
+static SizeClass size_classes[kNumClasses];
+
+static void* allocate_block(size_t size, uint32_t* size_class) {
+    uint32_t c = 0;
+    while (c < kNumClasses && (kMinBlockBytes << c) < size) {
+        c++;
+    }
+    *size_class = c;
+    if (c == kNumClasses)
+        return ::operator new(size);
+
+    SizeClass& sc = size_classes[c];
+    lock_guard<mutex> lock(sc.mtx);
+    if (sc.free.empty()) {
+        size_t block_bytes = kMinBlockBytes << c;
+        char* slab = static_cast<char*>(::operator new(kSlabBytes));
+        for (size_t off = 0; off + block_bytes <= kSlabBytes; off += block_bytes) {
+            sc.free.push_back(slab + off);
+        }
+    }
+    void* block = sc.free.back();
+    sc.free.pop_back();
+    return block;
+}
+
+static void free_block(void* block, uint32_t size_class) {
+    if (size_class == kNumClasses) {
+        ::operator delete(block);
+        return;
+    }
+    SizeClass& sc = size_classes[size_class];
+    lock_guard<mutex> lock(sc.mtx);
+    sc.free.push_back(block);
+}
+
+Value::Value(string_view bytes) : type_(Bytes) {
+    if (bytes.size() <= kInlineBytes) {
+        memcpy(rep_, bytes.data(), bytes.size());
+        len_ = bytes.size();
+        return;
+    }
+    uint32_t size_class;
+    void* mem = allocate_block(sizeof(Block) + bytes.size(), &size_class);
+    Block* b = new (mem) Block();
+    b->refs.store(1, memory_order_relaxed);
+    b->len = bytes.size();
+    b->size_class = size_class;
+    memcpy(b->data(), bytes.data(), bytes.size());
+    memcpy(rep_, &b, sizeof(b));
+    len_ = kHeap;
+}
+
+Value::Value(const Value& other) : len_(other.len_), type_(other.type_) {
+    memcpy(rep_, other.rep_, kInlineBytes);
+    if (type_ == Bytes && len_ == kHeap)
+        block()->refs.fetch_add(1, memory_order_relaxed);
+}
+
+Value::Value(Value&& other) noexcept : len_(other.len_), type_(other.type_) {
+    memcpy(rep_, other.rep_, kInlineBytes);
+    other.reset();
+}
+
+Value& Value::operator=(const Value& other) {
+    if (this != &other)
+        *this = Value(other);
+    return *this;
+}
+
+Value& Value::operator=(Value&& other) noexcept {
+    if (this == &other)
+        return *this;
+    release();
+    memcpy(rep_, other.rep_, kInlineBytes);
+    len_ = other.len_;
+    type_ = other.type_;
+    other.reset();
+    return *this;
+}
+
+void Value::release() {
+    if (type_ != Bytes || len_ != kHeap)
+        return;
+    Block* b = block();
+    if (b->refs.fetch_sub(1, memory_order_acq_rel) != 1)
+        return;
+    uint32_t size_class = b->size_class;
+    b->~Block();
+    free_block(b, size_class);
+}
+
+string Value::to_string() const {
+    if (is_int())
+        return std::to_string(as_int());
+    return string(as_bytes());
+}
+
+bool Value::operator==(const Value& other) const {
+    if (type_ != other.type_)
+        return false;
+    if (is_int())
+        return as_int() == other.as_int();
+    return as_bytes() == other.as_bytes();
+}
@@ -0,0 +1,89 @@
+#ifndef __VALUE_H__
+#define __VALUE_H__
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+using namespace std;
+
+// Value of a record: an int or a byte string (text or binary data).
+// A string of up to kInlineBytes is stored in the Value itself. A longer
+// one lives in an immutable reference-counted block allocated from a slab
+// (see value.cpp), so copying a Value (e.g. returning it from get()) never
+// copies the bytes.
+class Value {
+    public:
+        enum Type : uint8_t {
+            Int,
+            Bytes,
+        };
+        static const size_t kInlineBytes = 14;
+
+        Value() : Value(0) {}
+        Value(int v) : len_(0), type_(Int) { memcpy(rep_, &v, sizeof(v)); }
+        Value(string_view bytes);
+        Value(const char* bytes) : Value(string_view(bytes)) {}
+        Value(const string& bytes) : Value(string_view(bytes)) {}
+
+        Value(const Value& other);
+        Value(Value&& other) noexcept;
+        Value& operator=(const Value& other);
+        Value& operator=(Value&& other) noexcept;
+        ~Value() { release(); }
+
+        Type type() const { return type_; }
+        bool is_int() const { return type_ == Int; }
+        // 0 for a string
+        int as_int() const {
+            int v = 0;
+            if (is_int())
+                memcpy(&v, rep_, sizeof(v));
+            return v;
+        }
+        // empty for an int
+        string_view as_bytes() const {
+            if (is_int())
+                return {};
+            if (len_ == kHeap)
+                return string_view(block()->data(), block()->len);
+            return string_view(rep_, len_);
+        }
+        // The int in decimal, or the string itself
+        string to_string() const;
+
+        bool operator==(const Value& other) const;
+
+    private:
+        // Header of an out-of-line string, followed by the bytes
+        struct Block {
+            atomic<uint32_t> refs;
+            uint32_t len;
+            uint32_t size_class;  // index of the slab (see value.cpp)
+
+            char* data() { return reinterpret_cast<char*>(this + 1); }
+        };
+        static const uint8_t kHeap = 0xFF;  // |len_| of an out-of-line string
+
+        Block* block() const {
+            Block* b;
+            memcpy(&b, rep_, sizeof(b));
+            return b;
+        }
+        void release();
+        // moved-from は int の 0 に戻す
+        void reset() {
+            memset(rep_, 0, kInlineBytes);
+            len_ = 0;
+            type_ = Int;
+        }
+
+        // the int, the inline string or the Block* (16 bytes in total)
+        alignas(8) char rep_[kInlineBytes] = {};
+        uint8_t len_;  // length of the inline string, or kHeap
+        Type type_;
+};
+
+#endif  // __VALUE_H__